@@ -0,0 +1,418 @@
+#include "server.h"
+#include "histogram.h"
+#include <errno.h>
+
+// Micro-benchmark for the database layer. Builds a database in a temporary
+// directory through init_database(), seeds it with users, messages and
+// shared locations, then calls the database functions directly, one at a
+// time, for a fixed time each from one thread and from several at once.
+// There is no HTTP, JSON or event loop in the way, so a change to indexes,
+// statements or the connection pool shows up here on its own.
+//
+// Users and messages are seeded with plain inserts in one transaction on a
+// connection of our own; going through create_user() and save_message()
+// would spend most of the run committing. Locations go through
+// update_user_location() so the in-memory store sees them.
+
+typedef enum {
+    OP_CREATE_USER,
+    OP_AUTHENTICATE_USER,
+    OP_SAVE_MESSAGE,
+    OP_GET_USER_BY_ID,
+    OP_GET_USER_MESSAGES,
+    OP_GET_USER_LOCATIONS,
+    OP_COUNT
+} op_t;
+
+static const char* const op_names[OP_COUNT] = {
+    [OP_CREATE_USER] = "create_user",
+    [OP_AUTHENTICATE_USER] = "authenticate_user",
+    [OP_SAVE_MESSAGE] = "save_message",
+    [OP_GET_USER_BY_ID] = "get_user_by_id",
+    [OP_GET_USER_MESSAGES] = "get_user_messages",
+    [OP_GET_USER_LOCATIONS] = "get_user_locations",
+};
+
+#define MAX_THREAD_COUNTS 16
+#define SEED_PASSWORD "benchpass"
+
+typedef struct {
+    int users;
+    int messages;
+    int locations;
+    int thread_counts[MAX_THREAD_COUNTS];
+    int thread_count_count;
+    int duration_s;
+    int enabled[OP_COUNT];
+    int keep;
+} options_t;
+
+typedef struct {
+    op_t op;
+    int index;
+    uint64_t rng;
+    int created;
+    histogram_t histogram;
+} worker_t;
+
+static options_t options;
+static int first_user_id;   // seeded users are first_user_id .. first_user_id + users - 1
+static pthread_barrier_t start_line;
+
+// The database layer wakes long-poll waiters and times request phases for
+// the server; neither has anything to do here
+void long_poll_notify(int user_id, int message_id) {
+    (void)user_id;
+    (void)message_id;
+}
+
+void metrics_add_phase(metrics_phase_t phase, uint64_t ns) {
+    (void)phase;
+    (void)ns;
+}
+
+static uint64_t next_random(uint64_t* state) {
+    // xorshift64*
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+static int random_user(uint64_t* rng) {
+    return first_user_id + (int)(next_random(rng) % (uint64_t)options.users);
+}
+
+static int exec_sql(sqlite3* db, const char* sql) {
+    char* err_msg = NULL;
+    if (sqlite3_exec(db, sql, NULL, NULL, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        return -1;
+    }
+    return 0;
+}
+
+static int seed_users(sqlite3* db) {
+    char hash[HASH_SIZE];
+    hash_password(SEED_PASSWORD, hash);
+
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(db, "INSERT INTO users (username, email, password_hash) VALUES (?, ?, ?);",
+                           -1, &stmt, NULL) != SQLITE_OK) {
+        return -1;
+    }
+
+    int rc = 0;
+    for (int i = 0; i < options.users && rc == 0; i++) {
+        char username[50];
+        char email[100];
+        snprintf(username, sizeof(username), "seed%d", i);
+        snprintf(email, sizeof(email), "seed%d@bench.local", i);
+        sqlite3_bind_text(stmt, 1, username, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 2, email, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 3, hash, -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+            rc = -1;
+        } else if (i == 0) {
+            first_user_id = (int)sqlite3_last_insert_rowid(db);
+        }
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+    return rc;
+}
+
+static int seed_messages(sqlite3* db, uint64_t* rng) {
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(db,
+                           "INSERT INTO messages (sender_id, receiver_id, content, timestamp) VALUES (?, ?, ?, ?);",
+                           -1, &stmt, NULL) != SQLITE_OK) {
+        return -1;
+    }
+
+    time_t now = time(NULL);
+    int rc = 0;
+    for (int i = 0; i < options.messages && rc == 0; i++) {
+        char content[64];
+        snprintf(content, sizeof(content), "seed message %d", i);
+        sqlite3_bind_int(stmt, 1, random_user(rng));
+        sqlite3_bind_int(stmt, 2, random_user(rng));
+        sqlite3_bind_text(stmt, 3, content, -1, SQLITE_TRANSIENT);
+        // Spread over the last 30 days, oldest first like real traffic
+        sqlite3_bind_int64(stmt, 4, now - 30 * 86400 + (time_t)((int64_t)i * 30 * 86400 / options.messages));
+        if (sqlite3_step(stmt) != SQLITE_DONE) rc = -1;
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+    return rc;
+}
+
+static int seed(void) {
+    sqlite3* db;
+    if (sqlite3_open(DB_FILE, &db) != SQLITE_OK) {
+        fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    sqlite3_busy_timeout(db, DB_BUSY_TIMEOUT_MS);
+
+    uint64_t rng = 0x9e3779b97f4a7c15ULL;
+    uint64_t start = monotonic_ns();
+    int rc = exec_sql(db, "PRAGMA synchronous = OFF;") < 0 ||
+             exec_sql(db, "BEGIN;") < 0 ||
+             seed_users(db) < 0 ||
+             seed_messages(db, &rng) < 0 ||
+             exec_sql(db, "COMMIT;") < 0 ? -1 : 0;
+    if (rc < 0) {
+        fprintf(stderr, "Seeding failed: %s\n", sqlite3_errmsg(db));
+    } else {
+        exec_sql(db, "ANALYZE;");
+    }
+    sqlite3_close(db);
+    if (rc < 0) return -1;
+
+    printf("Seeded %d users and %d messages in %.1f s\n",
+           options.users, options.messages, (double)(monotonic_ns() - start) / 1e9);
+
+    start = monotonic_ns();
+    for (int i = 0; i < options.locations; i++) {
+        double lat = (double)(next_random(&rng) % 1800000) / 10000.0 - 90.0;
+        double lng = (double)(next_random(&rng) % 3600000) / 10000.0 - 180.0;
+        if (update_user_location(first_user_id + i, lat, lng, MAX_LOCATION_DURATION) < 0) {
+            fprintf(stderr, "Seeding location %d failed\n", i);
+            return -1;
+        }
+    }
+    printf("Shared %d locations in %.1f s\n",
+           options.locations, (double)(monotonic_ns() - start) / 1e9);
+    return 0;
+}
+
+static int run_op(worker_t* w) {
+    switch (w->op) {
+    case OP_CREATE_USER: {
+        char username[50];
+        char email[100];
+        snprintf(username, sizeof(username), "new%d_%d", w->index, w->created);
+        snprintf(email, sizeof(email), "new%d_%d@bench.local", w->index, w->created);
+        w->created++;
+        return create_user(username, email, SEED_PASSWORD, USER_REGULAR) < 0 ? -1 : 0;
+    }
+    case OP_AUTHENTICATE_USER: {
+        char username[50];
+        snprintf(username, sizeof(username), "seed%d", random_user(&w->rng) - first_user_id);
+        user_t* user = authenticate_user(username, SEED_PASSWORD);
+        if (!user) return -1;
+        free(user);
+        return 0;
+    }
+    case OP_SAVE_MESSAGE: {
+        message_t msg = {0};
+        msg.sender_id = random_user(&w->rng);
+        msg.receiver_id = random_user(&w->rng);
+        snprintf(msg.content, sizeof(msg.content), "bench message from thread %d", w->index);
+        msg.timestamp = time(NULL);
+        return save_message(&msg) < 0 ? -1 : 0;
+    }
+    case OP_GET_USER_BY_ID: {
+        user_t* user = get_user_by_id(random_user(&w->rng));
+        if (!user) return -1;
+        free(user);
+        return 0;
+    }
+    case OP_GET_USER_MESSAGES: {
+        message_t* messages;
+        int count;
+        if (get_user_messages(random_user(&w->rng), 0, MESSAGE_PAGE_SIZE, &messages, &count) < 0) return -1;
+        free(messages);
+        return 0;
+    }
+    case OP_GET_USER_LOCATIONS: {
+        user_t* users;
+        int count;
+        if (get_user_locations(&users, &count) < 0) return -1;
+        free(users);
+        return 0;
+    }
+    default:
+        return -1;
+    }
+}
+
+static void* worker_main(void* arg) {
+    worker_t* w = arg;
+    pthread_barrier_wait(&start_line);
+
+    uint64_t now = monotonic_ns();
+    uint64_t end_ns = now + (uint64_t)options.duration_s * 1000000000ULL;
+    while (now < end_ns) {
+        int failed = run_op(w) < 0;
+        uint64_t done = monotonic_ns();
+        histogram_record(&w->histogram, done - now, failed);
+        now = done;
+    }
+    return NULL;
+}
+
+static int run_case(op_t op, int threads) {
+    worker_t* workers = calloc((size_t)threads, sizeof(worker_t));
+    pthread_t* ids = calloc((size_t)threads, sizeof(pthread_t));
+    if (!workers || !ids) {
+        free(workers);
+        free(ids);
+        return -1;
+    }
+
+    static int runs = 0; // keeps create_user names apart between cases
+    runs++;
+
+    pthread_barrier_init(&start_line, NULL, (unsigned)threads);
+    for (int i = 0; i < threads; i++) {
+        workers[i].op = op;
+        workers[i].index = runs * 10000 + i;
+        workers[i].rng = 0x9e3779b97f4a7c15ULL * (uint64_t)(i + 1) ^ (uint64_t)runs;
+        if (pthread_create(&ids[i], NULL, worker_main, &workers[i]) != 0) {
+            perror("Failed to start benchmark thread");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < threads; i++) pthread_join(ids[i], NULL);
+    pthread_barrier_destroy(&start_line);
+
+    histogram_t total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < threads; i++) histogram_merge(&total, &workers[i].histogram);
+    printf("%-20s %7d %10llu %7llu %11.1f %9.1f %9.1f %9.1f %9.1f\n",
+           op_names[op], threads, (unsigned long long)total.count, (unsigned long long)total.errors,
+           (double)total.count / options.duration_s,
+           histogram_quantile(&total, 0.5) / 1e3, histogram_quantile(&total, 0.99) / 1e3,
+           histogram_quantile(&total, 0.999) / 1e3, total.max_ns / 1e3);
+    fflush(stdout);
+
+    free(workers);
+    free(ids);
+    return 0;
+}
+
+static int parse_thread_counts(const char* list) {
+    options.thread_count_count = 0;
+    const char* p = list;
+    while (*p) {
+        char* end;
+        long threads = strtol(p, &end, 10);
+        if (end == p || threads < 1 || options.thread_count_count == MAX_THREAD_COUNTS) return -1;
+        if (*end && *end != ',') return -1;
+        options.thread_counts[options.thread_count_count++] = (int)threads;
+        p = *end ? end + 1 : end;
+    }
+    return options.thread_count_count > 0 ? 0 : -1;
+}
+
+static int parse_ops(const char* list) {
+    memset(options.enabled, 0, sizeof(options.enabled));
+    char* copy = strdup(list);
+    if (!copy) return -1;
+    int rc = 0;
+    char* saveptr = NULL;
+    for (char* name = strtok_r(copy, ",", &saveptr); name && rc == 0; name = strtok_r(NULL, ",", &saveptr)) {
+        int op = 0;
+        while (op < OP_COUNT && strcmp(op_names[op], name) != 0) op++;
+        if (op == OP_COUNT) {
+            rc = -1;
+        } else {
+            options.enabled[op] = 1;
+        }
+    }
+    free(copy);
+    return rc;
+}
+
+static void usage(const char* program) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -u USERS      users to seed (default 1000000)\n"
+        "  -m MESSAGES   messages to seed (default 2000000)\n"
+        "  -l LOCATIONS  shared locations to seed (default 10000)\n"
+        "  -t THREADS    comma separated thread counts to run each operation with (default 1,4,16)\n"
+        "  -d SECONDS    how long each operation runs per thread count (default 3)\n"
+        "  -o OPS        comma separated operations to run (default all)\n"
+        "  -k            keep the database directory\n"
+        "Operations:",
+        program);
+    for (int op = 0; op < OP_COUNT; op++) fprintf(stderr, " %s", op_names[op]);
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char* argv[]) {
+    options.users = 1000000;
+    options.messages = 2000000;
+    options.locations = 10000;
+    options.duration_s = 3;
+    parse_thread_counts("1,4,16");
+    for (int op = 0; op < OP_COUNT; op++) options.enabled[op] = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "u:m:l:t:d:o:kh")) != -1) {
+        switch (opt) {
+        case 'u': options.users = atoi(optarg); break;
+        case 'm': options.messages = atoi(optarg); break;
+        case 'l': options.locations = atoi(optarg); break;
+        case 'd': options.duration_s = atoi(optarg); break;
+        case 'k': options.keep = 1; break;
+        case 't':
+            if (parse_thread_counts(optarg) < 0) {
+                fprintf(stderr, "Invalid thread counts: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'o':
+            if (parse_ops(optarg) < 0) {
+                fprintf(stderr, "Invalid operations: %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (options.users < 2 || options.messages < 0 || options.duration_s < 1 ||
+        options.locations < 0 || options.locations > options.users) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // DB_FILE is relative, so the whole database lives in the directory
+    char dir[] = "/tmp/hubbergram-db-bench-XXXXXX";
+    if (!mkdtemp(dir) || chdir(dir) < 0) {
+        perror("Failed to create database directory");
+        return 1;
+    }
+    printf("Database in %s\n", dir);
+
+    if (init_database() < 0 || seed() < 0) {
+        fprintf(stderr, "Database setup failed\n");
+        return 1;
+    }
+
+    printf("\n%-20s %7s %10s %7s %11s %9s %9s %9s %9s\n",
+           "operation", "threads", "ops", "errors", "ops/s", "p50 us", "p99 us", "p999 us", "max us");
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (!options.enabled[op]) continue;
+        for (int i = 0; i < options.thread_count_count; i++) {
+            if (run_case((op_t)op, options.thread_counts[i]) < 0) {
+                fprintf(stderr, "Out of memory\n");
+                return 1;
+            }
+        }
+    }
+
+    if (!options.keep) {
+        // Background threads still hold the files open; unlinking is enough
+        unlink(DB_FILE);
+        unlink(DB_FILE "-wal");
+        unlink(DB_FILE "-shm");
+        if (rmdir(dir) < 0 && errno != ENOENT) perror("Failed to remove database directory");
+    }
+    return 0;
+}
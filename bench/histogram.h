@@ -0,0 +1,67 @@
+#ifndef BENCH_HISTOGRAM_H
+#define BENCH_HISTOGRAM_H
+
+#include <stdint.h>
+
+// Latency histogram shared by the benchmarks: log-linear buckets with 16
+// steps per power of two, so any quantile is read to within about 6%.
+// Each thread fills its own and they are merged for the report.
+
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define MAX_EXPONENT 40 // about 18 minutes in nanoseconds
+#define HISTOGRAM_BUCKETS ((MAX_EXPONENT - SUB_BUCKET_BITS + 2) * SUB_BUCKETS)
+
+typedef struct {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t max_ns;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+static inline int histogram_bucket_of(uint64_t ns) {
+    if (ns < SUB_BUCKETS) return (int)ns;
+    int exponent = 63 - __builtin_clzll(ns);
+    if (exponent > MAX_EXPONENT) return HISTOGRAM_BUCKETS - 1;
+    int sub = (int)(ns >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+    return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+// Highest value that lands in the bucket
+static inline uint64_t histogram_bucket_limit(int index) {
+    if (index < SUB_BUCKETS) return (uint64_t)index;
+    int exponent = index / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+    uint64_t width = 1ULL << (exponent - SUB_BUCKET_BITS);
+    return (uint64_t)(SUB_BUCKETS + index % SUB_BUCKETS) * width + width - 1;
+}
+
+static inline void histogram_record(histogram_t* h, uint64_t ns, int failed) {
+    h->count++;
+    if (failed) h->errors++;
+    if (ns > h->max_ns) h->max_ns = ns;
+    h->buckets[histogram_bucket_of(ns)]++;
+}
+
+static inline uint64_t histogram_quantile(const histogram_t* h, double q) {
+    if (h->count == 0) return 0;
+    uint64_t rank = (uint64_t)(q * (double)h->count);
+    if (rank >= h->count) rank = h->count - 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > rank) {
+            uint64_t limit = histogram_bucket_limit(i);
+            return limit < h->max_ns ? limit : h->max_ns;
+        }
+    }
+    return h->max_ns;
+}
+
+static inline void histogram_merge(histogram_t* into, const histogram_t* from) {
+    into->count += from->count;
+    into->errors += from->errors;
+    if (from->max_ns > into->max_ns) into->max_ns = from->max_ns;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) into->buckets[i] += from->buckets[i];
+}
+
+#endif
@@ -0,0 +1,485 @@
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "histogram.h"
+
+// Load generator for a running server. Every thread drives one connection
+// with a weighted mix of register, login, send, get-messages and
+// update-location requests, either over a kept-alive connection or a fresh
+// one per request, for a fixed time and optionally at a fixed total rate.
+//
+// With a rate set, requests are sent on a schedule and their latency is
+// measured from when they were due rather than when they went out, so a
+// stalled server is charged for the requests it held up as well. Latencies
+// go into per-thread histograms that are merged at the end.
+
+#define REQUEST_SIZE 4096
+#define RESPONSE_INITIAL_SIZE 65536
+
+typedef enum {
+    OP_REGISTER,
+    OP_LOGIN,
+    OP_SEND,
+    OP_MESSAGES,
+    OP_LOCATION,
+    OP_COUNT
+} op_t;
+
+static const char* const op_names[OP_COUNT] = {
+    [OP_REGISTER] = "register",
+    [OP_LOGIN] = "login",
+    [OP_SEND] = "send",
+    [OP_MESSAGES] = "messages",
+    [OP_LOCATION] = "location",
+};
+
+typedef struct {
+    struct sockaddr_in server;
+    int threads;
+    int duration_s;
+    double rate;          // requests per second over all threads, 0 = as fast as possible
+    int keep_alive;
+    int weights[OP_COUNT];
+    int weight_total;
+    unsigned run_id;      // keeps usernames apart between runs on one database
+} options_t;
+
+typedef struct {
+    int index;
+    int fd;
+    uint64_t rng;
+    int registered;       // extra users created by the register op
+    int messages_sent;
+    char username[64];
+    char token[256];
+    char* response;
+    size_t response_cap;
+    size_t response_len;  // bytes of the current response read so far
+    int status;
+    int closed;           // the server announced it closes the connection
+    histogram_t histograms[OP_COUNT];
+} worker_t;
+
+static options_t options;
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t deadline_ns) {
+    struct timespec ts = {
+        .tv_sec = (time_t)(deadline_ns / 1000000000ULL),
+        .tv_nsec = (long)(deadline_ns % 1000000000ULL),
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+static uint64_t next_random(worker_t* w) {
+    // xorshift64*
+    w->rng ^= w->rng >> 12;
+    w->rng ^= w->rng << 25;
+    w->rng ^= w->rng >> 27;
+    return w->rng * 2685821657736338717ULL;
+}
+
+static void disconnect(worker_t* w) {
+    if (w->fd >= 0) close(w->fd);
+    w->fd = -1;
+    w->response_len = 0;
+    w->closed = 0;
+}
+
+static int connect_server(worker_t* w) {
+    w->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (w->fd < 0) return -1;
+    int one = 1;
+    setsockopt(w->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(w->fd, (struct sockaddr*)&options.server, sizeof(options.server)) < 0) {
+        disconnect(w);
+        return -1;
+    }
+    return 0;
+}
+
+static int send_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += sent;
+        len -= (size_t)sent;
+    }
+    return 0;
+}
+
+// Reads one response into w->response, leaving the body after the headers.
+// Returns the body offset, or -1 if the connection failed.
+static long read_response(worker_t* w) {
+    size_t head_len = 0;
+    size_t body_len = 0;
+    long body_start = -1;
+
+    for (;;) {
+        if (body_start < 0) {
+            char* end = w->response_len >= 4 ? memmem(w->response, w->response_len, "\r\n\r\n", 4) : NULL;
+            if (end) {
+                *end = '\0';
+                head_len = (size_t)(end - w->response);
+                body_start = (long)head_len + 4;
+                if (sscanf(w->response, "HTTP/1.%*d %d", &w->status) != 1) return -1;
+                const char* length = strcasestr(w->response, "\r\nContent-Length:");
+                body_len = length ? strtoul(length + 17, NULL, 10) : 0;
+                w->closed = strcasestr(w->response, "\r\nConnection: close") != NULL;
+            }
+        }
+        if (body_start >= 0 && w->response_len >= (size_t)body_start + body_len) break;
+
+        if (w->response_len + 1 >= w->response_cap) {
+            size_t cap = w->response_cap * 2;
+            char* grown = realloc(w->response, cap);
+            if (!grown) return -1;
+            w->response = grown;
+            w->response_cap = cap;
+        }
+        ssize_t got = recv(w->fd, w->response + w->response_len, w->response_cap - w->response_len - 1, 0);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return -1;
+        w->response_len += (size_t)got;
+    }
+
+    // The server answers one request at a time, so nothing follows the body
+    w->response[body_start + body_len] = '\0';
+    w->response_len = 0;
+    return body_start;
+}
+
+// Sends a request and waits for its response; returns the body, or NULL
+// if the request could not be completed
+static const char* call(worker_t* w, const char* method, const char* path, const char* body) {
+    char request[REQUEST_SIZE];
+    size_t body_len = body ? strlen(body) : 0;
+    int len = snprintf(request, sizeof(request),
+        "%s %s HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "%s%s%s"
+        "%s"
+        "Content-Type: application/json\r\n"
+        "Content-Length: %zu\r\n"
+        "\r\n%s",
+        method, path,
+        w->token[0] ? "Authorization: Bearer " : "", w->token, w->token[0] ? "\r\n" : "",
+        options.keep_alive ? "" : "Connection: close\r\n",
+        body_len, body ? body : "");
+    if (len < 0 || len >= (int)sizeof(request)) return NULL;
+
+    // A kept-alive connection the server dropped gets one retry on a new one
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int reused = w->fd >= 0;
+        if (!reused && connect_server(w) < 0) return NULL;
+
+        long body_start = -1;
+        if (send_all(w->fd, request, (size_t)len) == 0) body_start = read_response(w);
+        if (body_start < 0) {
+            disconnect(w);
+            if (reused) continue;
+            return NULL;
+        }
+
+        if (!options.keep_alive || w->closed) disconnect(w);
+        return w->response + body_start;
+    }
+    return NULL;
+}
+
+static int ok(worker_t* w, const char* body) {
+    return body && w->status >= 200 && w->status < 300;
+}
+
+static int register_user(worker_t* w, const char* username) {
+    char body[256];
+    snprintf(body, sizeof(body),
+             "{\"username\":\"%s\",\"email\":\"%s@bench.local\",\"password\":\"benchpass\"}",
+             username, username);
+    return ok(w, call(w, "POST", "/api/register", body)) ? 0 : -1;
+}
+
+static int login(worker_t* w) {
+    char body[256];
+    snprintf(body, sizeof(body), "{\"username\":\"%s\",\"password\":\"benchpass\"}", w->username);
+
+    w->token[0] = '\0';
+    const char* response = call(w, "POST", "/api/login", body);
+    if (!ok(w, response)) return -1;
+
+    const char* token = strstr(response, "\"token\"");
+    if (!token) return -1;
+    token = strchr(token + 7, '"');
+    if (!token) return -1;
+    token++;
+    const char* end = strchr(token, '"');
+    if (!end || end - token >= (long)sizeof(w->token)) return -1;
+    memcpy(w->token, token, (size_t)(end - token));
+    w->token[end - token] = '\0';
+    return 0;
+}
+
+static void user_name(char* out, size_t size, int thread, int extra) {
+    if (extra < 0) {
+        snprintf(out, size, "bench%u_%d", options.run_id, thread);
+    } else {
+        snprintf(out, size, "bench%u_%d_%d", options.run_id, thread, extra);
+    }
+}
+
+static op_t pick_op(worker_t* w) {
+    int roll = (int)(next_random(w) % (uint64_t)options.weight_total);
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (roll < options.weights[op]) return (op_t)op;
+        roll -= options.weights[op];
+    }
+    return OP_SEND;
+}
+
+static int run_op(worker_t* w, op_t op) {
+    char body[512];
+    char name[64];
+
+    switch (op) {
+    case OP_REGISTER: {
+        // Registering is anonymous; the thread's own login is kept
+        char token[sizeof(w->token)];
+        strcpy(token, w->token);
+        w->token[0] = '\0';
+        user_name(name, sizeof(name), w->index, w->registered++);
+        int rc = register_user(w, name);
+        strcpy(w->token, token);
+        return rc;
+    }
+    case OP_LOGIN:
+        return login(w);
+    case OP_SEND: {
+        user_name(name, sizeof(name), (w->index + 1) % options.threads, -1);
+        snprintf(body, sizeof(body),
+                 "{\"target_username\":\"%s\",\"content\":\"bench message %d from %s\"}",
+                 name, w->messages_sent++, w->username);
+        return ok(w, call(w, "POST", "/api/message", body)) ? 0 : -1;
+    }
+    case OP_MESSAGES:
+        return ok(w, call(w, "GET", "/api/messages?limit=20", NULL)) ? 0 : -1;
+    case OP_LOCATION: {
+        double lat = (double)(next_random(w) % 1800000) / 10000.0 - 90.0;
+        double lng = (double)(next_random(w) % 3600000) / 10000.0 - 180.0;
+        snprintf(body, sizeof(body),
+                 "{\"latitude\":%.4f,\"longitude\":%.4f,\"consent\":true,\"duration\":60}", lat, lng);
+        return ok(w, call(w, "POST", "/api/location", body)) ? 0 : -1;
+    }
+    default:
+        return -1;
+    }
+}
+
+static pthread_barrier_t ready;
+static uint64_t started_ns;
+
+static void* worker_main(void* arg) {
+    worker_t* w = arg;
+    int setup_ok = register_user(w, w->username) == 0 && login(w) == 0;
+    if (!setup_ok) {
+        fprintf(stderr, "Thread %d could not register and log in as %s (status %d)\n",
+                w->index, w->username, w->status);
+    }
+
+    // Everyone starts together, after every target user exists; main sets
+    // started_ns between the two waits
+    pthread_barrier_wait(&ready);
+    pthread_barrier_wait(&ready);
+    if (!setup_ok) return NULL;
+
+    uint64_t end_ns = started_ns + (uint64_t)options.duration_s * 1000000000ULL;
+    uint64_t interval_ns = options.rate > 0
+        ? (uint64_t)(1e9 * options.threads / options.rate)
+        : 0;
+    // Spread the threads over one interval instead of firing in step
+    uint64_t due_ns = started_ns + interval_ns * (uint64_t)w->index / (uint64_t)options.threads;
+
+    for (;;) {
+        if (interval_ns) {
+            if (due_ns >= end_ns) break;
+            if (monotonic_ns() < due_ns) sleep_until(due_ns);
+        } else {
+            due_ns = monotonic_ns();
+            if (due_ns >= end_ns) break;
+        }
+
+        op_t op = pick_op(w);
+        int failed = run_op(w, op) < 0;
+        histogram_record(&w->histograms[op], monotonic_ns() - due_ns, failed);
+        due_ns += interval_ns;
+    }
+
+    disconnect(w);
+    return NULL;
+}
+
+static int parse_mix(const char* mix) {
+    memset(options.weights, 0, sizeof(options.weights));
+    options.weight_total = 0;
+
+    char* copy = strdup(mix);
+    if (!copy) return -1;
+    int rc = 0;
+    char* saveptr = NULL;
+    for (char* part = strtok_r(copy, ",", &saveptr); part; part = strtok_r(NULL, ",", &saveptr)) {
+        char* equals = strchr(part, '=');
+        if (!equals) {
+            rc = -1;
+            break;
+        }
+        *equals = '\0';
+        int op = 0;
+        while (op < OP_COUNT && strcmp(op_names[op], part) != 0) op++;
+        int weight = atoi(equals + 1);
+        if (op == OP_COUNT || weight < 0) {
+            rc = -1;
+            break;
+        }
+        options.weights[op] = weight;
+        options.weight_total += weight;
+    }
+    free(copy);
+    return rc == 0 && options.weight_total > 0 ? 0 : -1;
+}
+
+static void usage(const char* program) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -a ADDRESS   server address (default 127.0.0.1)\n"
+        "  -p PORT      server port (default %d)\n"
+        "  -c THREADS   concurrent connections (default 16)\n"
+        "  -d SECONDS   how long to run (default 10)\n"
+        "  -r RATE      total requests per second, 0 = as fast as possible (default 0)\n"
+        "  -n           open a new connection for every request\n"
+        "  -m MIX       request weights (default register=1,login=4,send=40,messages=40,location=15)\n",
+        program, SERVER_PORT);
+}
+
+static void print_row(const char* name, const histogram_t* h, double seconds) {
+    printf("%-10s %10llu %8llu %10.1f %9.3f %9.3f %9.3f %9.3f\n",
+           name, (unsigned long long)h->count, (unsigned long long)h->errors,
+           (double)h->count / seconds,
+           histogram_quantile(h, 0.5) / 1e6, histogram_quantile(h, 0.99) / 1e6,
+           histogram_quantile(h, 0.999) / 1e6, h->max_ns / 1e6);
+}
+
+int main(int argc, char* argv[]) {
+    const char* address = "127.0.0.1";
+    int port = SERVER_PORT;
+    options.threads = 16;
+    options.duration_s = 10;
+    options.keep_alive = 1;
+    parse_mix("register=1,login=4,send=40,messages=40,location=15");
+
+    int opt;
+    while ((opt = getopt(argc, argv, "a:p:c:d:r:nm:h")) != -1) {
+        switch (opt) {
+        case 'a': address = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'c': options.threads = atoi(optarg); break;
+        case 'd': options.duration_s = atoi(optarg); break;
+        case 'r': options.rate = atof(optarg); break;
+        case 'n': options.keep_alive = 0; break;
+        case 'm':
+            if (parse_mix(optarg) < 0) {
+                fprintf(stderr, "Invalid mix: %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (options.threads < 1 || options.duration_s < 1 || options.rate < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    options.server.sin_family = AF_INET;
+    options.server.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, address, &options.server.sin_addr) != 1) {
+        fprintf(stderr, "Invalid address: %s\n", address);
+        return 1;
+    }
+    options.run_id = (unsigned)time(NULL) ^ ((unsigned)getpid() << 16);
+
+    worker_t* workers = calloc((size_t)options.threads, sizeof(worker_t));
+    pthread_t* threads = calloc((size_t)options.threads, sizeof(pthread_t));
+    if (!workers || !threads) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    printf("%d connections (%s) for %d s against %s:%d, %s\n",
+           options.threads, options.keep_alive ? "keep-alive" : "new per request",
+           options.duration_s, address, port,
+           options.rate > 0 ? "at a fixed rate" : "as fast as possible");
+    if (options.rate > 0) printf("Target rate: %.1f requests/s\n", options.rate);
+
+    pthread_barrier_init(&ready, NULL, (unsigned)options.threads + 1);
+    for (int i = 0; i < options.threads; i++) {
+        worker_t* w = &workers[i];
+        w->index = i;
+        w->fd = -1;
+        w->rng = 0x9e3779b97f4a7c15ULL * (uint64_t)(i + 1) ^ options.run_id;
+        w->response_cap = RESPONSE_INITIAL_SIZE;
+        w->response = malloc(w->response_cap);
+        user_name(w->username, sizeof(w->username), i, -1);
+        if (!w->response || pthread_create(&threads[i], NULL, worker_main, w) != 0) {
+            fprintf(stderr, "Failed to start thread %d\n", i);
+            return 1;
+        }
+    }
+
+    pthread_barrier_wait(&ready);
+    started_ns = monotonic_ns();
+    pthread_barrier_wait(&ready);
+
+    for (int i = 0; i < options.threads; i++) pthread_join(threads[i], NULL);
+    double seconds = (double)(monotonic_ns() - started_ns) / 1e9;
+
+    histogram_t totals[OP_COUNT + 1];
+    memset(totals, 0, sizeof(totals));
+    for (int i = 0; i < options.threads; i++) {
+        for (int op = 0; op < OP_COUNT; op++) {
+            histogram_merge(&totals[op], &workers[i].histograms[op]);
+            histogram_merge(&totals[OP_COUNT], &workers[i].histograms[op]);
+        }
+        free(workers[i].response);
+    }
+
+    printf("\n%-10s %10s %8s %10s %9s %9s %9s %9s\n",
+           "endpoint", "requests", "errors", "req/s", "p50 ms", "p99 ms", "p999 ms", "max ms");
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (options.weights[op] > 0) print_row(op_names[op], &totals[op], seconds);
+    }
+    print_row("total", &totals[OP_COUNT], seconds);
+
+    free(workers);
+    free(threads);
+    return totals[OP_COUNT].count > 0 ? 0 : 1;
+}
@@ -17,8 +17,12 @@ if [ -f "$DB_FILE" ]; then
         # Create backup directory
         mkdir -p "$BACKUP_DIR"
         
-        # Backup current database
-        cp "$DB_FILE" "$BACKUP_DIR/telegram_clone_backup_$(date +%Y%m%d_%H%M%S).db"
+        # Backup current database (with its write-ahead log, if any)
+        BACKUP_FILE="$BACKUP_DIR/telegram_clone_backup_$(date +%Y%m%d_%H%M%S).db"
+        cp "$DB_FILE" "$BACKUP_FILE"
+        if [ -f "$DB_FILE-wal" ]; then
+            cp "$DB_FILE-wal" "$BACKUP_FILE-wal"
+        fi
         echo "✓ Database backed up to $BACKUP_DIR/"
         
         # Test database access with old key
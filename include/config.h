@@ -3,13 +3,32 @@
 
 // Server Configuration
 #define SERVER_PORT 8080
-#define MAX_CONNECTIONS 100
+#define MAX_CONNECTIONS 65536
+#define LISTEN_BACKLOG 1024
+#define EVENT_LOOP_MAX_EVENTS 256
 #define BUFFER_SIZE 4096
+#define MAX_REQUEST_SIZE (64 * 1024) // headers + body of a single request
+#define WORKER_THREADS 0             // request handler threads, 0 = one per core
+#define WORKER_QUEUE_SIZE 4096       // pending requests before answering 503
 #define MAX_MESSAGE_SIZE 2048
-#define MAX_MEDIA_SIZE (2 * 1024 * 1024 * 1024) // 2GB
+#define MESSAGE_PAGE_SIZE 50         // default messages per history page
+#define MESSAGE_PAGE_MAX 200
+#define MESSAGE_SEARCH_PAGE_SIZE 20  // default results per search page
+#define MESSAGE_SEARCH_PAGE_MAX 100
+#define MESSAGE_SEARCH_MAX_OFFSET 1000 // deepest result a search pages to
+#define MESSAGE_SEARCH_MAX_LENGTH 256  // longest search text read
+#define MESSAGE_SEARCH_MAX_TERMS 16    // words of a search used
+#define LONG_POLL_TIMEOUT_MS 25000   // how long /api/messages/wait holds a request
+#define LONG_POLL_BUCKETS 4096       // waiter table size, power of two
+#define MAX_MEDIA_SIZE (2LL * 1024 * 1024 * 1024) // 2GB
+#define MEDIA_DIR "media"            // uploaded files, named by their SHA-256
+#define UPLOAD_CHUNK_SIZE (64 * 1024) // bytes read from the socket at a time
+#define UPLOAD_TURN_SIZE (1024 * 1024) // bytes one worker turn takes before yielding
 
 // Security Configuration
 #define TOKEN_EXPIRY_HOURS 24
+#define TOKEN_CACHE_SIZE 256         // verified tokens remembered per worker, power of two
+#define TOKEN_CACHE_MAX_LEN 96       // longer tokens are verified every time
 #define MAX_LOGIN_ATTEMPTS 5
 #define PASSWORD_MIN_LENGTH 6
 
@@ -17,6 +36,12 @@
 #define DEFAULT_LOCATION_DURATION 60 // minutes
 #define MIN_LOCATION_DURATION 15     // minutes
 #define MAX_LOCATION_DURATION 480    // minutes (8 hours)
+#define LOCATION_QUERY_LIMIT 1000    // most rows a bounding box query returns
+#define LOCATION_NEAREST_DEFAULT 50  // rows of a radius query without a limit
+#define LOCATION_NEAREST_MAX 500     // most rows a radius query may ask for
+#define LOCATION_WRITE_BEHIND 1      // absorb updates in memory, see location_store.c
+#define LOCATION_FLUSH_INTERVAL_MS 1000 // how often buffered updates are written
+#define LOCATION_STORE_BUCKETS 4096  // stored locations by user id, power of two
 
 // Database Security
 #define DB_ENCRYPTION 1
@@ -25,17 +50,32 @@
 // Database Configuration
 #define DB_FILE "telegram_clone.db"
 #define DB_BACKUP_INTERVAL 3600 // seconds
+#define DB_READER_CONNECTIONS 0     // read-only connections, 0 = one per core
+#define DB_SYNCHRONOUS "FULL"       // sync every commit; message writes share commits
+#define DB_CACHE_SIZE_KB 16384      // page cache per connection
+#define DB_MMAP_SIZE (256LL * 1024 * 1024)
+#define DB_BUSY_TIMEOUT_MS 5000
+#define MESSAGE_BATCH_WINDOW_US 500 // how long a message waits for others to share its commit, under load
+#define MESSAGE_BATCH_MAX 256       // messages per commit
+#define USER_CACHE_CAPACITY 16384   // cached user rows, 0 disables the cache
+#define USER_CACHE_SHARDS 16
+
+// WebSocket Configuration
+#define WEBSOCKET_MAX_FRAME_SIZE 4096      // largest frame accepted from a client
+#define WEBSOCKET_REGISTRY_BUCKETS 4096    // open sockets by user id, power of two
 
 // Privacy Settings
 #define REQUIRE_LOCATION_CONSENT 1
 #define AUTO_DELETE_EXPIRED_LOCATIONS 1
+#define LOCATION_EXPIRY_BUCKETS 4096       // scheduled expiries by user id, power of two
 #define LOG_ADMIN_ACTIONS 1
 
 // Feature Flags
-#define ENABLE_FILE_UPLOAD 0
+#define ENABLE_FILE_UPLOAD 1
 #define ENABLE_GROUP_CHAT 1
+#define GROUP_UNREAD_MAX 1000       // unread counts in the group list stop here
 #define ENABLE_MESSAGE_ENCRYPTION 0
-#define ENABLE_WEBSOCKET 0
+#define ENABLE_WEBSOCKET 1
 
 // Logging Configuration
 #define LOG_LEVEL_DEBUG 0
@@ -48,5 +88,9 @@
 // Rate Limiting
 #define RATE_LIMIT_REQUESTS_PER_MINUTE 60
 #define RATE_LIMIT_MESSAGES_PER_MINUTE 30
+#ifndef RATE_LIMIT_CLIENTS // `make bench` builds its server with -DRATE_LIMIT_CLIENTS=0
+#define RATE_LIMIT_CLIENTS 65536 // tracked users and addresses, 0 disables limiting
+#endif
+#define RATE_LIMIT_SHARDS 64
 
 #endif
\ No newline at end of file
@@ -0,0 +1,79 @@
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include <stddef.h>
+
+#define HTTP_MAX_HEADERS 32
+#define HTTP_MAX_HEADER_SIZE 8192
+
+typedef enum {
+    HTTP_PARSE_REQUEST_LINE = 0,
+    HTTP_PARSE_HEADERS,
+    HTTP_PARSE_BODY,
+    HTTP_PARSE_CHUNK_SIZE,
+    HTTP_PARSE_CHUNK_DATA,
+    HTTP_PARSE_CHUNK_DATA_END,
+    HTTP_PARSE_TRAILERS,
+    HTTP_PARSE_DONE
+} http_parse_state_t;
+
+// Incremental request parser. It works on a buffer that holds the request
+// from its first byte and may grow between calls; everything is tracked as
+// offsets so the buffer can be reallocated. Chunked bodies are decoded in
+// place, directly after the header block. A Content-Length body larger than
+// MAX_REQUEST_SIZE completes the request at the end of its headers and is
+// left for the handler to stream (see connection_stream_body).
+typedef struct {
+    http_parse_state_t state;
+    size_t pos;            // next byte to examine
+    size_t line_start;
+    size_t request_start;
+    size_t headers_start;
+    size_t headers_end;
+    size_t body_start;
+    size_t body_len;
+    size_t body_remaining; // of a body too large to buffer, left on the socket
+    size_t chunk_remaining;
+    size_t total_len;      // bytes the finished request occupies
+    long content_length;
+    int header_count;
+    int version_minor;
+    int chunked;
+    int keep_alive;
+    int expect_continue;
+} http_parser_t;
+
+typedef struct {
+    const char* name;
+    const char* value;
+} http_header_t;
+
+// Pointer view of a parsed request. Strings point into the connection
+// buffer, which the parser NUL-terminates in place.
+typedef struct {
+    const char* method;
+    const char* path;
+    const char* query;     // empty string when the target has none
+    int version_minor;
+    http_header_t headers[HTTP_MAX_HEADERS];
+    int header_count;
+    char* body;
+    size_t body_len;
+    size_t body_remaining; // bytes of a large body still to be streamed in
+    int keep_alive;
+} http_request_t;
+
+void http_parser_reset(http_parser_t* parser);
+
+// Returns 1 when a full request is available, 0 when more bytes are needed,
+// or a negative HTTP status (e.g. -400, -413) describing why it was rejected.
+int http_parser_execute(http_parser_t* parser, char* buf, size_t len);
+
+// Fills in a view of a completed request. Must be called at most once per
+// request since it terminates the request line and headers in place.
+// Returns 0, or -1 if the request is not what http_parser_execute accepted.
+int http_parser_get_request(const http_parser_t* parser, char* buf, http_request_t* request);
+
+const char* http_request_header(const http_request_t* request, const char* name);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef JSON_READER_H
+#define JSON_READER_H
+
+#include <stddef.h>
+
+typedef enum {
+    JSON_FIELD_STRING = 0,
+    JSON_FIELD_NUMBER,
+    JSON_FIELD_BOOL
+} json_field_type_t;
+
+// One known key of a flat request object. name and type are set by the
+// caller; the rest is filled in by the reader. Strings point into the
+// parsed text, which is unescaped and NUL-terminated in place.
+typedef struct {
+    const char* name;
+    json_field_type_t type;
+    int present;           // given with a non-null value
+    const char* string;
+    double number;
+    int boolean;
+    size_t raw_start;      // offset and length of the encoded string
+    size_t raw_len;
+    int escaped;
+} json_field_t;
+
+#define JSON_FIELD(name, type) { (name), (type), 0, NULL, 0.0, 0, 0, 0, 0 }
+
+// Pulls the known fields out of a flat JSON object without allocating.
+// Unknown keys with scalar values are skipped. Returns 0 on success, or -1
+// if the text is anything else (nested values, a known key with a value of
+// the wrong type, invalid JSON); text is only modified on success, so the
+// caller can hand it to a full parser instead.
+int json_read_fields(char* text, size_t len, json_field_t* fields, int count);
+
+#endif
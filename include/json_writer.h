@@ -0,0 +1,41 @@
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <stddef.h>
+
+#define JSON_WRITER_INITIAL_SIZE 4096
+
+// Appends JSON text straight into one growable buffer, so a response costs
+// a single pass over the rows and a handful of reallocs instead of a heap
+// object per field. Separators are tracked with one flag: containers and
+// keys reset it, values set it. Allocation failures are sticky and
+// reported by json_writer_finish().
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+    int need_comma;
+    int failed;
+} json_writer_t;
+
+void json_writer_init(json_writer_t* w, size_t initial_size);
+void json_writer_free(json_writer_t* w);
+
+// Returns 0 and leaves the buffer in w->data/w->len, or -1 if any append
+// ran out of memory (the buffer is freed in that case).
+int json_writer_finish(json_writer_t* w);
+
+void json_writer_begin_object(json_writer_t* w);
+void json_writer_end_object(json_writer_t* w);
+void json_writer_begin_array(json_writer_t* w);
+void json_writer_end_array(json_writer_t* w);
+void json_writer_key(json_writer_t* w, const char* key);
+
+void json_writer_string(json_writer_t* w, const char* value);
+void json_writer_string_len(json_writer_t* w, const char* value, size_t len);
+void json_writer_int(json_writer_t* w, long long value);
+void json_writer_double(json_writer_t* w, double value);
+void json_writer_bool(json_writer_t* w, int value);
+void json_writer_null(json_writer_t* w);
+
+#endif
@@ -17,6 +17,7 @@
 #include <sqlite3.h>
 
 #include <unistd.h>
+#include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -26,6 +27,11 @@
 #include <openssl/err.h>
 #include <openssl/sha.h>
 
+#include "http_parser.h"
+#include "worker_pool.h"
+#include "json_writer.h"
+#include "json_reader.h"
+
 #define PORT SERVER_PORT
 #define MAX_CLIENTS MAX_CONNECTIONS
 #define TOKEN_SIZE 256
@@ -58,8 +64,18 @@ typedef struct {
     char media_path[256];
     time_t timestamp;
     int encrypted;
+    char sender_username[50];   // filled in by history queries
+    char receiver_username[50];
 } message_t;
 
+// A file uploaded to MEDIA_DIR, stored once per content
+typedef struct {
+    char hash[HASH_SIZE];  // hex SHA-256 of the content, also its name
+    long long size;
+    char content_type[100];
+    time_t created_at;
+} media_t;
+
 typedef struct {
     int socket;
     struct sockaddr_in address;
@@ -68,6 +84,99 @@ typedef struct {
     int authenticated;
 } client_t;
 
+struct out_chunk;
+struct connection;
+
+// Routes and request phases tracked by metrics.c
+typedef enum {
+    ROUTE_OTHER = 0,
+    ROUTE_ROOT,
+    ROUTE_OPTIONS,
+    ROUTE_REGISTER,
+    ROUTE_LOGIN,
+    ROUTE_SEND_MESSAGE,
+    ROUTE_UPDATE_LOCATION,
+    ROUTE_GET_LOCATIONS,
+    ROUTE_GET_USERS,
+    ROUTE_GET_MESSAGES,
+    ROUTE_WAIT_MESSAGES,
+    ROUTE_WEBSOCKET,
+    ROUTE_METRICS,
+    ROUTE_CREATE_GROUP,
+    ROUTE_GET_GROUPS,
+    ROUTE_ADD_GROUP_MEMBER,
+    ROUTE_SEND_GROUP_MESSAGE,
+    ROUTE_GET_GROUP_MESSAGES,
+    ROUTE_MARK_GROUP_READ,
+    ROUTE_SEARCH_MESSAGES,
+    ROUTE_UPLOAD_MEDIA,
+    ROUTE_GET_MEDIA,
+    ROUTE_COUNT
+} metrics_route_t;
+
+typedef enum {
+    PHASE_PARSE = 0,  // on the loop thread, before dispatch
+    PHASE_QUEUE,      // waiting for a worker
+    PHASE_AUTH,
+    PHASE_DB,         // holding or waiting for a connection, or a group commit
+    PHASE_SERIALIZE,  // the rest of the handler: JSON and request logic
+    PHASE_SEND,
+    PHASE_TOTAL,
+    PHASE_COUNT
+} metrics_phase_t;
+
+// State of a parked long-poll request, see long_poll.c
+typedef struct {
+    int user_id;
+    int since_id;
+    int seen_id;
+    int limit;
+    int timed_out;
+    uint64_t deadline_ns;
+    struct connection* bucket_prev;
+    struct connection* bucket_next;
+    struct connection* older;
+    struct connection* newer;
+} long_poll_t;
+
+// A request body too large to buffer, handed to its handler as it arrives.
+// The handler embeds this in its own state and passes it to
+// connection_stream_body(); write() returns -1 to stop reading. finish()
+// runs once, with remaining 0 if the whole body was read, and either
+// answers the request or, if the body was cut short, only cleans up.
+typedef struct body_stream {
+    size_t remaining;
+    int (*write)(struct body_stream* stream, const char* data, size_t len);
+    void (*finish)(client_t* client, struct body_stream* stream);
+} body_stream_t;
+
+typedef struct connection {
+    client_t client;
+    char* in_buf;        // bytes received but not yet handled, freed while idle
+    size_t in_len;
+    size_t in_cap;
+    http_parser_t parser;
+    size_t request_len;  // length of the request currently owned by a worker
+    int continue_sent;
+    uint64_t parse_ns;   // spent parsing the current request, for metrics
+    uint64_t dispatched_ns;
+    int keep_alive;      // of the request being answered
+    int version_minor;
+    struct out_chunk* out_head; // response bytes the socket has not taken yet
+    struct out_chunk* out_tail;
+    int peer_closed;
+    int closing;
+    struct connection* next_done; // in the done list, or closed and waiting to be freed
+    int closed;
+    int websocket;       // upgraded; owned by the loop thread from then on
+    int ws_registered;
+    struct connection* ws_next; // next socket in the same registry bucket
+    int parked;          // long-poll request waiting for a message
+    int resuming;        // woken and handed to a worker; loop thread only
+    long_poll_t wait;
+    body_stream_t* stream; // request body still being received
+} connection_t;
+
 typedef struct {
     int id;
     char name[100];
@@ -75,40 +184,219 @@ typedef struct {
     time_t created_at;
 } group_t;
 
+typedef enum {
+    GROUP_ROLE_MEMBER = 0,
+    GROUP_ROLE_ADMIN = 1
+} group_role_t;
+
+typedef struct {
+    int group_id;
+    int user_id;
+    group_role_t role;
+    time_t joined_at;
+    int last_read_id; // newest message the member has read
+} group_member_t;
+
+// A group as one member sees it in their group list
+typedef struct {
+    group_t group;
+    group_role_t role;
+    int last_read_id;
+    int last_message_id;
+    int unread;       // counted up to GROUP_UNREAD_MAX
+} group_summary_t;
+
+typedef struct {
+    const char* name;
+    uint64_t hits;
+    uint64_t prepares;
+} db_statement_stats_t;
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t inserts;
+    uint64_t evictions;
+    uint64_t invalidations;
+    int entries;
+    int capacity;
+} user_cache_stats_t;
+
+typedef struct {
+    uint64_t batches;
+    uint64_t messages;
+    uint64_t largest_batch;
+    uint64_t commit_ns_total;
+} message_batch_stats_t;
+
+typedef struct {
+    uint64_t allowed;
+    uint64_t throttled_requests;
+    uint64_t throttled_messages;
+} rate_limit_stats_t;
+
+// Row callbacks return nonzero to stop the scan early
+typedef int (*message_row_fn)(const message_t* msg, void* ctx);
+typedef int (*user_row_fn)(const user_t* user, void* ctx);
+typedef int (*group_row_fn)(const group_summary_t* summary, void* ctx);
+
+// A buffered location update on its way to the database
+typedef struct {
+    int user_id;
+    double latitude;
+    double longitude;
+    time_t updated;
+    int duration;
+} location_update_t;
+
 // Database functions
 int init_database(void);
+int get_statement_stats(db_statement_stats_t* stats, int max);
 int create_user(const char* username, const char* email, const char* password, user_role_t role);
 user_t* authenticate_user(const char* username, const char* password);
 int save_message(message_t* msg);
+void get_message_batch_stats(message_batch_stats_t* stats);
 int update_user_location(int user_id, double lat, double lng, int duration);
 int get_user_locations(user_t** users, int* count);
+int each_user_location(user_row_fn fn, void* ctx);
+int each_user_location_in_box(double min_lat, double max_lat, double min_lng, double max_lng,
+                              int limit, user_row_fn fn, void* ctx);
 user_t* get_user_by_username(const char* username);
 user_t* get_user_by_id(int user_id);
-int get_user_messages(int user_id, message_t** messages, int* count);
+int find_user_by_username(const char* username, user_t* user);
+int find_user_by_id(int user_id, user_t* user);
+int get_user_messages(int user_id, int before_id, int limit, message_t** messages, int* count);
+int each_user_message(int user_id, int before_id, int limit, message_row_fn fn, void* ctx);
+int each_user_message_since(int user_id, int since_id, int limit, message_row_fn fn, void* ctx);
+int expire_user_locations(const int* user_ids, int count);
+int flush_user_locations(void);
+int create_group(const char* name, int admin_id);
+int add_group_member(int group_id, int user_id);
+int find_group_member(int group_id, int user_id, group_member_t* member);
+int mark_group_read(int group_id, int user_id, int message_id);
+int each_user_group(int user_id, group_row_fn fn, void* ctx);
+int each_group_message(int group_id, int before_id, int limit, message_row_fn fn, void* ctx);
+int search_user_messages(int user_id, const char* text, int offset, int limit,
+                         message_row_fn fn, void* ctx);
+int save_media(const media_t* media, int uploader_id);
+int find_media(const char* hash, int user_id, media_t* media);
+
+// User cache functions
+int user_cache_init(int capacity, int shards);
+int user_cache_get_by_id(int user_id, user_t* user);
+int user_cache_get_by_username(const char* username, user_t* user);
+uint64_t user_cache_generation(void);
+void user_cache_put(const user_t* user, uint64_t generation);
+void user_cache_invalidate(int user_id);
+void user_cache_forget_username(const char* username);
+void user_cache_get_stats(user_cache_stats_t* stats);
+
+// Location store functions
+int location_store_start(void);
+int location_store_load(const user_t* user, void* ctx);
+int location_store_update(int user_id, const char* username, double lat, double lng,
+                          time_t updated, int duration);
+void location_store_forget(const int* user_ids, int count, time_t now);
+int location_store_take_dirty(location_update_t** updates, int* cap);
+void location_store_requeue(const location_update_t* updates, int count);
+int location_store_each(time_t now, user_row_fn fn, void* ctx);
+int location_store_each_in_box(double min_lat, double max_lat, double min_lng, double max_lng,
+                               int limit, time_t now, user_row_fn fn, void* ctx);
+
+// Location expiry functions
+int location_expiry_start(void);
+void location_expiry_schedule(int user_id, time_t expires);
+
+// Metrics functions
+void metrics_begin_request(uint64_t parse_ns, uint64_t dispatched_ns);
+void metrics_set_route(metrics_route_t route);
+void metrics_set_status(int status);
+void metrics_add_phase(metrics_phase_t phase, uint64_t ns);
+void metrics_end_request(void);
+void api_get_metrics(client_t* client); // Admin only
+
+// Rate limiting functions
+int rate_limit_init(int capacity, int shards);
+int rate_limit_allow(client_t* client, int sends_message);
+void rate_limit_get_stats(rate_limit_stats_t* stats);
 
 // Server functions
 void start_server(void);
-void* handle_client(void* arg);
-void handle_http_request(client_t* client, const char* request);
-void handle_websocket(client_t* client);
+void handle_http_request(client_t* client, http_request_t* request);
+
+// Long-poll functions
+int long_poll_latest(int user_id);
+void long_poll_notify(int user_id, int message_id);
+void long_poll_wait(client_t* client, int since_id, int seen_id, int limit);
+void long_poll_park(connection_t* conn);
+void long_poll_cancel(connection_t* conn);
+void long_poll_drain(void);
+int long_poll_expire(void);
+
+// WebSocket functions
+void handle_websocket(client_t* client, http_request_t* request);
+void websocket_attach(connection_t* conn);
+void websocket_detach(connection_t* conn);
+void websocket_read(connection_t* conn);
+int websocket_active(void);
+void websocket_publish(const int* user_ids, int count, const char* payload, size_t len);
+void websocket_drain_pushes(void);
+
+// Event loop functions
+void event_loop_run(int server_socket);
+void event_loop_get_pool_stats(worker_pool_stats_t* stats);
+int connection_send(client_t* client, const char* head, size_t head_len,
+                    const char* body, size_t body_len, void (*release)(void*), void* owner);
+int connection_send_file(client_t* client, const char* head, size_t head_len,
+                         int fd, off_t offset, size_t len);
+void connection_stream_body(client_t* client, http_request_t* request, body_stream_t* stream);
+void connection_flush(connection_t* conn);
+void connection_resume(connection_t* conn);
+void event_loop_wake(void);
 
 // Auth functions
-char* generate_token(int user_id);
-int verify_token(const char* token, int* user_id);
+char* generate_token(int user_id, user_role_t role);
+int verify_token(const char* token, int* user_id, user_role_t* role);
 void hash_password(const char* password, char* hash);
 
 // API endpoints
-void api_register(client_t* client, json_object* data);
-void api_login(client_t* client, json_object* data);
-void api_send_message(client_t* client, json_object* data);
-void api_update_location(client_t* client, json_object* data);
-void api_get_locations(client_t* client); // Admin only
+void api_register(client_t* client, http_request_t* request);
+void api_login(client_t* client, http_request_t* request);
+void api_send_message(client_t* client, http_request_t* request);
+void api_update_location(client_t* client, http_request_t* request);
+void api_get_locations(client_t* client, const char* query); // Admin only
 void api_get_users(client_t* client); // Admin only
-void api_get_messages(client_t* client);
+void api_get_messages(client_t* client, const char* query);
+void api_wait_messages(client_t* client, const char* query);
+void api_resume_wait_messages(client_t* client, const long_poll_t* wait);
+void api_search_messages(client_t* client, const char* query);
+#if ENABLE_FILE_UPLOAD
+int media_init(void);
+void api_upload_media(client_t* client, http_request_t* request);
+void api_get_media(client_t* client, http_request_t* request); // Uploader and conversation members
+#endif
+#if ENABLE_GROUP_CHAT
+void api_create_group(client_t* client, http_request_t* request);
+void api_get_groups(client_t* client);
+void api_add_group_member(client_t* client, http_request_t* request); // Group admin only
+void api_send_group_message(client_t* client, http_request_t* request); // Members only
+void api_get_group_messages(client_t* client, http_request_t* request); // Members only
+void api_mark_group_read(client_t* client, http_request_t* request); // Members only
+#endif
 
 // Utility functions
-void send_response(int socket, int status, const char* content_type, const char* body);
-void send_json_response(int socket, int status, json_object* json);
+void send_response(client_t* client, int status, const char* content_type, const char* body);
+void send_response_body(client_t* client, int status, const char* content_type,
+                        const char* body, size_t body_len, void (*release)(void*), void* owner);
+void send_file_response(client_t* client, int status, const char* content_type,
+                        int fd, off_t offset, size_t length, const char* extra_headers);
+void send_json_response(client_t* client, int status, json_object* json);
+void send_json_writer(client_t* client, int status, json_writer_t* w);
+json_object* read_json_fields(http_request_t* request, json_field_t* fields, int count);
+int query_param(const char* query, const char* name, char* value, size_t size);
+long query_param_long(const char* query, const char* name, long default_value);
+int query_param_double(const char* query, const char* name, double* value);
+int path_id(const char* path);
 int is_admin(client_t* client);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,71 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#define CACHE_LINE_SIZE 64
+
+typedef void (*work_fn_t)(void* arg);
+
+typedef struct {
+    size_t sequence;
+    work_fn_t fn;
+    void* arg;
+    uint64_t enqueued_ns;
+} work_slot_t;
+
+// Fixed set of threads fed by a bounded lock-free MPMC ring (Vyukov style).
+// Producers and consumers only contend on their own index; idle workers
+// sleep on a semaphore that counts queued items.
+typedef struct {
+    const char* name;
+    work_slot_t* slots;
+    size_t mask;
+
+    char pad0[CACHE_LINE_SIZE];
+    size_t enqueue_pos;
+    char pad1[CACHE_LINE_SIZE];
+    size_t dequeue_pos;
+    char pad2[CACHE_LINE_SIZE];
+
+    sem_t ready;
+    pthread_t* threads;
+    int thread_count;
+
+    // Statistics, updated with atomic builtins
+    uint64_t submitted;
+    uint64_t rejected;
+    uint64_t completed;
+    uint64_t wait_ns_total;
+    uint64_t wait_ns_max;
+    size_t depth_max;
+} worker_pool_t;
+
+typedef struct {
+    const char* name;
+    int threads;
+    size_t capacity;
+    size_t depth;
+    size_t depth_max;
+    uint64_t submitted;
+    uint64_t rejected;
+    uint64_t completed;
+    uint64_t wait_ns_total;
+    uint64_t wait_ns_max;
+} worker_pool_stats_t;
+
+// threads <= 0 sizes the pool to the number of online cores; capacity is
+// rounded up to a power of two.
+int worker_pool_init(worker_pool_t* pool, const char* name, int threads, size_t capacity);
+
+// Returns 0 on success, -1 if the queue is full.
+int worker_pool_submit(worker_pool_t* pool, work_fn_t fn, void* arg);
+
+void worker_pool_get_stats(worker_pool_t* pool, worker_pool_stats_t* stats);
+
+uint64_t monotonic_ns(void);
+
+#endif
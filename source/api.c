@@ -1,27 +1,33 @@
 #include "server.h"
+#include <math.h>
 
-void api_register(client_t* client, json_object* data) {
-    json_object* username_obj, *email_obj, *password_obj, *role_obj;
-    
-    if (!json_object_object_get_ex(data, "username", &username_obj) ||
-        !json_object_object_get_ex(data, "email", &email_obj) ||
-        !json_object_object_get_ex(data, "password", &password_obj)) {
-        send_response(client->socket, 400, "application/json", "{\"error\":\"Missing required fields\"}");
+enum { REGISTER_USERNAME, REGISTER_EMAIL, REGISTER_PASSWORD, REGISTER_ROLE, REGISTER_FIELDS };
+
+static void register_user(client_t* client, const json_field_t* fields) {
+    if (!fields[REGISTER_USERNAME].present ||
+        !fields[REGISTER_EMAIL].present ||
+        !fields[REGISTER_PASSWORD].present) {
+        send_response(client, 400, "application/json", "{\"error\":\"Missing required fields\"}");
         return;
     }
 
-    const char* username = json_object_get_string(username_obj);
-    const char* email = json_object_get_string(email_obj);
-    const char* password = json_object_get_string(password_obj);
+    const char* username = fields[REGISTER_USERNAME].string;
+    const char* email = fields[REGISTER_EMAIL].string;
+    const char* password = fields[REGISTER_PASSWORD].string;
     
     user_role_t role = USER_REGULAR;
-    if (json_object_object_get_ex(data, "role", &role_obj)) {
-        role = json_object_get_int(role_obj);
+    if (fields[REGISTER_ROLE].present) {
+        double number = fields[REGISTER_ROLE].number;
+        if (number < INT_MIN || number > INT_MAX) {
+            send_response(client, 400, "application/json", "{\"error\":\"Invalid role\"}");
+            return;
+        }
+        role = (int)number;
     }
 
     int user_id = create_user(username, email, password, role);
     if (user_id < 0) {
-        send_response(client->socket, 400, "application/json", "{\"error\":\"User creation failed\"}");
+        send_response(client, 400, "application/json", "{\"error\":\"User creation failed\"}");
         return;
     }
 
@@ -32,29 +38,40 @@ void api_register(client_t* client, json_object* data) {
     json_object_object_add(response, "success", success);
     json_object_object_add(response, "user_id", id);
     
-    send_json_response(client->socket, 201, response);
+    send_json_response(client, 201, response);
     json_object_put(response);
 }
 
-void api_login(client_t* client, json_object* data) {
-    json_object* username_obj, *password_obj;
-    
-    if (!json_object_object_get_ex(data, "username", &username_obj) ||
-        !json_object_object_get_ex(data, "password", &password_obj)) {
-        send_response(client->socket, 400, "application/json", "{\"error\":\"Missing credentials\"}");
+void api_register(client_t* client, http_request_t* request) {
+    json_field_t fields[REGISTER_FIELDS] = {
+        [REGISTER_USERNAME] = JSON_FIELD("username", JSON_FIELD_STRING),
+        [REGISTER_EMAIL] = JSON_FIELD("email", JSON_FIELD_STRING),
+        [REGISTER_PASSWORD] = JSON_FIELD("password", JSON_FIELD_STRING),
+        [REGISTER_ROLE] = JSON_FIELD("role", JSON_FIELD_NUMBER),
+    };
+    json_object* backing = read_json_fields(request, fields, REGISTER_FIELDS);
+    register_user(client, fields);
+    json_object_put(backing);
+}
+
+enum { LOGIN_USERNAME, LOGIN_PASSWORD, LOGIN_FIELDS };
+
+static void login(client_t* client, const json_field_t* fields) {
+    if (!fields[LOGIN_USERNAME].present || !fields[LOGIN_PASSWORD].present) {
+        send_response(client, 400, "application/json", "{\"error\":\"Missing credentials\"}");
         return;
     }
 
-    const char* username = json_object_get_string(username_obj);
-    const char* password = json_object_get_string(password_obj);
+    const char* username = fields[LOGIN_USERNAME].string;
+    const char* password = fields[LOGIN_PASSWORD].string;
 
     user_t* user = authenticate_user(username, password);
     if (!user) {
-        send_response(client->socket, 401, "application/json", "{\"error\":\"Invalid credentials\"}");
+        send_response(client, 401, "application/json", "{\"error\":\"Invalid credentials\"}");
         return;
     }
 
-    char* token = generate_token(user->id);
+    char* token = generate_token(user->id, user->role);
     client->user = *user;
     client->authenticated = 1;
     strcpy(client->token, token);
@@ -68,42 +85,116 @@ void api_login(client_t* client, json_object* data) {
     json_object_object_add(response, "token", token_obj);
     json_object_object_add(response, "role", role_obj);
     
-    send_json_response(client->socket, 200, response);
+    send_json_response(client, 200, response);
     json_object_put(response);
     free(user);
     free(token);
 }
 
-void api_send_message(client_t* client, json_object* data) {
-    if (!client->authenticated) {
-        send_response(client->socket, 401, "application/json", "{\"error\":\"Not authenticated\"}");
-        return;
+void api_login(client_t* client, http_request_t* request) {
+    json_field_t fields[LOGIN_FIELDS] = {
+        [LOGIN_USERNAME] = JSON_FIELD("username", JSON_FIELD_STRING),
+        [LOGIN_PASSWORD] = JSON_FIELD("password", JSON_FIELD_STRING),
+    };
+    json_object* backing = read_json_fields(request, fields, LOGIN_FIELDS);
+    login(client, fields);
+    json_object_put(backing);
+}
+
+enum { MESSAGE_CONTENT, MESSAGE_TARGET, MESSAGE_MEDIA, MESSAGE_FIELDS };
+
+// Fills in the media of a new message from its "media" field, if any.
+// Only media the sender can see may be attached; otherwise answers the
+// request itself and returns -1.
+static int attach_media(client_t* client, const json_field_t* field, message_t* msg) {
+    if (!field->present) return 0;
+#if ENABLE_FILE_UPLOAD
+    media_t media;
+    int rc = strlen(field->string) == HASH_SIZE - 1 ? find_media(field->string, client->user.id, &media) : 1;
+    if (rc < 0) {
+        send_response(client, 500, "application/json", "{\"error\":\"Failed to retrieve media\"}");
+        return -1;
     }
+    if (rc == 0) {
+        strcpy(msg->media_path, media.hash);
+        return 0;
+    }
+#endif
+    send_response(client, 400, "application/json", "{\"error\":\"Unknown media\"}");
+    return -1;
+}
 
-    json_object* content_obj, *target_obj;
-    
-    if (!json_object_object_get_ex(data, "content", &content_obj)) {
-        send_response(client->socket, 400, "application/json", "{\"error\":\"Missing content\"}");
+#if ENABLE_WEBSOCKET
+// Pushes a new message to the open sockets of both parties, in the same
+// shape as an entry of the history list
+static void push_message(const message_t* msg, const char* receiver) {
+    if (!websocket_active()) return;
+
+    user_t sender;
+    if (find_user_by_id(msg->sender_id, &sender) < 0) return;
+
+    json_writer_t w;
+    json_writer_init(&w, 0);
+    json_writer_begin_object(&w);
+    json_writer_key(&w, "type");
+    json_writer_string(&w, "message");
+    json_writer_key(&w, "message");
+    json_writer_begin_object(&w);
+    json_writer_key(&w, "id");
+    json_writer_int(&w, msg->id);
+    json_writer_key(&w, "sender");
+    json_writer_string(&w, sender.username);
+    json_writer_key(&w, "receiver");
+    json_writer_string(&w, receiver);
+    json_writer_key(&w, "content");
+    json_writer_string(&w, msg->content);
+    if (msg->media_path[0]) {
+        json_writer_key(&w, "media");
+        json_writer_string(&w, msg->media_path);
+    }
+    json_writer_key(&w, "timestamp");
+    json_writer_int(&w, msg->timestamp);
+    json_writer_end_object(&w);
+    json_writer_end_object(&w);
+
+    if (json_writer_finish(&w) == 0) {
+        int user_ids[2] = { msg->sender_id, msg->receiver_id };
+        int count = msg->receiver_id > 0 && msg->receiver_id != msg->sender_id ? 2 : 1;
+        websocket_publish(user_ids, count, w.data, w.len);
+        json_writer_free(&w);
+    }
+}
+#endif
+
+static void send_message(client_t* client, const json_field_t* fields) {
+    const json_field_t* content = &fields[MESSAGE_CONTENT];
+    if (!content->present && !fields[MESSAGE_MEDIA].present) {
+        send_response(client, 400, "application/json", "{\"error\":\"Missing content\"}");
         return;
     }
 
     message_t msg = {0};
+    if (content->present && strlen(content->string) >= sizeof(msg.content)) {
+        send_response(client, 400, "application/json", "{\"error\":\"Message too long\"}");
+        return;
+    }
+
     msg.sender_id = client->user.id;
-    strcpy(msg.content, json_object_get_string(content_obj));
+    if (content->present) strcpy(msg.content, content->string);
     msg.timestamp = time(NULL);
+    if (attach_media(client, &fields[MESSAGE_MEDIA], &msg) < 0) return;
 
-    if (json_object_object_get_ex(data, "target_username", &target_obj)) {
-        const char* target_username = json_object_get_string(target_obj);
-        user_t* target_user = get_user_by_username(target_username);
-        if (target_user) {
-            msg.receiver_id = target_user->id;
-            free(target_user);
+    user_t target_user = {0};
+    if (fields[MESSAGE_TARGET].present) {
+        const char* target_username = fields[MESSAGE_TARGET].string;
+        if (find_user_by_username(target_username, &target_user) == 0) {
+            msg.receiver_id = target_user.id;
         }
     }
 
     int msg_id = save_message(&msg);
     if (msg_id < 0) {
-        send_response(client->socket, 500, "application/json", "{\"error\":\"Failed to save message\"}");
+        send_response(client, 500, "application/json", "{\"error\":\"Failed to save message\"}");
         return;
     }
 
@@ -114,40 +205,66 @@ void api_send_message(client_t* client, json_object* data) {
     json_object_object_add(response, "success", success);
     json_object_object_add(response, "message_id", id);
     
-    send_json_response(client->socket, 201, response);
+    send_json_response(client, 201, response);
     json_object_put(response);
+
+#if ENABLE_WEBSOCKET
+    msg.id = msg_id;
+    push_message(&msg, target_user.username);
+#endif
 }
 
-void api_update_location(client_t* client, json_object* data) {
+void api_send_message(client_t* client, http_request_t* request) {
     if (!client->authenticated) {
-        send_response(client->socket, 401, "application/json", "{\"error\":\"Not authenticated\"}");
+        send_response(client, 401, "application/json", "{\"error\":\"Not authenticated\"}");
         return;
     }
 
-    json_object* lat_obj, *lng_obj, *duration_obj, *consent_obj;
-    
-    if (!json_object_object_get_ex(data, "latitude", &lat_obj) ||
-        !json_object_object_get_ex(data, "longitude", &lng_obj) ||
-        !json_object_object_get_ex(data, "consent", &consent_obj)) {
-        send_response(client->socket, 400, "application/json", "{\"error\":\"Missing location data or consent\"}");
+    json_field_t fields[MESSAGE_FIELDS] = {
+        [MESSAGE_CONTENT] = JSON_FIELD("content", JSON_FIELD_STRING),
+        [MESSAGE_TARGET] = JSON_FIELD("target_username", JSON_FIELD_STRING),
+        [MESSAGE_MEDIA] = JSON_FIELD("media", JSON_FIELD_STRING),
+    };
+    json_object* backing = read_json_fields(request, fields, MESSAGE_FIELDS);
+    send_message(client, fields);
+    json_object_put(backing);
+}
+
+enum { LOCATION_LATITUDE, LOCATION_LONGITUDE, LOCATION_CONSENT, LOCATION_DURATION, LOCATION_FIELDS };
+
+static void update_location(client_t* client, const json_field_t* fields) {
+    if (!fields[LOCATION_LATITUDE].present ||
+        !fields[LOCATION_LONGITUDE].present ||
+        !fields[LOCATION_CONSENT].present) {
+        send_response(client, 400, "application/json", "{\"error\":\"Missing location data or consent\"}");
         return;
     }
 
-    if (!json_object_get_boolean(consent_obj)) {
-        send_response(client->socket, 400, "application/json", "{\"error\":\"Location sharing requires explicit consent\"}");
+    if (!fields[LOCATION_CONSENT].boolean) {
+        send_response(client, 400, "application/json", "{\"error\":\"Location sharing requires explicit consent\"}");
         return;
     }
 
-    double lat = json_object_get_double(lat_obj);
-    double lng = json_object_get_double(lng_obj);
+    // Checked before anything reaches the location store's grid
+    double lat = fields[LOCATION_LATITUDE].number;
+    double lng = fields[LOCATION_LONGITUDE].number;
+    if (lat < -90.0 || lat > 90.0 || lng < -180.0 || lng > 180.0) {
+        send_response(client, 400, "application/json", "{\"error\":\"Invalid coordinates\"}");
+        return;
+    }
     int duration = 60; // Default 1 hour
 
-    if (json_object_object_get_ex(data, "duration", &duration_obj)) {
-        duration = json_object_get_int(duration_obj);
+    if (fields[LOCATION_DURATION].present) {
+        double number = fields[LOCATION_DURATION].number;
+        if (number < INT_MIN || number > INT_MAX) {
+            send_response(client, 400, "application/json", "{\"error\":\"Invalid duration\"}");
+            return;
+        }
+        duration = (int)number;
     }
 
     if (update_user_location(client->user.id, lat, lng, duration) < 0) {
-        send_response(client->socket, 500, "application/json", "{\"error\":\"Failed to update location\"}");
+        send_response(client, 500, "application/json", "{\"error\":\"Failed to update location\"}");
         return;
     }
 
@@ -158,98 +275,646 @@ void api_update_location(client_t* client, json_object* data) {
     json_object_object_add(response, "success", success);
     json_object_object_add(response, "message", msg);
     
-    send_json_response(client->socket, 200, response);
+    send_json_response(client, 200, response);
     json_object_put(response);
 }
 
-void api_get_locations(client_t* client) {
-    if (!client->authenticated || client->user.role != USER_ADMIN) {
-        send_response(client->socket, 403, "application/json", "{\"error\":\"Admin access required\"}");
+void api_update_location(client_t* client, http_request_t* request) {
+    if (!client->authenticated) {
+        send_response(client, 401, "application/json", "{\"error\":\"Not authenticated\"}");
         return;
     }
 
-    user_t* users;
+    json_field_t fields[LOCATION_FIELDS] = {
+        [LOCATION_LATITUDE] = JSON_FIELD("latitude", JSON_FIELD_NUMBER),
+        [LOCATION_LONGITUDE] = JSON_FIELD("longitude", JSON_FIELD_NUMBER),
+        [LOCATION_CONSENT] = JSON_FIELD("consent", JSON_FIELD_BOOL),
+        [LOCATION_DURATION] = JSON_FIELD("duration", JSON_FIELD_NUMBER),
+    };
+    json_object* backing = read_json_fields(request, fields, LOCATION_FIELDS);
+    update_location(client, fields);
+    json_object_put(backing);
+}
+
+static void write_location_fields(json_writer_t* w, const user_t* user) {
+    json_writer_key(w, "username");
+    json_writer_string(w, user->username);
+    json_writer_key(w, "latitude");
+    json_writer_double(w, user->latitude);
+    json_writer_key(w, "longitude");
+    json_writer_double(w, user->longitude);
+    json_writer_key(w, "last_updated");
+    json_writer_int(w, user->location_updated);
+}
+
+static int write_location(const user_t* user, void* ctx) {
+    json_writer_t* w = ctx;
+    json_writer_begin_object(w);
+    write_location_fields(w, user);
+    json_writer_end_object(w);
+    return w->failed;
+}
+
+#define EARTH_RADIUS_KM 6371.0
+#define KM_PER_DEGREE 111.19 // along a meridian, on the same sphere
+
+typedef struct {
+    double distance_km;
+    user_t user;
+} location_hit_t;
+
+// The nearest locations found so far, as a max-heap on distance
+typedef struct {
+    double lat;
+    double lng;
+    double radius_km;
+    location_hit_t* hits;
     int count;
-    
-    if (get_user_locations(&users, &count) < 0) {
-        send_response(client->socket, 500, "application/json", "{\"error\":\"Failed to retrieve locations\"}");
+    int limit;
+} nearest_search_t;
+
+static double distance_km(double lat1, double lng1, double lat2, double lng2) {
+    double to_rad = M_PI / 180.0;
+    double dlat = (lat2 - lat1) * to_rad;
+    double dlng = (lng2 - lng1) * to_rad;
+    double a = sin(dlat / 2) * sin(dlat / 2) +
+               cos(lat1 * to_rad) * cos(lat2 * to_rad) * sin(dlng / 2) * sin(dlng / 2);
+    return 2 * EARTH_RADIUS_KM * asin(sqrt(fmin(1.0, a)));
+}
+
+static void sift_down(location_hit_t* hits, int count, int i) {
+    for (;;) {
+        int largest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < count && hits[left].distance_km > hits[largest].distance_km) largest = left;
+        if (right < count && hits[right].distance_km > hits[largest].distance_km) largest = right;
+        if (largest == i) return;
+
+        location_hit_t swap = hits[i];
+        hits[i] = hits[largest];
+        hits[largest] = swap;
+        i = largest;
+    }
+}
+
+static int collect_nearest(const user_t* user, void* ctx) {
+    nearest_search_t* search = ctx;
+    double d = distance_km(search->lat, search->lng, user->latitude, user->longitude);
+    if (d > search->radius_km) return 0; // in the box's corners
+
+    if (search->count < search->limit) {
+        // Sift the new hit up
+        int i = search->count++;
+        while (i > 0 && search->hits[(i - 1) / 2].distance_km < d) {
+            search->hits[i] = search->hits[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        search->hits[i].distance_km = d;
+        search->hits[i].user = *user;
+    } else if (d < search->hits[0].distance_km) {
+        search->hits[0].distance_km = d;
+        search->hits[0].user = *user;
+        sift_down(search->hits, search->count, 0);
+    }
+    return 0;
+}
+
+static int compare_hits(const void* a, const void* b) {
+    double da = ((const location_hit_t*)a)->distance_km;
+    double db = ((const location_hit_t*)b)->distance_km;
+    return (da > db) - (da < db);
+}
+
+// Finds everything within radius_km of (lat, lng), keeping the nearest
+// limit, sorted. The spatial index is searched with the circle's bounding box.
+static int find_nearest(nearest_search_t* search) {
+    double dlat = search->radius_km / KM_PER_DEGREE;
+    double min_lat = fmax(-90.0, search->lat - dlat);
+    double max_lat = fmin(90.0, search->lat + dlat);
+
+    // Meridians converge, so the box widens towards the poles
+    double min_lng = -180.0;
+    double max_lng = 180.0;
+    double widest = fmax(fabs(min_lat), fabs(max_lat));
+    if (widest < 89.0) {
+        double dlng = dlat / cos(widest * M_PI / 180.0);
+        if (dlng < 180.0) {
+            min_lng = search->lng - dlng;
+            max_lng = search->lng + dlng;
+            if (min_lng < -180.0) min_lng += 360.0;
+            if (max_lng > 180.0) max_lng -= 360.0;
+        }
+    }
+
+    search->hits = malloc(sizeof(location_hit_t) * search->limit);
+    if (!search->hits) return -1;
+    search->count = 0;
+
+    if (each_user_location_in_box(min_lat, max_lat, min_lng, max_lng, -1, collect_nearest, search) < 0) {
+        free(search->hits);
+        search->hits = NULL;
+        return -1;
+    }
+
+    qsort(search->hits, search->count, sizeof(location_hit_t), compare_hits);
+    return 0;
+}
+
+// Returns 1 if all four box parameters are given; sets *valid if they make sense
+static int read_box(const char* query, double box[4], int* valid) {
+    int given = query_param_double(query, "min_lat", &box[0]) +
+                query_param_double(query, "max_lat", &box[1]) +
+                query_param_double(query, "min_lng", &box[2]) +
+                query_param_double(query, "max_lng", &box[3]);
+    *valid = given == 4 && box[0] >= -90.0 && box[0] <= box[1] && box[1] <= 90.0 &&
+             box[2] >= -180.0 && box[2] <= 180.0 && box[3] >= -180.0 && box[3] <= 180.0;
+    return given > 0;
+}
+
+void api_get_locations(client_t* client, const char* query) {
+    if (!client->authenticated || client->user.role != USER_ADMIN) {
+        send_response(client, 403, "application/json", "{\"error\":\"Admin access required\"}");
         return;
     }
 
-    json_object* response = json_object_new_object();
-    json_object* locations = json_object_new_array();
-
-    for (int i = 0; i < count; i++) {
-        json_object* user_loc = json_object_new_object();
-        json_object* username = json_object_new_string(users[i].username);
-        json_object* lat = json_object_new_double(users[i].latitude);
-        json_object* lng = json_object_new_double(users[i].longitude);
-        json_object* updated = json_object_new_int64(users[i].location_updated);
-        
-        json_object_object_add(user_loc, "username", username);
-        json_object_object_add(user_loc, "latitude", lat);
-        json_object_object_add(user_loc, "longitude", lng);
-        json_object_object_add(user_loc, "last_updated", updated);
-        
-        json_object_array_add(locations, user_loc);
-    }
-
-    json_object_object_add(response, "locations", locations);
-    send_json_response(client->socket, 200, response);
-    
-    json_object_put(response);
-    if (users) free(users);
+    // ?min_lat=&max_lat=&min_lng=&max_lng= selects a box (min_lng > max_lng
+    // crosses the antimeridian); ?lat=&lng=&radius_km=&limit= the nearest
+    // within a radius; with neither, every shared location
+    double box[4];
+    int box_valid;
+    int by_box = read_box(query, box, &box_valid);
+    if (by_box && !box_valid) {
+        send_response(client, 400, "application/json", "{\"error\":\"Invalid bounding box\"}");
+        return;
+    }
+
+    nearest_search_t search = { 0 };
+    int by_radius = query_param_double(query, "lat", &search.lat) +
+                    query_param_double(query, "lng", &search.lng) +
+                    query_param_double(query, "radius_km", &search.radius_km);
+    if (by_radius && (by_box || by_radius != 3 || fabs(search.lat) > 90.0 ||
+                      fabs(search.lng) > 180.0 || search.radius_km <= 0.0)) {
+        send_response(client, 400, "application/json", "{\"error\":\"Invalid radius query\"}");
+        return;
+    }
+    search.limit = (int)query_param_long(query, "limit", LOCATION_NEAREST_DEFAULT);
+    if (search.limit < 1 || search.limit > LOCATION_NEAREST_MAX) search.limit = LOCATION_NEAREST_DEFAULT;
+
+    // Rows are written straight from the statement into the response
+    json_writer_t w;
+    json_writer_init(&w, 0);
+    json_writer_begin_object(&w);
+    json_writer_key(&w, "locations");
+    json_writer_begin_array(&w);
+
+    int rc;
+    if (by_radius) {
+        rc = find_nearest(&search);
+        for (int i = 0; rc == 0 && i < search.count; i++) {
+            json_writer_begin_object(&w);
+            write_location_fields(&w, &search.hits[i].user);
+            json_writer_key(&w, "distance_km");
+            json_writer_double(&w, search.hits[i].distance_km);
+            json_writer_end_object(&w);
+        }
+        free(search.hits);
+    } else if (by_box) {
+        rc = each_user_location_in_box(box[0], box[1], box[2], box[3], LOCATION_QUERY_LIMIT, write_location, &w);
+    } else {
+        rc = each_user_location(write_location, &w);
+    }
+
+    if (rc < 0) {
+        json_writer_free(&w);
+        send_response(client, 500, "application/json", "{\"error\":\"Failed to retrieve locations\"}");
+        return;
+    }
+
+    json_writer_end_array(&w);
+    json_writer_end_object(&w);
+    send_json_writer(client, 200, &w);
 }
 
 void api_get_users(client_t* client) {
     if (!client->authenticated || client->user.role != USER_ADMIN) {
-        send_response(client->socket, 403, "application/json", "{\"error\":\"Admin access required\"}");
+        send_response(client, 403, "application/json", "{\"error\":\"Admin access required\"}");
         return;
     }
 
-    send_response(client->socket, 200, "application/json", "{\"message\":\"User list endpoint - implementation depends on requirements\"}");
+    send_response(client, 200, "application/json", "{\"message\":\"User list endpoint - implementation depends on requirements\"}");
+}
+
+typedef struct {
+    json_writer_t* w;
+    int count;
+    int last_id;
+} message_page_t;
+
+static int write_message(const message_t* msg, void* ctx) {
+    message_page_t* page = ctx;
+    json_writer_t* w = page->w;
+
+    json_writer_begin_object(w);
+    json_writer_key(w, "id");
+    json_writer_int(w, msg->id);
+    json_writer_key(w, "sender");
+    json_writer_string(w, msg->sender_username[0] ? msg->sender_username : "Unknown");
+    if (msg->group_id > 0) {
+        json_writer_key(w, "group_id");
+        json_writer_int(w, msg->group_id);
+    } else {
+        json_writer_key(w, "receiver");
+        json_writer_string(w, msg->receiver_username);
+    }
+    json_writer_key(w, "content");
+    json_writer_string(w, msg->content);
+    if (msg->media_path[0]) {
+        json_writer_key(w, "media");
+        json_writer_string(w, msg->media_path);
+    }
+    json_writer_key(w, "timestamp");
+    json_writer_int(w, msg->timestamp);
+    json_writer_end_object(w);
+
+    page->count++;
+    page->last_id = msg->id;
+    return w->failed;
 }
 
-void api_get_messages(client_t* client) {
+void api_get_messages(client_t* client, const char* query) {
     if (!client->authenticated) {
-        send_response(client->socket, 401, "application/json", "{\"error\":\"Not authenticated\"}");
+        send_response(client, 401, "application/json", "{\"error\":\"Not authenticated\"}");
         return;
     }
 
-    message_t* messages;
-    int count;
-    
-    if (get_user_messages(client->user.id, &messages, &count) < 0) {
-        send_response(client->socket, 500, "application/json", "{\"error\":\"Failed to retrieve messages\"}");
+    // Keyset pagination: pass the last id of a page as before_id for the next
+    long before_id = query_param_long(query, "before_id", 0);
+    long limit = query_param_long(query, "limit", MESSAGE_PAGE_SIZE);
+    if (before_id < 0 || before_id > INT_MAX) before_id = 0;
+    if (limit < 1 || limit > MESSAGE_PAGE_MAX) limit = MESSAGE_PAGE_SIZE;
+
+    json_writer_t w;
+    json_writer_init(&w, 0);
+    json_writer_begin_object(&w);
+    json_writer_key(&w, "messages");
+    json_writer_begin_array(&w);
+
+    message_page_t page = { &w, 0, 0 };
+    if (each_user_message(client->user.id, before_id, limit, write_message, &page) < 0) {
+        json_writer_free(&w);
+        send_response(client, 500, "application/json", "{\"error\":\"Failed to retrieve messages\"}");
         return;
     }
 
-    json_object* response = json_object_new_object();
-    json_object* msg_array = json_object_new_array();
-
-    for (int i = 0; i < count; i++) {
-        json_object* msg_obj = json_object_new_object();
-        json_object* sender = json_object_new_string("Unknown");
-        json_object* content = json_object_new_string(messages[i].content);
-        json_object* timestamp = json_object_new_int64(messages[i].timestamp);
-        
-        user_t* sender_user = get_user_by_id(messages[i].sender_id);
-        if (sender_user) {
-            json_object_put(sender);
-            sender = json_object_new_string(sender_user->username);
-            free(sender_user);
+    json_writer_end_array(&w);
+    if (page.count == limit) {
+        json_writer_key(&w, "next_before_id");
+        json_writer_int(&w, page.last_id);
+    }
+    json_writer_end_object(&w);
+    send_json_writer(client, 200, &w);
+}
+
+
+// Answers with messages newer than since_id, oldest first, or parks the
+// request until one arrives. Runs again when a parked request wakes up.
+static void answer_wait(client_t* client, int since_id, int limit, int timed_out) {
+    // Read before the query; see long_poll.c
+    int seen_id = long_poll_latest(client->user.id);
+
+    json_writer_t w;
+    json_writer_init(&w, 0);
+    json_writer_begin_object(&w);
+    json_writer_key(&w, "messages");
+    json_writer_begin_array(&w);
+
+    message_page_t page = { &w, 0, 0 };
+    if (each_user_message_since(client->user.id, since_id, limit, write_message, &page) < 0) {
+        json_writer_free(&w);
+        send_response(client, 500, "application/json", "{\"error\":\"Failed to retrieve messages\"}");
+        return;
+    }
+
+    if (page.count == 0 && !timed_out) {
+        json_writer_free(&w);
+        long_poll_wait(client, since_id, seen_id, limit);
+        return;
+    }
+
+    json_writer_end_array(&w);
+    json_writer_key(&w, "last_id");
+    json_writer_int(&w, page.count ? page.last_id : since_id);
+    json_writer_end_object(&w);
+    send_json_writer(client, 200, &w);
+}
+
+void api_wait_messages(client_t* client, const char* query) {
+    if (!client->authenticated) {
+        send_response(client, 401, "application/json", "{\"error\":\"Not authenticated\"}");
+        return;
+    }
+
+    // Clients pass the newest id they have, then last_id from each answer
+    long since_id = query_param_long(query, "since_id", 0);
+    long limit = query_param_long(query, "limit", MESSAGE_PAGE_SIZE);
+    if (since_id < 0 || since_id > INT_MAX) since_id = 0;
+    if (limit < 1 || limit > MESSAGE_PAGE_MAX) limit = MESSAGE_PAGE_SIZE;
+
+    answer_wait(client, since_id, limit, 0);
+}
+
+void api_resume_wait_messages(client_t* client, const long_poll_t* wait) {
+    answer_wait(client, wait->since_id, wait->limit, wait->timed_out);
+}
+
+void api_search_messages(client_t* client, const char* query) {
+    if (!client->authenticated) {
+        send_response(client, 401, "application/json", "{\"error\":\"Not authenticated\"}");
+        return;
+    }
+
+    char text[MESSAGE_SEARCH_MAX_LENGTH];
+    if (!query_param(query, "q", text, sizeof(text))) {
+        send_response(client, 400, "application/json", "{\"error\":\"Missing search query\"}");
+        return;
+    }
+
+    // Results are ranked, so pages are counted from the top rather than keyed
+    long offset = query_param_long(query, "offset", 0);
+    long limit = query_param_long(query, "limit", MESSAGE_SEARCH_PAGE_SIZE);
+    if (limit < 1 || limit > MESSAGE_SEARCH_PAGE_MAX) limit = MESSAGE_SEARCH_PAGE_SIZE;
+    if (offset < 0 || offset > MESSAGE_SEARCH_MAX_OFFSET) {
+        send_response(client, 400, "application/json", "{\"error\":\"Invalid offset\"}");
+        return;
+    }
+
+    json_writer_t w;
+    json_writer_init(&w, 0);
+    json_writer_begin_object(&w);
+    json_writer_key(&w, "messages");
+    json_writer_begin_array(&w);
+
+    message_page_t page = { &w, 0, 0 };
+    int rc = search_user_messages(client->user.id, text, offset, limit, write_message, &page);
+    if (rc != 0) {
+        json_writer_free(&w);
+        if (rc > 0) {
+            send_response(client, 400, "application/json", "{\"error\":\"Missing search query\"}");
+        } else {
+            send_response(client, 500, "application/json", "{\"error\":\"Failed to search messages\"}");
         }
-        
-        json_object_object_add(msg_obj, "sender", sender);
-        json_object_object_add(msg_obj, "content", content);
-        json_object_object_add(msg_obj, "timestamp", timestamp);
-        
-        json_object_array_add(msg_array, msg_obj);
+        return;
     }
 
-    json_object_object_add(response, "messages", msg_array);
-    send_json_response(client->socket, 200, response);
-    
-    json_object_put(response);
-    if (messages) free(messages);
-}
\ No newline at end of file
+    json_writer_end_array(&w);
+    if (page.count == limit && offset + limit <= MESSAGE_SEARCH_MAX_OFFSET) {
+        json_writer_key(&w, "next_offset");
+        json_writer_int(&w, offset + limit);
+    }
+    json_writer_end_object(&w);
+    send_json_writer(client, 200, &w);
+}
+
+#if ENABLE_GROUP_CHAT
+// Looks up the client's membership of the group named in the path; answers
+// the request itself and returns -1 if there is none
+static int require_member(client_t* client, http_request_t* request, group_member_t* member) {
+    if (!client->authenticated) {
+        send_response(client, 401, "application/json", "{\"error\":\"Not authenticated\"}");
+        return -1;
+    }
+
+    // Missing groups look the same as other people's, so ids reveal nothing
+    int group_id = path_id(request->path);
+    if (group_id < 0 || find_group_member(group_id, client->user.id, member) < 0) {
+        send_response(client, 403, "application/json", "{\"error\":\"Not a member of this group\"}");
+        return -1;
+    }
+    return 0;
+}
+
+enum { GROUP_NAME, GROUP_FIELDS };
+
+static void create_group_with(client_t* client, const json_field_t* fields) {
+    if (!fields[GROUP_NAME].present || !fields[GROUP_NAME].string[0]) {
+        send_response(client, 400, "application/json", "{\"error\":\"Missing group name\"}");
+        return;
+    }
+    if (strlen(fields[GROUP_NAME].string) >= sizeof(((group_t*)0)->name)) {
+        send_response(client, 400, "application/json", "{\"error\":\"Group name too long\"}");
+        return;
+    }
+
+    int group_id = create_group(fields[GROUP_NAME].string, client->user.id);
+    if (group_id < 0) {
+        send_response(client, 500, "application/json", "{\"error\":\"Failed to create group\"}");
+        return;
+    }
+
+    char body[64];
+    snprintf(body, sizeof(body), "{\"success\":true,\"group_id\":%d}", group_id);
+    send_response(client, 201, "application/json", body);
+}
+
+void api_create_group(client_t* client, http_request_t* request) {
+    if (!client->authenticated) {
+        send_response(client, 401, "application/json", "{\"error\":\"Not authenticated\"}");
+        return;
+    }
+
+    json_field_t fields[GROUP_FIELDS] = {
+        [GROUP_NAME] = JSON_FIELD("name", JSON_FIELD_STRING),
+    };
+    json_object* backing = read_json_fields(request, fields, GROUP_FIELDS);
+    create_group_with(client, fields);
+    json_object_put(backing);
+}
+
+static int write_group(const group_summary_t* summary, void* ctx) {
+    json_writer_t* w = ctx;
+    json_writer_begin_object(w);
+    json_writer_key(w, "id");
+    json_writer_int(w, summary->group.id);
+    json_writer_key(w, "name");
+    json_writer_string(w, summary->group.name);
+    json_writer_key(w, "admin");
+    json_writer_bool(w, summary->role == GROUP_ROLE_ADMIN);
+    json_writer_key(w, "last_message_id");
+    json_writer_int(w, summary->last_message_id);
+    json_writer_key(w, "last_read_id");
+    json_writer_int(w, summary->last_read_id);
+    json_writer_key(w, "unread");
+    json_writer_int(w, summary->unread);
+    json_writer_end_object(w);
+    return w->failed;
+}
+
+void api_get_groups(client_t* client) {
+    if (!client->authenticated) {
+        send_response(client, 401, "application/json", "{\"error\":\"Not authenticated\"}");
+        return;
+    }
+
+    json_writer_t w;
+    json_writer_init(&w, 0);
+    json_writer_begin_object(&w);
+    json_writer_key(&w, "groups");
+    json_writer_begin_array(&w);
+
+    if (each_user_group(client->user.id, write_group, &w) < 0) {
+        json_writer_free(&w);
+        send_response(client, 500, "application/json", "{\"error\":\"Failed to retrieve groups\"}");
+        return;
+    }
+
+    json_writer_end_array(&w);
+    json_writer_end_object(&w);
+    send_json_writer(client, 200, &w);
+}
+
+enum { MEMBER_USERNAME, MEMBER_FIELDS };
+
+static void add_member(client_t* client, const group_member_t* admin, const json_field_t* fields) {
+    if (!fields[MEMBER_USERNAME].present) {
+        send_response(client, 400, "application/json", "{\"error\":\"Missing username\"}");
+        return;
+    }
+
+    user_t user;
+    if (find_user_by_username(fields[MEMBER_USERNAME].string, &user) < 0) {
+        send_response(client, 404, "application/json", "{\"error\":\"User not found\"}");
+        return;
+    }
+
+    int rc = add_group_member(admin->group_id, user.id);
+    if (rc < 0) {
+        send_response(client, 500, "application/json", "{\"error\":\"Failed to add member\"}");
+    } else if (rc == 1) {
+        send_response(client, 200, "application/json", "{\"success\":true,\"message\":\"Already a member\"}");
+    } else {
+        send_response(client, 201, "application/json", "{\"success\":true}");
+    }
+}
+
+void api_add_group_member(client_t* client, http_request_t* request) {
+    group_member_t member;
+    if (require_member(client, request, &member) < 0) return;
+    if (member.role != GROUP_ROLE_ADMIN) {
+        send_response(client, 403, "application/json", "{\"error\":\"Group admin access required\"}");
+        return;
+    }
+
+    json_field_t fields[MEMBER_FIELDS] = {
+        [MEMBER_USERNAME] = JSON_FIELD("username", JSON_FIELD_STRING),
+    };
+    json_object* backing = read_json_fields(request, fields, MEMBER_FIELDS);
+    add_member(client, &member, fields);
+    json_object_put(backing);
+}
+
+enum { GROUP_MESSAGE_CONTENT, GROUP_MESSAGE_MEDIA, GROUP_MESSAGE_FIELDS };
+
+static void send_group_message(client_t* client, const group_member_t* member, const json_field_t* fields) {
+    const json_field_t* content = &fields[GROUP_MESSAGE_CONTENT];
+    if (!content->present && !fields[GROUP_MESSAGE_MEDIA].present) {
+        send_response(client, 400, "application/json", "{\"error\":\"Missing content\"}");
+        return;
+    }
+
+    message_t msg = {0};
+    if (content->present && strlen(content->string) >= sizeof(msg.content)) {
+        send_response(client, 400, "application/json", "{\"error\":\"Message too long\"}");
+        return;
+    }
+
+    // One row for the whole group; members read it through the group index
+    msg.sender_id = client->user.id;
+    msg.group_id = member->group_id;
+    if (content->present) strcpy(msg.content, content->string);
+    msg.timestamp = time(NULL);
+    if (attach_media(client, &fields[GROUP_MESSAGE_MEDIA], &msg) < 0) return;
+
+    int msg_id = save_message(&msg);
+    if (msg_id < 0) {
+        send_response(client, 500, "application/json", "{\"error\":\"Failed to save message\"}");
+        return;
+    }
+
+    char body[64];
+    snprintf(body, sizeof(body), "{\"success\":true,\"message_id\":%d}", msg_id);
+    send_response(client, 201, "application/json", body);
+}
+
+void api_send_group_message(client_t* client, http_request_t* request) {
+    group_member_t member;
+    if (require_member(client, request, &member) < 0) return;
+
+    json_field_t fields[GROUP_MESSAGE_FIELDS] = {
+        [GROUP_MESSAGE_CONTENT] = JSON_FIELD("content", JSON_FIELD_STRING),
+        [GROUP_MESSAGE_MEDIA] = JSON_FIELD("media", JSON_FIELD_STRING),
+    };
+    json_object* backing = read_json_fields(request, fields, GROUP_MESSAGE_FIELDS);
+    send_group_message(client, &member, fields);
+    json_object_put(backing);
+}
+
+void api_get_group_messages(client_t* client, http_request_t* request) {
+    group_member_t member;
+    if (require_member(client, request, &member) < 0) return;
+
+    long before_id = query_param_long(request->query, "before_id", 0);
+    long limit = query_param_long(request->query, "limit", MESSAGE_PAGE_SIZE);
+    if (before_id < 0 || before_id > INT_MAX) before_id = 0;
+    if (limit < 1 || limit > MESSAGE_PAGE_MAX) limit = MESSAGE_PAGE_SIZE;
+
+    json_writer_t w;
+    json_writer_init(&w, 0);
+    json_writer_begin_object(&w);
+    json_writer_key(&w, "last_read_id");
+    json_writer_int(&w, member.last_read_id);
+    json_writer_key(&w, "messages");
+    json_writer_begin_array(&w);
+
+    message_page_t page = { &w, 0, 0 };
+    if (each_group_message(member.group_id, before_id, limit, write_message, &page) < 0) {
+        json_writer_free(&w);
+        send_response(client, 500, "application/json", "{\"error\":\"Failed to retrieve messages\"}");
+        return;
+    }
+
+    json_writer_end_array(&w);
+    if (page.count == limit) {
+        json_writer_key(&w, "next_before_id");
+        json_writer_int(&w, page.last_id);
+    }
+    json_writer_end_object(&w);
+    send_json_writer(client, 200, &w);
+}
+
+enum { READ_MESSAGE_ID, READ_FIELDS };
+
+void api_mark_group_read(client_t* client, http_request_t* request) {
+    group_member_t member;
+    if (require_member(client, request, &member) < 0) return;
+
+    json_field_t fields[READ_FIELDS] = {
+        [READ_MESSAGE_ID] = JSON_FIELD("message_id", JSON_FIELD_NUMBER),
+    };
+    json_object* backing = read_json_fields(request, fields, READ_FIELDS);
+    int present = fields[READ_MESSAGE_ID].present;
+    double message_id = fields[READ_MESSAGE_ID].number;
+    json_object_put(backing);
+
+    if (!present || message_id < 1 || message_id > INT_MAX) {
+        send_response(client, 400, "application/json", "{\"error\":\"Missing or invalid message_id\"}");
+        return;
+    }
+
+    if (mark_group_read(member.group_id, client->user.id, (int)message_id) < 0) {
+        send_response(client, 500, "application/json", "{\"error\":\"Failed to update read position\"}");
+        return;
+    }
+    send_response(client, 200, "application/json", "{\"success\":true}");
+}
+#endif
@@ -1,4 +1,8 @@
 #include "server.h"
+#include "db_security.h"
+#include <ctype.h>
+#include <openssl/crypto.h>
+#include <openssl/hmac.h>
 
 void hash_password(const char* password, char* hash) {
     unsigned char digest[SHA256_DIGEST_LENGTH];
@@ -13,47 +17,124 @@ void hash_password(const char* password, char* hash) {
     hash[64] = '\0';
 }
 
-char* generate_token(int user_id) {
-    char* token = malloc(TOKEN_SIZE);
-    time_t now = time(NULL);
-    
-    // Simple token: base64(user_id:timestamp:random)
-    srand(now);
-    int random = rand();
-    
-    char temp[128];
-    snprintf(temp, sizeof(temp), "%d:%ld:%d", user_id, now, random);
-    
-    // Simple base64-like encoding (for demo purposes)
-    for (int i = 0; i < strlen(temp) && i < TOKEN_SIZE-1; i++) {
-        token[i] = temp[i] + 1; // Simple shift
+// Tokens are "<user id>.<role>.<expiry>.<signature>", the signature being
+// an unpadded base64url HMAC-SHA256 of everything before it. They carry all
+// that authorization needs, so checking one never touches the database.
+#define TOKEN_SIGNATURE_LEN 43
+
+static unsigned char signing_key[SHA256_DIGEST_LENGTH];
+static pthread_once_t signing_key_once = PTHREAD_ONCE_INIT;
+
+// Recently verified tokens, per worker thread so lookups need no locking.
+// Direct-mapped on a hash of the token; a hit still compares the full token.
+typedef struct {
+    char token[TOKEN_CACHE_MAX_LEN];
+    int user_id;
+    user_role_t role;
+    time_t expires;
+} verified_token_t;
+
+static __thread verified_token_t verified_tokens[TOKEN_CACHE_SIZE];
+
+static void init_signing_key(void) {
+    char db_password[256];
+    get_db_password(db_password, sizeof(db_password));
+
+    // Derived rather than used directly, so the database key never signs
+    // anything itself; tokens stay valid across restarts of the same build.
+    HMAC(EVP_sha256(), db_password, strlen(db_password),
+         (const unsigned char*)"hubbergram-token", 16, signing_key, NULL);
+    memset(db_password, 0, sizeof(db_password));
+}
+
+static void sign_payload(const char* payload, size_t len, char* signature) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    unsigned char mac[SHA256_DIGEST_LENGTH];
+
+    pthread_once(&signing_key_once, init_signing_key);
+    HMAC(EVP_sha256(), signing_key, sizeof(signing_key), (const unsigned char*)payload, len, mac, NULL);
+
+    int out = 0;
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; i += 3) {
+        unsigned int n = mac[i] << 16;
+        if (i + 1 < SHA256_DIGEST_LENGTH) n |= mac[i + 1] << 8;
+        if (i + 2 < SHA256_DIGEST_LENGTH) n |= mac[i + 2];
+        signature[out++] = alphabet[(n >> 18) & 63];
+        signature[out++] = alphabet[(n >> 12) & 63];
+        if (i + 1 < SHA256_DIGEST_LENGTH) signature[out++] = alphabet[(n >> 6) & 63];
+        if (i + 2 < SHA256_DIGEST_LENGTH) signature[out++] = alphabet[n & 63];
     }
-    token[strlen(temp)] = '\0';
-    
+    signature[out] = '\0';
+}
+
+char* generate_token(int user_id, user_role_t role) {
+    char* token = malloc(TOKEN_SIZE);
+    if (!token) return NULL;
+
+    time_t expires = time(NULL) + TOKEN_EXPIRY_HOURS * 3600;
+    int len = snprintf(token, TOKEN_SIZE, "%d.%d.%lld.", user_id, (int)role, (long long)expires);
+    sign_payload(token, len - 1, token + len);
     return token;
 }
 
-int verify_token(const char* token, int* user_id) {
-    if (!token || strlen(token) == 0) return 0;
-    
-    // Decode token (reverse of generate_token)
-    char temp[128];
-    for (int i = 0; i < strlen(token) && i < 127; i++) {
-        temp[i] = token[i] - 1; // Reverse shift
+static int parse_field(const char** p, long long* value) {
+    char* end;
+    if (!isdigit((unsigned char)**p)) return -1;
+    *value = strtoll(*p, &end, 10);
+    if (*end != '.') return -1;
+    *p = end + 1;
+    return 0;
+}
+
+static uint32_t hash_token(const char* token, size_t len) {
+    uint32_t h = 2166136261u; // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)token[i];
+        h *= 16777619u;
     }
-    temp[strlen(token)] = '\0';
-    
-    // Parse user_id:timestamp:random
-    char* saveptr;
-    char* user_str = strtok_r(temp, ":", &saveptr);
-    char* time_str = strtok_r(NULL, ":", &saveptr);
-    
-    if (!user_str || !time_str) return 0;
-    
-    *user_id = atoi(user_str);
-    time_t token_time = atol(time_str);
+    return h;
+}
+
+int verify_token(const char* token, int* user_id, user_role_t* role) {
+    if (!token) return 0;
+
+    size_t len = strlen(token);
+    if (len <= TOKEN_SIGNATURE_LEN + 1 || len >= TOKEN_SIZE) return 0;
+
     time_t now = time(NULL);
-    
-    // Token expires after 24 hours
-    return (now - token_time) < 86400;
-}
\ No newline at end of file
+    verified_token_t* cached = NULL;
+    if (len < TOKEN_CACHE_MAX_LEN) {
+        cached = &verified_tokens[hash_token(token, len) & (TOKEN_CACHE_SIZE - 1)];
+        if (cached->expires > now && strcmp(cached->token, token) == 0) {
+            *user_id = cached->user_id;
+            *role = cached->role;
+            return 1;
+        }
+    }
+
+    size_t payload_len = len - TOKEN_SIGNATURE_LEN - 1;
+    if (token[payload_len] != '.') return 0;
+
+    char signature[TOKEN_SIGNATURE_LEN + 1];
+    sign_payload(token, payload_len, signature);
+    if (CRYPTO_memcmp(signature, token + payload_len + 1, TOKEN_SIGNATURE_LEN) != 0) return 0;
+
+    long long id, role_value, expires;
+    const char* p = token;
+    if (parse_field(&p, &id) < 0 || parse_field(&p, &role_value) < 0 ||
+        parse_field(&p, &expires) < 0 || p != token + payload_len + 1) {
+        return 0;
+    }
+    if (expires <= now || id <= 0 || id > INT32_MAX) return 0;
+
+    *user_id = (int)id;
+    *role = role_value == USER_ADMIN ? USER_ADMIN : USER_REGULAR;
+
+    if (cached) {
+        memcpy(cached->token, token, len + 1);
+        cached->user_id = *user_id;
+        cached->role = *role;
+        cached->expires = expires;
+    }
+    return 1;
+}
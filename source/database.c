@@ -1,22 +1,620 @@
 #include "server.h"
 #include "db_security.h"
+#include <ctype.h>
 
-static sqlite3* db = NULL;
+// Every query the server runs is prepared once per connection and reused.
+// A connection (and so its statements) is used by one thread at a time,
+// from acquire_statement() until release_statement().
+typedef enum {
+    STMT_CREATE_USER = 0,
+    STMT_AUTHENTICATE_USER,
+    STMT_SAVE_MESSAGE,
+    STMT_UPDATE_USER_LOCATION,
+    STMT_GET_USER_LOCATIONS,
+    STMT_GET_USER_BY_USERNAME,
+    STMT_GET_USER_BY_ID,
+    STMT_GET_USER_MESSAGES,
+    STMT_GET_USER_MESSAGES_SINCE,
+#if !LOCATION_WRITE_BEHIND
+    STMT_GET_LOCATIONS_IN_BOX,
+#endif
+    STMT_EXPIRE_LOCATION,
+    STMT_GET_LOCATION_EXPIRIES,
+    STMT_CREATE_GROUP,
+    STMT_ADD_GROUP_MEMBER,
+    STMT_GET_GROUP_MEMBER,
+    STMT_MARK_GROUP_READ,
+    STMT_GET_USER_GROUPS,
+    STMT_GET_GROUP_MESSAGES,
+    STMT_GET_USER_GROUP_IDS,
+    STMT_SEARCH_MESSAGES,
+    STMT_SAVE_MEDIA,
+    STMT_ADD_MEDIA_UPLOAD,
+    STMT_GET_MEDIA,
+    STMT_COUNT
+} statement_id_t;
+
+static const struct {
+    const char* name;
+    int writes;
+    const char* sql;
+} statements[STMT_COUNT] = {
+    [STMT_CREATE_USER] = { "create_user", 1,
+        "INSERT INTO users (username, email, password_hash, role) VALUES (?, ?, ?, ?);" },
+    [STMT_AUTHENTICATE_USER] = { "authenticate_user", 0,
+        "SELECT * FROM users WHERE username = ? AND password_hash = ?;" },
+    [STMT_SAVE_MESSAGE] = { "save_message", 1,
+        "INSERT INTO messages (sender_id, receiver_id, group_id, content, media_path, timestamp, encrypted) VALUES (?, ?, ?, ?, ?, ?, ?);" },
+    [STMT_UPDATE_USER_LOCATION] = { "update_user_location", 1,
+        "UPDATE users SET latitude = ?, longitude = ?, location_updated = ?, location_duration = ?, location_consent = 1 WHERE id = ?;" },
+    [STMT_GET_USER_LOCATIONS] = { "get_user_locations", 0,
+        "SELECT * FROM users WHERE location_consent = 1 AND (location_updated + location_duration * 60) > ?;" },
+    [STMT_GET_USER_BY_USERNAME] = { "get_user_by_username", 0,
+        "SELECT * FROM users WHERE username = ?;" },
+    [STMT_GET_USER_BY_ID] = { "get_user_by_id", 0,
+        "SELECT * FROM users WHERE id = ?;" },
+    [STMT_GET_USER_MESSAGES] = { "get_user_messages", 0,
+        // Two bounded index range scans merged, instead of an OR that scans
+        // and sorts the whole table; messages to self come from the first.
+        // Usernames are joined in so callers need no per-row user lookups.
+        // Group messages have their own history, see below.
+        "SELECT m.*, s.username, r.username FROM ("
+        "SELECT * FROM (SELECT * FROM messages WHERE receiver_id = ?1 AND id < ?2 ORDER BY id DESC LIMIT ?3) "
+        "UNION ALL "
+        "SELECT * FROM (SELECT * FROM messages WHERE sender_id = ?1 AND receiver_id IS NOT ?1 AND group_id IS NULL "
+        "AND id < ?2 ORDER BY id DESC LIMIT ?3) "
+        "ORDER BY id DESC LIMIT ?3) AS m "
+        "LEFT JOIN users s ON s.id = m.sender_id "
+        "LEFT JOIN users r ON r.id = m.receiver_id "
+        "ORDER BY m.id DESC;" },
+    [STMT_GET_USER_MESSAGES_SINCE] = { "get_user_messages_since", 0,
+        // Same shape, walking forward from an id, oldest first
+        "SELECT m.*, s.username, r.username FROM ("
+        "SELECT * FROM (SELECT * FROM messages WHERE receiver_id = ?1 AND id > ?2 ORDER BY id LIMIT ?3) "
+        "UNION ALL "
+        "SELECT * FROM (SELECT * FROM messages WHERE sender_id = ?1 AND receiver_id IS NOT ?1 AND group_id IS NULL "
+        "AND id > ?2 ORDER BY id LIMIT ?3) "
+        "ORDER BY id LIMIT ?3) AS m "
+        "LEFT JOIN users s ON s.id = m.sender_id "
+        "LEFT JOIN users r ON r.id = m.receiver_id "
+        "ORDER BY m.id;" },
+#if !LOCATION_WRITE_BEHIND
+    [STMT_GET_LOCATIONS_IN_BOX] = { "get_locations_in_box", 0,
+        // The R*Tree stores 32-bit floats rounded outwards, so its matches
+        // are rechecked against the exact coordinates
+        "SELECT u.* FROM location_index l JOIN users u ON u.id = l.id "
+        "WHERE l.min_lat <= ?2 AND l.max_lat >= ?1 AND l.min_lng <= ?4 AND l.max_lng >= ?3 "
+        "AND l.expires > ?5 "
+        "AND u.latitude BETWEEN ?1 AND ?2 AND u.longitude BETWEEN ?3 AND ?4 "
+        "LIMIT ?6;" },
+#endif
+    [STMT_EXPIRE_LOCATION] = { "expire_location", 1,
+        // Skips users who shared again after the timer fired
+        "UPDATE users SET location_consent = 0, latitude = NULL, longitude = NULL "
+        "WHERE id = ?1 AND location_consent = 1 AND (location_updated + location_duration * 60) <= ?2;" },
+    [STMT_GET_LOCATION_EXPIRIES] = { "get_location_expiries", 0,
+        "SELECT id, location_updated + location_duration * 60 FROM users WHERE location_consent = 1;" },
+    [STMT_CREATE_GROUP] = { "create_group", 1,
+        "INSERT INTO groups (name, admin_id, created_at) VALUES (?, ?, ?);" },
+    [STMT_ADD_GROUP_MEMBER] = { "add_group_member", 1,
+        "INSERT OR IGNORE INTO group_members (group_id, user_id, role, joined_at) VALUES (?, ?, ?, ?);" },
+    [STMT_GET_GROUP_MEMBER] = { "get_group_member", 0,
+        "SELECT role, joined_at, last_read_id FROM group_members WHERE group_id = ? AND user_id = ?;" },
+    [STMT_MARK_GROUP_READ] = { "mark_group_read", 1,
+        // Cursors only move forward, whatever order reads are reported in
+        "UPDATE group_members SET last_read_id = ?3 WHERE group_id = ?1 AND user_id = ?2 AND last_read_id < ?3;" },
+    [STMT_GET_USER_GROUPS] = { "get_user_groups", 0,
+        // Unread messages are counted from the member's cursor along the
+        // group index, and only up to ?2 of them
+        "SELECT g.id, g.name, g.admin_id, g.created_at, m.role, m.last_read_id, "
+        "(SELECT MAX(id) FROM messages WHERE group_id = g.id), "
+        "(SELECT COUNT(*) FROM (SELECT 1 FROM messages WHERE group_id = g.id AND id > m.last_read_id LIMIT ?2)) "
+        "FROM group_members m JOIN groups g ON g.id = m.group_id "
+        "WHERE m.user_id = ?1 ORDER BY m.group_id;" },
+    [STMT_GET_GROUP_MESSAGES] = { "get_group_messages", 0,
+        // Shaped like the direct history so the same row reader serves both
+        "SELECT m.*, s.username, NULL FROM ("
+        "SELECT * FROM messages WHERE group_id = ?1 AND id < ?2 ORDER BY id DESC LIMIT ?3) AS m "
+        "LEFT JOIN users s ON s.id = m.sender_id "
+        "ORDER BY m.id DESC;" },
+    [STMT_GET_USER_GROUP_IDS] = { "get_user_group_ids", 0,
+        "SELECT group_id FROM group_members WHERE user_id = ?;" },
+    [STMT_SEARCH_MESSAGES] = { "search_messages", 0,
+        // Ranked ids come out of the full-text index first; only the page
+        // asked for is joined back to the messages and their senders
+        "SELECT m.*, s.username, r.username FROM ("
+        "SELECT rowid AS id, rank FROM messages_fts WHERE messages_fts MATCH ?1 "
+        "ORDER BY rank LIMIT ?2 OFFSET ?3) AS hit "
+        "JOIN messages m ON m.id = hit.id "
+        "LEFT JOIN users s ON s.id = m.sender_id "
+        "LEFT JOIN users r ON r.id = m.receiver_id "
+        "ORDER BY hit.rank;" },
+    [STMT_SAVE_MEDIA] = { "save_media", 1,
+        "INSERT OR IGNORE INTO media (hash, size, content_type, created_at) VALUES (?, ?, ?, ?);" },
+    [STMT_ADD_MEDIA_UPLOAD] = { "add_media_upload", 1,
+        "INSERT OR IGNORE INTO media_uploads (hash, user_id, uploaded_at) VALUES (?, ?, ?);" },
+    [STMT_GET_MEDIA] = { "get_media", 0,
+        // Visible to whoever uploaded it and to the parties of any message
+        // it is attached to
+        "SELECT hash, size, content_type, created_at FROM media WHERE hash = ?1 AND ("
+        "EXISTS (SELECT 1 FROM media_uploads WHERE hash = ?1 AND user_id = ?2) OR "
+        "EXISTS (SELECT 1 FROM messages WHERE media_path = ?1 AND "
+        "(sender_id = ?2 OR receiver_id = ?2 OR "
+        "group_id IN (SELECT group_id FROM group_members WHERE user_id = ?2))));" },
+};
+
+typedef struct {
+    sqlite3* handle;
+    sqlite3_stmt* statements[STMT_COUNT];
+    uint64_t acquire_ns; // when the current holder asked for it
+} db_conn_t;
+
+// Writes go through one dedicated connection; reads check out one of a pool
+// of read connections so history reads run in parallel under WAL.
+static db_conn_t writer;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static db_conn_t* readers = NULL;
+static db_conn_t** free_readers = NULL;
+static int reader_count = 0;
+static int free_reader_count = 0;
+static pthread_mutex_t readers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reader_available = PTHREAD_COND_INITIALIZER;
+
+static uint64_t statement_hits[STMT_COUNT];
+static uint64_t statement_prepares[STMT_COUNT];
+
+// Group commit for save_message(): callers queue their message and sleep
+// while one thread inserts everything queued so far in a single
+// transaction, so a burst of sends shares one commit instead of paying
+// for one each.
+typedef struct pending_message {
+    message_t* msg;
+    int id;
+    int done;
+    struct pending_message* next;
+} pending_message_t;
+
+static pending_message_t* pending_head = NULL;
+static pending_message_t* pending_tail = NULL;
+static int pending_count = 0;
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending_ready;
+static pthread_cond_t pending_done = PTHREAD_COND_INITIALIZER;
+
+static message_batch_stats_t batch_stats;
+
+static int open_connection(db_conn_t* conn, int read_only) {
+    memset(conn, 0, sizeof(*conn));
+
+    // Connections are never shared between threads at the same time, so
+    // SQLite's own per-connection mutex is redundant
+    int rc = sqlite3_open_v2(DB_FILE, &conn->handle,
+                             SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(conn->handle));
+        return -1;
+    }
 
-int init_database(void) {
     char db_password[256];
+    char pragma_cmd[512];
     get_db_password(db_password, sizeof(db_password));
-    
-    int rc = sqlite3_open("telegram_clone.db", &db);
-    if (rc == SQLITE_OK) {
-        char pragma_cmd[512];
-        snprintf(pragma_cmd, sizeof(pragma_cmd), "PRAGMA key = '%s';", db_password);
-        sqlite3_exec(db, pragma_cmd, NULL, NULL, NULL);
-        memset(db_password, 0, sizeof(db_password));
-        memset(pragma_cmd, 0, sizeof(pragma_cmd));
-    }
-    if (rc) {
-        fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(db));
+    snprintf(pragma_cmd, sizeof(pragma_cmd), "PRAGMA key = '%s';", db_password);
+    sqlite3_exec(conn->handle, pragma_cmd, NULL, NULL, NULL);
+    memset(db_password, 0, sizeof(db_password));
+    memset(pragma_cmd, 0, sizeof(pragma_cmd));
+
+    snprintf(pragma_cmd, sizeof(pragma_cmd),
+        "PRAGMA busy_timeout = %d;"
+        "PRAGMA synchronous = %s;"
+        "PRAGMA cache_size = -%d;"
+        "PRAGMA mmap_size = %lld;"
+        "PRAGMA temp_store = MEMORY;"
+        "PRAGMA query_only = %d;",
+        DB_BUSY_TIMEOUT_MS, DB_SYNCHRONOUS, DB_CACHE_SIZE_KB, (long long)DB_MMAP_SIZE, read_only);
+
+    char* err_msg = NULL;
+    if (sqlite3_exec(conn->handle, pragma_cmd, NULL, NULL, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        return -1;
+    }
+    return 0;
+}
+
+static int prepare_statement(db_conn_t* conn, statement_id_t id) {
+    int rc = sqlite3_prepare_v3(conn->handle, statements[id].sql, -1, SQLITE_PREPARE_PERSISTENT,
+                                &conn->statements[id], NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Failed to prepare %s: %s\n", statements[id].name, sqlite3_errmsg(conn->handle));
+        conn->statements[id] = NULL;
+        return -1;
+    }
+    __atomic_add_fetch(&statement_prepares[id], 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// The connection's copy of a statement, prepared now if that failed
+// before; NULL if it still cannot be. Caller holds the connection.
+static sqlite3_stmt* cached_statement(db_conn_t* conn, statement_id_t id) {
+    if (conn->statements[id]) {
+        __atomic_add_fetch(&statement_hits[id], 1, __ATOMIC_RELAXED);
+    } else if (prepare_statement(conn, id) < 0) {
+        return NULL;
+    }
+    return conn->statements[id];
+}
+
+static db_conn_t* acquire_connection(int writes) {
+    if (writes) {
+        pthread_mutex_lock(&writer_lock);
+        return &writer;
+    }
+
+    pthread_mutex_lock(&readers_lock);
+    while (free_reader_count == 0) {
+        pthread_cond_wait(&reader_available, &readers_lock);
+    }
+    db_conn_t* conn = free_readers[--free_reader_count];
+    pthread_mutex_unlock(&readers_lock);
+    return conn;
+}
+
+static void release_connection(db_conn_t* conn) {
+    if (conn == &writer) {
+        pthread_mutex_unlock(&writer_lock);
+        return;
+    }
+
+    pthread_mutex_lock(&readers_lock);
+    free_readers[free_reader_count++] = conn;
+    pthread_cond_signal(&reader_available);
+    pthread_mutex_unlock(&readers_lock);
+}
+
+// Checks out the writer or a reader, as the statement requires, and returns
+// its cached copy of the statement; NULL (with nothing checked out) if it
+// cannot be prepared.
+static sqlite3_stmt* acquire_statement(statement_id_t id, db_conn_t** conn_out) {
+    uint64_t start = monotonic_ns();
+    db_conn_t* conn = acquire_connection(statements[id].writes);
+    conn->acquire_ns = start;
+    sqlite3_stmt* stmt = cached_statement(conn, id);
+    if (!stmt) {
+        release_connection(conn);
+        metrics_add_phase(PHASE_DB, monotonic_ns() - start);
+        return NULL;
+    }
+    *conn_out = conn;
+    return stmt;
+}
+
+static void release_statement(db_conn_t* conn, sqlite3_stmt* stmt) {
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    uint64_t acquired = conn->acquire_ns;
+    release_connection(conn);
+    metrics_add_phase(PHASE_DB, monotonic_ns() - acquired);
+}
+
+// Schema changes after the initial tables. Entry i upgrades a database at
+// PRAGMA user_version i to i + 1; append new steps, never edit old ones.
+static const char* const migrations[] = {
+    // 1: per-participant message indexes. Index entries are ordered by
+    // (column, rowid), so each also serves "newest first" by id.
+    "CREATE INDEX IF NOT EXISTS idx_messages_receiver ON messages(receiver_id);"
+    "CREATE INDEX IF NOT EXISTS idx_messages_sender ON messages(sender_id);",
+
+    // 2: an index on expiry for the unfiltered location list. This step
+    // also used to create the location R*Tree, which depends on the build
+    // and is now left to sync_location_index().
+    "CREATE INDEX IF NOT EXISTS idx_users_location_expiry "
+    "ON users(location_updated + location_duration * 60) WHERE location_consent = 1;",
+
+    // 3: group membership with a read cursor per member. A group message is
+    // one row that members read through the group index, never a copy per
+    // member. Direct messages now store no group at all, which keeps them
+    // out of that index.
+    "CREATE TABLE IF NOT EXISTS group_members ("
+    "group_id INTEGER NOT NULL REFERENCES groups(id),"
+    "user_id INTEGER NOT NULL REFERENCES users(id),"
+    "role INTEGER NOT NULL DEFAULT 0,"
+    "joined_at INTEGER NOT NULL,"
+    "last_read_id INTEGER NOT NULL DEFAULT 0,"
+    "PRIMARY KEY (group_id, user_id)"
+    ") WITHOUT ROWID;"
+    "CREATE INDEX IF NOT EXISTS idx_group_members_user ON group_members(user_id);"
+    "INSERT OR IGNORE INTO group_members (group_id, user_id, role, joined_at) "
+    "SELECT id, admin_id, 1, created_at FROM groups;"
+    "UPDATE messages SET group_id = NULL WHERE group_id = 0;"
+    "CREATE INDEX IF NOT EXISTS idx_messages_group ON messages(group_id) WHERE group_id IS NOT NULL;",
+
+    // 4: full-text index of message contents. It stores no text of its own
+    // but reads it from a view over messages, which adds a parties column
+    // holding a token per participant ("u<id>" for direct messages,
+    // "g<id>" for group ones): a search intersects the words with the
+    // caller's parties inside the index instead of filtering every match.
+    // Triggers keep it in step with messages, inside the same transaction.
+    "CREATE VIEW IF NOT EXISTS messages_search_source AS SELECT id, content, "
+    "CASE WHEN group_id IS NOT NULL THEN 'g' || group_id "
+    "ELSE 'u' || sender_id || CASE WHEN receiver_id > 0 AND receiver_id != sender_id "
+    "THEN ' u' || receiver_id ELSE '' END END AS parties "
+    "FROM messages;"
+    "CREATE VIRTUAL TABLE IF NOT EXISTS messages_fts USING fts5("
+    "content, parties, content = 'messages_search_source', content_rowid = 'id', "
+    "tokenize = 'unicode61 remove_diacritics 2');"
+    "INSERT INTO messages_fts(messages_fts, rank) VALUES ('rank', 'bm25(1.0, 0.0)');"
+    "INSERT INTO messages_fts(messages_fts) VALUES ('rebuild');"
+    "CREATE TRIGGER IF NOT EXISTS messages_search_insert AFTER INSERT ON messages BEGIN "
+    "INSERT INTO messages_fts(rowid, content, parties) "
+    "SELECT id, content, parties FROM messages_search_source WHERE id = NEW.id; END;"
+    "CREATE TRIGGER IF NOT EXISTS messages_search_delete BEFORE DELETE ON messages BEGIN "
+    "INSERT INTO messages_fts(messages_fts, rowid, content, parties) "
+    "SELECT 'delete', id, content, parties FROM messages_search_source WHERE id = OLD.id; END;"
+    "CREATE TRIGGER IF NOT EXISTS messages_search_unindex BEFORE UPDATE OF sender_id, receiver_id, group_id, content "
+    "ON messages BEGIN "
+    "INSERT INTO messages_fts(messages_fts, rowid, content, parties) "
+    "SELECT 'delete', id, content, parties FROM messages_search_source WHERE id = OLD.id; END;"
+    "CREATE TRIGGER IF NOT EXISTS messages_search_reindex AFTER UPDATE OF sender_id, receiver_id, group_id, content "
+    "ON messages BEGIN "
+    "INSERT INTO messages_fts(rowid, content, parties) "
+    "SELECT id, content, parties FROM messages_search_source WHERE id = NEW.id; END;",
+
+    // 5: uploaded media, one row per distinct content, and who uploaded
+    // it. Messages refer to media by hash in media_path, NULL when there is
+    // none, indexed for the access check on download.
+    "CREATE TABLE IF NOT EXISTS media ("
+    "hash TEXT PRIMARY KEY,"
+    "size INTEGER NOT NULL,"
+    "content_type TEXT NOT NULL,"
+    "created_at INTEGER NOT NULL"
+    ") WITHOUT ROWID;"
+    "CREATE TABLE IF NOT EXISTS media_uploads ("
+    "hash TEXT NOT NULL REFERENCES media(hash),"
+    "user_id INTEGER NOT NULL REFERENCES users(id),"
+    "uploaded_at INTEGER NOT NULL,"
+    "PRIMARY KEY (hash, user_id)"
+    ") WITHOUT ROWID;"
+    "UPDATE messages SET media_path = NULL WHERE media_path = '';"
+    "CREATE INDEX IF NOT EXISTS idx_messages_media ON messages(media_path) WHERE media_path IS NOT NULL;",
+};
+
+static int run_migrations(sqlite3* db) {
+    sqlite3_stmt* stmt;
+    int version = 0;
+    if (sqlite3_prepare_v2(db, "PRAGMA user_version;", -1, &stmt, NULL) != SQLITE_OK) return -1;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        version = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+
+    int target = sizeof(migrations) / sizeof(migrations[0]);
+    for (; version < target; version++) {
+        char set_version[64];
+        snprintf(set_version, sizeof(set_version), "PRAGMA user_version = %d;", version + 1);
+
+        char* err_msg = NULL;
+        if (sqlite3_exec(db, "BEGIN;", NULL, NULL, &err_msg) != SQLITE_OK ||
+            sqlite3_exec(db, migrations[version], NULL, NULL, &err_msg) != SQLITE_OK ||
+            sqlite3_exec(db, set_version, NULL, NULL, &err_msg) != SQLITE_OK ||
+            sqlite3_exec(db, "COMMIT;", NULL, NULL, &err_msg) != SQLITE_OK) {
+            fprintf(stderr, "Migration to schema version %d failed: %s\n", version + 1, err_msg);
+            sqlite3_free(err_msg);
+            sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+            return -1;
+        }
+        printf("Database schema migrated to version %d\n", version + 1);
+    }
+    return 0;
+}
+
+// The R*Tree of shared locations only exists in builds that read locations
+// from the database; with write-behind, box queries use the location
+// store's grid. A build without write-behind creates it once, filled from
+// users, and keeps it in step with triggers. One with write-behind removes
+// any left behind by an earlier build or by schema version 2, rather than
+// keep maintaining an index nothing reads.
+static int sync_location_index(sqlite3* db) {
+#if LOCATION_WRITE_BEHIND
+    const char* sql =
+        "DROP TRIGGER IF EXISTS users_location_index;"
+        "DROP TRIGGER IF EXISTS users_location_unindex;"
+        "DROP TABLE IF EXISTS location_index;";
+#else
+    const char* sql =
+        "CREATE VIRTUAL TABLE IF NOT EXISTS location_index USING rtree(id, min_lat, max_lat, min_lng, max_lng, +expires);"
+        "INSERT INTO location_index "
+        "SELECT id, latitude, latitude, longitude, longitude, location_updated + location_duration * 60 "
+        "FROM users WHERE location_consent = 1 AND NOT EXISTS (SELECT 1 FROM location_index);"
+        "CREATE TRIGGER IF NOT EXISTS users_location_index "
+        "AFTER UPDATE OF latitude, longitude, location_updated, location_duration, location_consent ON users "
+        "WHEN NEW.location_consent = 1 BEGIN "
+        "INSERT OR REPLACE INTO location_index VALUES (NEW.id, NEW.latitude, NEW.latitude, NEW.longitude, NEW.longitude, "
+        "NEW.location_updated + NEW.location_duration * 60); END;"
+        "CREATE TRIGGER IF NOT EXISTS users_location_unindex "
+        "AFTER UPDATE OF location_consent ON users WHEN NEW.location_consent = 0 BEGIN "
+        "DELETE FROM location_index WHERE id = NEW.id; END;";
+#endif
+    char* err_msg = NULL;
+    if (sqlite3_exec(db, "BEGIN;", NULL, NULL, &err_msg) != SQLITE_OK ||
+        sqlite3_exec(db, sql, NULL, NULL, &err_msg) != SQLITE_OK ||
+        sqlite3_exec(db, "COMMIT;", NULL, NULL, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "Location index setup failed: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+        return -1;
+    }
+    return 0;
+}
+
+static void read_user_row(sqlite3_stmt* stmt, user_t* user) {
+    user->id = sqlite3_column_int(stmt, 0);
+    strcpy(user->username, (char*)sqlite3_column_text(stmt, 1));
+    strcpy(user->email, (char*)sqlite3_column_text(stmt, 2));
+    strcpy(user->password_hash, (char*)sqlite3_column_text(stmt, 3));
+    user->role = sqlite3_column_int(stmt, 4);
+    user->location_consent = sqlite3_column_int(stmt, 5);
+    user->latitude = sqlite3_column_double(stmt, 6);
+    user->longitude = sqlite3_column_double(stmt, 7);
+    user->location_updated = sqlite3_column_int64(stmt, 8);
+    user->location_duration = sqlite3_column_int(stmt, 9);
+}
+
+static void commit_message_batch(pending_message_t* batch) {
+    uint64_t start = monotonic_ns();
+    db_conn_t* conn;
+    sqlite3_stmt* stmt = acquire_statement(STMT_SAVE_MESSAGE, &conn);
+    if (!stmt) {
+        for (pending_message_t* p = batch; p; p = p->next) p->id = -1;
+        return;
+    }
+
+    int in_transaction = sqlite3_exec(conn->handle, "BEGIN IMMEDIATE;", NULL, NULL, NULL) == SQLITE_OK;
+    int aborted = 0;
+    for (pending_message_t* p = batch; p && !aborted; p = p->next) {
+        message_t* msg = p->msg;
+        sqlite3_bind_int(stmt, 1, msg->sender_id);
+        sqlite3_bind_int(stmt, 2, msg->receiver_id);
+        if (msg->group_id > 0) {
+            sqlite3_bind_int(stmt, 3, msg->group_id);
+        } else {
+            sqlite3_bind_null(stmt, 3);
+        }
+        sqlite3_bind_text(stmt, 4, msg->content, -1, SQLITE_STATIC);
+        if (msg->media_path[0]) {
+            sqlite3_bind_text(stmt, 5, msg->media_path, -1, SQLITE_STATIC);
+        } else {
+            sqlite3_bind_null(stmt, 5);
+        }
+        sqlite3_bind_int64(stmt, 6, msg->timestamp);
+        sqlite3_bind_int(stmt, 7, msg->encrypted);
+
+        // A constraint failure only undoes its own insert, but errors such as
+        // SQLITE_FULL, SQLITE_IOERR or SQLITE_NOMEM roll back the whole
+        // transaction; the rest must then not be inserted outside it
+        int rc = sqlite3_step(stmt);
+        p->id = (rc == SQLITE_DONE) ? sqlite3_last_insert_rowid(conn->handle) : -1;
+        if (rc != SQLITE_DONE && in_transaction && sqlite3_get_autocommit(conn->handle)) aborted = 1;
+        sqlite3_reset(stmt);
+    }
+
+    if (aborted) {
+        fprintf(stderr, "Message batch rolled back: %s\n", sqlite3_errmsg(conn->handle));
+        for (pending_message_t* p = batch; p; p = p->next) p->id = -1;
+    } else if (in_transaction && sqlite3_exec(conn->handle, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Message batch commit failed: %s\n", sqlite3_errmsg(conn->handle));
+        sqlite3_exec(conn->handle, "ROLLBACK;", NULL, NULL, NULL);
+        for (pending_message_t* p = batch; p; p = p->next) p->id = -1;
+    }
+    release_statement(conn, stmt);
+
+    __atomic_add_fetch(&batch_stats.commit_ns_total, monotonic_ns() - start, __ATOMIC_RELAXED);
+}
+
+static void* message_batcher(void* arg) {
+    (void)arg;
+
+    // Whether messages queued up while the last batch was committing. Only
+    // then are there other senders worth waiting for; a lone sender's
+    // message is committed straight away.
+    int contended = 0;
+
+    pthread_mutex_lock(&pending_lock);
+    while (1) {
+        while (!pending_head) {
+            contended = 0;
+            pthread_cond_wait(&pending_ready, &pending_lock);
+        }
+
+        // Give concurrent senders a moment to join, unless the batch is full
+        if (MESSAGE_BATCH_WINDOW_US > 0 && contended && pending_count < MESSAGE_BATCH_MAX) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_nsec += MESSAGE_BATCH_WINDOW_US * 1000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            while (pending_count < MESSAGE_BATCH_MAX &&
+                   pthread_cond_timedwait(&pending_ready, &pending_lock, &deadline) == 0) {
+            }
+        }
+
+        pending_message_t* batch = pending_head;
+        pending_message_t* last = batch;
+        int size = 1;
+        while (size < MESSAGE_BATCH_MAX && last->next) {
+            last = last->next;
+            size++;
+        }
+        pending_head = last->next;
+        if (!pending_head) pending_tail = NULL;
+        pending_count -= size;
+        last->next = NULL;
+        pthread_mutex_unlock(&pending_lock);
+
+        commit_message_batch(batch);
+
+        __atomic_add_fetch(&batch_stats.batches, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&batch_stats.messages, size, __ATOMIC_RELAXED);
+        if ((uint64_t)size > batch_stats.largest_batch) {
+            __atomic_store_n(&batch_stats.largest_batch, size, __ATOMIC_RELAXED);
+        }
+
+        pthread_mutex_lock(&pending_lock);
+        contended = pending_count > 0;
+        for (pending_message_t* p = batch; p; p = p->next) {
+            p->done = 1;
+        }
+        pthread_cond_broadcast(&pending_done);
+    }
+    return NULL;
+}
+
+static int start_message_batcher(void) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pending_ready, &attr);
+    pthread_condattr_destroy(&attr);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, message_batcher, NULL) != 0) {
+        perror("Failed to start message batcher");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+#if LOCATION_WRITE_BEHIND
+static int query_user_locations(user_row_fn fn, void* ctx);
+#endif
+
+#if AUTO_DELETE_EXPIRED_LOCATIONS
+// Gives every shared location stored before this run its timer; those
+// already past their time are purged on the first tick
+static int schedule_location_expiries(void) {
+    db_conn_t* conn;
+    sqlite3_stmt* stmt = acquire_statement(STMT_GET_LOCATION_EXPIRIES, &conn);
+    if (!stmt) return -1;
+
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        location_expiry_schedule(sqlite3_column_int(stmt, 0), (time_t)sqlite3_column_int64(stmt, 1));
+    }
+    release_statement(conn, stmt);
+    return 0;
+}
+#endif
+
+int init_database(void) {
+    if (open_connection(&writer, 0) < 0) return -1;
+    sqlite3* db = writer.handle;
+
+    // WAL lets the read connections run alongside the writer
+    int rc = sqlite3_exec(db, "PRAGMA journal_mode = WAL;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Can't enable WAL: %s\n", sqlite3_errmsg(db));
         return -1;
     }
 
@@ -81,232 +679,799 @@ int init_database(void) {
         return -1;
     }
 
+    if (run_migrations(db) < 0 || sync_location_index(db) < 0) return -1;
+
+    reader_count = DB_READER_CONNECTIONS;
+    if (reader_count <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        reader_count = cores > 1 ? (int)cores : 2;
+    }
+    readers = calloc(reader_count, sizeof(db_conn_t));
+    free_readers = calloc(reader_count, sizeof(db_conn_t*));
+    if (!readers || !free_readers) return -1;
+
+    for (int i = 0; i < reader_count; i++) {
+        if (open_connection(&readers[i], 1) < 0) return -1;
+        free_readers[free_reader_count++] = &readers[i];
+    }
+
+    // A statement that fails here (SQLITE_BUSY on a schema read, say) is
+    // reported and prepared again on first use, see cached_statement()
+    for (int i = 0; i < STMT_COUNT; i++) {
+        if (statements[i].writes) {
+            prepare_statement(&writer, i);
+        } else {
+            for (int r = 0; r < reader_count; r++) {
+                prepare_statement(&readers[r], i);
+            }
+        }
+    }
+
+    if (user_cache_init(USER_CACHE_CAPACITY, USER_CACHE_SHARDS) < 0) return -1;
+    if (start_message_batcher() < 0) return -1;
+#if LOCATION_WRITE_BEHIND
+    if (query_user_locations(location_store_load, NULL) < 0 || location_store_start() < 0) return -1;
+#endif
+#if AUTO_DELETE_EXPIRED_LOCATIONS
+    if (location_expiry_start() < 0 || schedule_location_expiries() < 0) return -1;
+#endif
+
     return 0;
 }
 
+int get_statement_stats(db_statement_stats_t* stats, int max) {
+    int count = 0;
+    for (int i = 0; i < STMT_COUNT && count < max; i++, count++) {
+        stats[i].name = statements[i].name;
+        stats[i].hits = __atomic_load_n(&statement_hits[i], __ATOMIC_RELAXED);
+        stats[i].prepares = __atomic_load_n(&statement_prepares[i], __ATOMIC_RELAXED);
+    }
+    return count;
+}
+
 int create_user(const char* username, const char* email, const char* password, user_role_t role) {
     char hash[HASH_SIZE];
     hash_password(password, hash);
 
-    const char* sql = "INSERT INTO users (username, email, password_hash, role) VALUES (?, ?, ?, ?);";
-    sqlite3_stmt* stmt;
-    
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) return -1;
+    db_conn_t* conn;
+    sqlite3_stmt* stmt = acquire_statement(STMT_CREATE_USER, &conn);
+    if (!stmt) return -1;
 
     sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
     sqlite3_bind_text(stmt, 2, email, -1, SQLITE_STATIC);
     sqlite3_bind_text(stmt, 3, hash, -1, SQLITE_STATIC);
     sqlite3_bind_int(stmt, 4, role);
 
-    rc = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+    int rc = sqlite3_step(stmt);
+    int user_id = (rc == SQLITE_DONE) ? sqlite3_last_insert_rowid(conn->handle) : -1;
+    release_statement(conn, stmt);
 
-    return (rc == SQLITE_DONE) ? sqlite3_last_insert_rowid(db) : -1;
+    // Misses are not cached, but drop any mapping left for this name
+    if (user_id > 0) user_cache_forget_username(username);
+    return user_id;
 }
 
 user_t* authenticate_user(const char* username, const char* password) {
     char hash[HASH_SIZE];
     hash_password(password, hash);
 
-    const char* sql = "SELECT * FROM users WHERE username = ? AND password_hash = ?;";
-    sqlite3_stmt* stmt;
-    
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) return NULL;
+    db_conn_t* conn;
+    sqlite3_stmt* stmt = acquire_statement(STMT_AUTHENTICATE_USER, &conn);
+    if (!stmt) return NULL;
 
     sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
     sqlite3_bind_text(stmt, 2, hash, -1, SQLITE_STATIC);
 
-    rc = sqlite3_step(stmt);
-    if (rc != SQLITE_ROW) {
-        sqlite3_finalize(stmt);
-        return NULL;
+    user_t* user = NULL;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        user = malloc(sizeof(user_t));
+        read_user_row(stmt, user);
     }
 
-    user_t* user = malloc(sizeof(user_t));
-    user->id = sqlite3_column_int(stmt, 0);
-    strcpy(user->username, (char*)sqlite3_column_text(stmt, 1));
-    strcpy(user->email, (char*)sqlite3_column_text(stmt, 2));
-    strcpy(user->password_hash, (char*)sqlite3_column_text(stmt, 3));
-    user->role = sqlite3_column_int(stmt, 4);
-    user->location_consent = sqlite3_column_int(stmt, 5);
-    user->latitude = sqlite3_column_double(stmt, 6);
-    user->longitude = sqlite3_column_double(stmt, 7);
-    user->location_updated = sqlite3_column_int64(stmt, 8);
-    user->location_duration = sqlite3_column_int(stmt, 9);
-
-    sqlite3_finalize(stmt);
+    release_statement(conn, stmt);
     return user;
 }
 
+// Returns once the message is committed, with its id or -1
 int save_message(message_t* msg) {
-    const char* sql = "INSERT INTO messages (sender_id, receiver_id, group_id, content, media_path, timestamp, encrypted) VALUES (?, ?, ?, ?, ?, ?, ?);";
-    sqlite3_stmt* stmt;
-    
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) return -1;
-
-    sqlite3_bind_int(stmt, 1, msg->sender_id);
-    sqlite3_bind_int(stmt, 2, msg->receiver_id);
-    sqlite3_bind_int(stmt, 3, msg->group_id);
-    sqlite3_bind_text(stmt, 4, msg->content, -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 5, msg->media_path, -1, SQLITE_STATIC);
-    sqlite3_bind_int64(stmt, 6, msg->timestamp);
-    sqlite3_bind_int(stmt, 7, msg->encrypted);
-
-    rc = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+    pending_message_t entry = { msg, -1, 0, NULL };
+    uint64_t start = monotonic_ns();
+
+    pthread_mutex_lock(&pending_lock);
+    if (pending_tail) {
+        pending_tail->next = &entry;
+    } else {
+        pending_head = &entry;
+    }
+    pending_tail = &entry;
+    pending_count++;
+    pthread_cond_signal(&pending_ready);
 
-    return (rc == SQLITE_DONE) ? sqlite3_last_insert_rowid(db) : -1;
+    while (!entry.done) {
+        pthread_cond_wait(&pending_done, &pending_lock);
+    }
+    pthread_mutex_unlock(&pending_lock);
+    metrics_add_phase(PHASE_DB, monotonic_ns() - start);
+
+    // Committed: wake long-poll waiters of both parties. Group messages are
+    // not part of the direct history that waiters watch.
+    if (entry.id >= 0 && msg->group_id <= 0) {
+        long_poll_notify(msg->sender_id, entry.id);
+        if (msg->receiver_id > 0 && msg->receiver_id != msg->sender_id) {
+            long_poll_notify(msg->receiver_id, entry.id);
+        }
+    }
+    return entry.id;
+}
+
+void get_message_batch_stats(message_batch_stats_t* stats) {
+    stats->batches = __atomic_load_n(&batch_stats.batches, __ATOMIC_RELAXED);
+    stats->messages = __atomic_load_n(&batch_stats.messages, __ATOMIC_RELAXED);
+    stats->largest_batch = __atomic_load_n(&batch_stats.largest_batch, __ATOMIC_RELAXED);
+    stats->commit_ns_total = __atomic_load_n(&batch_stats.commit_ns_total, __ATOMIC_RELAXED);
 }
 
 int update_user_location(int user_id, double lat, double lng, int duration) {
-    const char* sql = "UPDATE users SET latitude = ?, longitude = ?, location_updated = ?, location_duration = ?, location_consent = 1 WHERE id = ?;";
-    sqlite3_stmt* stmt;
-    
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) return -1;
+    time_t now = time(NULL);
+
+#if LOCATION_WRITE_BEHIND
+    // Absorbed in memory; the store's flusher writes it out
+    int rc = location_store_update(user_id, NULL, lat, lng, now, duration);
+    if (rc == 1) {
+        user_t user;
+        rc = find_user_by_id(user_id, &user) < 0 ? -1 :
+             location_store_update(user_id, user.username, lat, lng, now, duration);
+    }
+    if (rc < 0) return -1;
+#else
+    db_conn_t* conn;
+    sqlite3_stmt* stmt = acquire_statement(STMT_UPDATE_USER_LOCATION, &conn);
+    if (!stmt) return -1;
 
     sqlite3_bind_double(stmt, 1, lat);
     sqlite3_bind_double(stmt, 2, lng);
-    sqlite3_bind_int64(stmt, 3, time(NULL));
+    sqlite3_bind_int64(stmt, 3, now);
     sqlite3_bind_int(stmt, 4, duration);
     sqlite3_bind_int(stmt, 5, user_id);
 
-    rc = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+    int rc = sqlite3_step(stmt);
+    release_statement(conn, stmt);
+    user_cache_invalidate(user_id);
+    if (rc != SQLITE_DONE) return -1;
+#endif
 
-    return (rc == SQLITE_DONE) ? 0 : -1;
+#if AUTO_DELETE_EXPIRED_LOCATIONS
+    location_expiry_schedule(user_id, now + (time_t)duration * 60);
+#endif
+    return 0;
 }
 
-int get_user_locations(user_t** users, int* count) {
+#if LOCATION_WRITE_BEHIND
+// Serialises flushes with expiry, so a flush cannot write back a position
+// that expiry has just taken out of the store and purged
+static pthread_mutex_t location_write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int flush_user_locations(void) {
+    // Only touched with location_write_lock held
+    static location_update_t* updates = NULL;
+    static int cap = 0;
+
+    pthread_mutex_lock(&location_write_lock);
+    int count = location_store_take_dirty(&updates, &cap);
+    if (count == 0) {
+        pthread_mutex_unlock(&location_write_lock);
+        return 0;
+    }
+
+    db_conn_t* conn;
+    sqlite3_stmt* stmt = acquire_statement(STMT_UPDATE_USER_LOCATION, &conn);
+    if (!stmt) {
+        location_store_requeue(updates, count);
+        pthread_mutex_unlock(&location_write_lock);
+        return -1;
+    }
+
+    int rc = sqlite3_exec(conn->handle, "BEGIN IMMEDIATE;", NULL, NULL, NULL);
+    for (int i = 0; i < count && rc == SQLITE_OK; i++) {
+        sqlite3_bind_double(stmt, 1, updates[i].latitude);
+        sqlite3_bind_double(stmt, 2, updates[i].longitude);
+        sqlite3_bind_int64(stmt, 3, updates[i].updated);
+        sqlite3_bind_int(stmt, 4, updates[i].duration);
+        sqlite3_bind_int(stmt, 5, updates[i].user_id);
+        if (sqlite3_step(stmt) != SQLITE_DONE) rc = SQLITE_ERROR;
+        sqlite3_reset(stmt);
+    }
+    if (rc == SQLITE_OK) rc = sqlite3_exec(conn->handle, "COMMIT;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Location flush failed: %s\n", sqlite3_errmsg(conn->handle));
+        sqlite3_exec(conn->handle, "ROLLBACK;", NULL, NULL, NULL);
+        location_store_requeue(updates, count);
+    }
+    release_statement(conn, stmt);
+    pthread_mutex_unlock(&location_write_lock);
+
+    for (int i = 0; i < count; i++) user_cache_invalidate(updates[i].user_id);
+    return rc == SQLITE_OK ? count : -1;
+}
+#endif
+
+#if AUTO_DELETE_EXPIRED_LOCATIONS
+int expire_user_locations(const int* user_ids, int count) {
     time_t now = time(NULL);
-    const char* sql = "SELECT * FROM users WHERE location_consent = 1 AND (location_updated + location_duration * 60) > ?;";
-    sqlite3_stmt* stmt;
-    
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) return -1;
-
-    sqlite3_bind_int64(stmt, 1, now);
-
-    *count = 0;
-    *users = NULL;
-
-    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
-        *users = realloc(*users, sizeof(user_t) * (*count + 1));
-        user_t* user = &(*users)[*count];
-        
-        user->id = sqlite3_column_int(stmt, 0);
-        strcpy(user->username, (char*)sqlite3_column_text(stmt, 1));
-        strcpy(user->email, (char*)sqlite3_column_text(stmt, 2));
-        user->role = sqlite3_column_int(stmt, 4);
-        user->location_consent = sqlite3_column_int(stmt, 5);
-        user->latitude = sqlite3_column_double(stmt, 6);
-        user->longitude = sqlite3_column_double(stmt, 7);
-        user->location_updated = sqlite3_column_int64(stmt, 8);
-        user->location_duration = sqlite3_column_int(stmt, 9);
-        
-        (*count)++;
+#if LOCATION_WRITE_BEHIND
+    pthread_mutex_lock(&location_write_lock);
+    location_store_forget(user_ids, count, now);
+#endif
+
+    db_conn_t* conn;
+    sqlite3_stmt* stmt = acquire_statement(STMT_EXPIRE_LOCATION, &conn);
+    if (!stmt) {
+#if LOCATION_WRITE_BEHIND
+        pthread_mutex_unlock(&location_write_lock);
+#endif
+        return -1;
     }
 
-    sqlite3_finalize(stmt);
+    int expired = 0;
+    int in_transaction = sqlite3_exec(conn->handle, "BEGIN IMMEDIATE;", NULL, NULL, NULL) == SQLITE_OK;
+    for (int i = 0; i < count; i++) {
+        sqlite3_bind_int(stmt, 1, user_ids[i]);
+        sqlite3_bind_int64(stmt, 2, now);
+        if (sqlite3_step(stmt) == SQLITE_DONE && sqlite3_changes(conn->handle) > 0) expired++;
+        sqlite3_reset(stmt);
+    }
+    if (in_transaction && sqlite3_exec(conn->handle, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Location expiry commit failed: %s\n", sqlite3_errmsg(conn->handle));
+        sqlite3_exec(conn->handle, "ROLLBACK;", NULL, NULL, NULL);
+        expired = -1;
+    }
+    release_statement(conn, stmt);
+#if LOCATION_WRITE_BEHIND
+    pthread_mutex_unlock(&location_write_lock);
+#endif
+
+    for (int i = 0; i < count; i++) user_cache_invalidate(user_ids[i]);
+    return expired;
+}
+#endif
+
+// Hands each row of a users query to fn, without the password hash
+static void each_location_row(sqlite3_stmt* stmt, int* count, user_row_fn fn, void* ctx) {
+    user_t user = {0};
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        user.id = sqlite3_column_int(stmt, 0);
+        strcpy(user.username, (char*)sqlite3_column_text(stmt, 1));
+        strcpy(user.email, (char*)sqlite3_column_text(stmt, 2));
+        user.role = sqlite3_column_int(stmt, 4);
+        user.location_consent = sqlite3_column_int(stmt, 5);
+        user.latitude = sqlite3_column_double(stmt, 6);
+        user.longitude = sqlite3_column_double(stmt, 7);
+        user.location_updated = sqlite3_column_int64(stmt, 8);
+        user.location_duration = sqlite3_column_int(stmt, 9);
+
+        if (count) (*count)++;
+        if (fn(&user, ctx) != 0) break;
+    }
+}
+
+static int query_user_locations(user_row_fn fn, void* ctx) {
+    db_conn_t* conn;
+    sqlite3_stmt* stmt = acquire_statement(STMT_GET_USER_LOCATIONS, &conn);
+    if (!stmt) return -1;
+
+    sqlite3_bind_int64(stmt, 1, time(NULL));
+    each_location_row(stmt, NULL, fn, ctx);
+
+    release_statement(conn, stmt);
     return 0;
 }
 
-user_t* get_user_by_username(const char* username) {
-    const char* sql = "SELECT * FROM users WHERE username = ?;";
-    sqlite3_stmt* stmt;
-    
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) return NULL;
+#if !LOCATION_WRITE_BEHIND
+static int query_user_locations_in_box(double min_lat, double max_lat, double min_lng, double max_lng,
+                                       int limit, user_row_fn fn, void* ctx) {
+    // A box with min_lng > max_lng crosses the antimeridian; search both sides
+    double ranges[2][2] = { { min_lng, max_lng }, { -180.0, max_lng } };
+    int range_count = 1;
+    if (min_lng > max_lng) {
+        ranges[0][1] = 180.0;
+        range_count = 2;
+    }
+
+    time_t now = time(NULL);
+    int found = 0;
+    for (int i = 0; i < range_count && (limit < 0 || found < limit); i++) {
+        db_conn_t* conn;
+        sqlite3_stmt* stmt = acquire_statement(STMT_GET_LOCATIONS_IN_BOX, &conn);
+        if (!stmt) return -1;
+
+        sqlite3_bind_double(stmt, 1, min_lat);
+        sqlite3_bind_double(stmt, 2, max_lat);
+        sqlite3_bind_double(stmt, 3, ranges[i][0]);
+        sqlite3_bind_double(stmt, 4, ranges[i][1]);
+        sqlite3_bind_int64(stmt, 5, now);
+        sqlite3_bind_int(stmt, 6, limit < 0 ? -1 : limit - found);
+        each_location_row(stmt, &found, fn, ctx);
+
+        release_statement(conn, stmt);
+    }
+    return 0;
+}
+#endif
+
+int each_user_location(user_row_fn fn, void* ctx) {
+#if LOCATION_WRITE_BEHIND
+    return location_store_each(time(NULL), fn, ctx);
+#else
+    return query_user_locations(fn, ctx);
+#endif
+}
+
+int each_user_location_in_box(double min_lat, double max_lat, double min_lng, double max_lng,
+                              int limit, user_row_fn fn, void* ctx) {
+#if LOCATION_WRITE_BEHIND
+    return location_store_each_in_box(min_lat, max_lat, min_lng, max_lng, limit, time(NULL), fn, ctx);
+#else
+    return query_user_locations_in_box(min_lat, max_lat, min_lng, max_lng, limit, fn, ctx);
+#endif
+}
+
+typedef struct {
+    user_t* users;
+    int count;
+    int failed;
+} user_list_t;
+
+static int collect_user(const user_t* user, void* ctx) {
+    user_list_t* list = ctx;
+    user_t* users = realloc(list->users, sizeof(user_t) * (list->count + 1));
+    if (!users) {
+        list->failed = 1;
+        return 1;
+    }
+    users[list->count++] = *user;
+    list->users = users;
+    return 0;
+}
+
+int get_user_locations(user_t** users, int* count) {
+    user_list_t list = { NULL, 0, 0 };
+    if (each_user_location(collect_user, &list) < 0 || list.failed) {
+        free(list.users);
+        return -1;
+    }
+
+    *users = list.users;
+    *count = list.count;
+    return 0;
+}
+
+int find_user_by_username(const char* username, user_t* user) {
+    if (user_cache_get_by_username(username, user)) return 0;
+
+    uint64_t generation = user_cache_generation();
+    db_conn_t* conn;
+    sqlite3_stmt* stmt = acquire_statement(STMT_GET_USER_BY_USERNAME, &conn);
+    if (!stmt) return -1;
 
     sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
 
-    rc = sqlite3_step(stmt);
-    if (rc != SQLITE_ROW) {
-        sqlite3_finalize(stmt);
-        return NULL;
+    int found = sqlite3_step(stmt) == SQLITE_ROW;
+    if (found) {
+        read_user_row(stmt, user);
     }
 
-    user_t* user = malloc(sizeof(user_t));
-    user->id = sqlite3_column_int(stmt, 0);
-    strcpy(user->username, (char*)sqlite3_column_text(stmt, 1));
-    strcpy(user->email, (char*)sqlite3_column_text(stmt, 2));
-    strcpy(user->password_hash, (char*)sqlite3_column_text(stmt, 3));
-    user->role = sqlite3_column_int(stmt, 4);
-    user->location_consent = sqlite3_column_int(stmt, 5);
-    user->latitude = sqlite3_column_double(stmt, 6);
-    user->longitude = sqlite3_column_double(stmt, 7);
-    user->location_updated = sqlite3_column_int64(stmt, 8);
-    user->location_duration = sqlite3_column_int(stmt, 9);
+    release_statement(conn, stmt);
+    if (!found) return -1;
 
-    sqlite3_finalize(stmt);
-    return user;
+    user_cache_put(user, generation);
+    return 0;
 }
 
-user_t* get_user_by_id(int user_id) {
-    const char* sql = "SELECT * FROM users WHERE id = ?;";
-    sqlite3_stmt* stmt;
-    
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) return NULL;
+int find_user_by_id(int user_id, user_t* user) {
+    if (user_cache_get_by_id(user_id, user)) return 0;
+
+    uint64_t generation = user_cache_generation();
+    db_conn_t* conn;
+    sqlite3_stmt* stmt = acquire_statement(STMT_GET_USER_BY_ID, &conn);
+    if (!stmt) return -1;
 
     sqlite3_bind_int(stmt, 1, user_id);
 
-    rc = sqlite3_step(stmt);
-    if (rc != SQLITE_ROW) {
-        sqlite3_finalize(stmt);
-        return NULL;
+    int found = sqlite3_step(stmt) == SQLITE_ROW;
+    if (found) {
+        read_user_row(stmt, user);
     }
 
+    release_statement(conn, stmt);
+    if (!found) return -1;
+
+    user_cache_put(user, generation);
+    return 0;
+}
+
+user_t* get_user_by_username(const char* username) {
     user_t* user = malloc(sizeof(user_t));
-    user->id = sqlite3_column_int(stmt, 0);
-    strcpy(user->username, (char*)sqlite3_column_text(stmt, 1));
-    strcpy(user->email, (char*)sqlite3_column_text(stmt, 2));
-    strcpy(user->password_hash, (char*)sqlite3_column_text(stmt, 3));
-    user->role = sqlite3_column_int(stmt, 4);
-    user->location_consent = sqlite3_column_int(stmt, 5);
-    user->latitude = sqlite3_column_double(stmt, 6);
-    user->longitude = sqlite3_column_double(stmt, 7);
-    user->location_updated = sqlite3_column_int64(stmt, 8);
-    user->location_duration = sqlite3_column_int(stmt, 9);
+    if (user && find_user_by_username(username, user) < 0) {
+        free(user);
+        return NULL;
+    }
+    return user;
+}
 
-    sqlite3_finalize(stmt);
+user_t* get_user_by_id(int user_id) {
+    user_t* user = malloc(sizeof(user_t));
+    if (user && find_user_by_id(user_id, user) < 0) {
+        free(user);
+        return NULL;
+    }
     return user;
 }
 
-int get_user_messages(int user_id, message_t** messages, int* count) {
-    const char* sql = "SELECT * FROM messages WHERE receiver_id = ? OR sender_id = ? ORDER BY timestamp DESC LIMIT 50;";
-    sqlite3_stmt* stmt;
-    
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) return -1;
+// Hands each row of a messages query shaped like the history queries
+// (m.*, sender name, receiver name) to fn
+static void read_message_rows(sqlite3_stmt* stmt, message_row_fn fn, void* ctx) {
+    message_t msg;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        msg.id = sqlite3_column_int(stmt, 0);
+        msg.sender_id = sqlite3_column_int(stmt, 1);
+        msg.receiver_id = sqlite3_column_int(stmt, 2);
+        msg.group_id = sqlite3_column_int(stmt, 3);
+        strcpy(msg.content, (char*)sqlite3_column_text(stmt, 4));
+        const char* media = (const char*)sqlite3_column_text(stmt, 5);
+        snprintf(msg.media_path, sizeof(msg.media_path), "%s", media ? media : "");
+        msg.timestamp = sqlite3_column_int64(stmt, 6);
+        msg.encrypted = sqlite3_column_int(stmt, 7);
+
+        const char* sender = (const char*)sqlite3_column_text(stmt, 8);
+        const char* receiver = (const char*)sqlite3_column_text(stmt, 9);
+        snprintf(msg.sender_username, sizeof(msg.sender_username), "%s", sender ? sender : "");
+        snprintf(msg.receiver_username, sizeof(msg.receiver_username), "%s", receiver ? receiver : "");
+
+        if (fn(&msg, ctx) != 0) break;
+    }
+}
+
+static int each_message_row(statement_id_t id, int user_id, int64_t bound, int limit,
+                            message_row_fn fn, void* ctx) {
+    db_conn_t* conn;
+    sqlite3_stmt* stmt = acquire_statement(id, &conn);
+    if (!stmt) return -1;
 
     sqlite3_bind_int(stmt, 1, user_id);
+    sqlite3_bind_int64(stmt, 2, bound);
+    sqlite3_bind_int(stmt, 3, limit);
+    read_message_rows(stmt, fn, ctx);
+
+    release_statement(conn, stmt);
+    return 0;
+}
+
+int each_user_message(int user_id, int before_id, int limit, message_row_fn fn, void* ctx) {
+    return each_message_row(STMT_GET_USER_MESSAGES, user_id, before_id > 0 ? before_id : INT64_MAX,
+                            limit, fn, ctx);
+}
+
+int each_user_message_since(int user_id, int since_id, int limit, message_row_fn fn, void* ctx) {
+    return each_message_row(STMT_GET_USER_MESSAGES_SINCE, user_id, since_id, limit, fn, ctx);
+}
+
+typedef struct {
+    message_t* messages;
+    int count;
+    int failed;
+} message_list_t;
+
+static int collect_message(const message_t* msg, void* ctx) {
+    message_list_t* list = ctx;
+    message_t* messages = realloc(list->messages, sizeof(message_t) * (list->count + 1));
+    if (!messages) {
+        list->failed = 1;
+        return 1;
+    }
+    messages[list->count++] = *msg;
+    list->messages = messages;
+    return 0;
+}
+
+int get_user_messages(int user_id, int before_id, int limit, message_t** messages, int* count) {
+    message_list_t list = { NULL, 0, 0 };
+    if (each_user_message(user_id, before_id, limit, collect_message, &list) < 0 || list.failed) {
+        free(list.messages);
+        return -1;
+    }
+
+    *messages = list.messages;
+    *count = list.count;
+    return 0;
+}
+
+int create_group(const char* name, int admin_id) {
+    db_conn_t* conn;
+    sqlite3_stmt* stmt = acquire_statement(STMT_CREATE_GROUP, &conn);
+    if (!stmt) return -1;
+
+    // The group and its first member, the admin, appear together
+    time_t now = time(NULL);
+    int group_id = -1;
+    if (sqlite3_exec(conn->handle, "BEGIN IMMEDIATE;", NULL, NULL, NULL) != SQLITE_OK) {
+        release_statement(conn, stmt);
+        return -1;
+    }
+
+    sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, admin_id);
+    sqlite3_bind_int64(stmt, 3, now);
+    if (sqlite3_step(stmt) == SQLITE_DONE) {
+        group_id = sqlite3_last_insert_rowid(conn->handle);
+
+        sqlite3_stmt* member = cached_statement(conn, STMT_ADD_GROUP_MEMBER);
+        if (member) {
+            sqlite3_bind_int(member, 1, group_id);
+            sqlite3_bind_int(member, 2, admin_id);
+            sqlite3_bind_int(member, 3, GROUP_ROLE_ADMIN);
+            sqlite3_bind_int64(member, 4, now);
+            if (sqlite3_step(member) != SQLITE_DONE) group_id = -1;
+            sqlite3_reset(member);
+            sqlite3_clear_bindings(member);
+        } else {
+            group_id = -1;
+        }
+    }
+
+    if (group_id < 0 || sqlite3_exec(conn->handle, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK) {
+        sqlite3_exec(conn->handle, "ROLLBACK;", NULL, NULL, NULL);
+        group_id = -1;
+    }
+    release_statement(conn, stmt);
+    return group_id;
+}
+
+int add_group_member(int group_id, int user_id) {
+    db_conn_t* conn;
+    sqlite3_stmt* stmt = acquire_statement(STMT_ADD_GROUP_MEMBER, &conn);
+    if (!stmt) return -1;
+
+    sqlite3_bind_int(stmt, 1, group_id);
+    sqlite3_bind_int(stmt, 2, user_id);
+    sqlite3_bind_int(stmt, 3, GROUP_ROLE_MEMBER);
+    sqlite3_bind_int64(stmt, 4, time(NULL));
+
+    int rc = sqlite3_step(stmt);
+    int result = rc != SQLITE_DONE ? -1 : sqlite3_changes(conn->handle) > 0 ? 0 : 1;
+    release_statement(conn, stmt);
+    return result;
+}
+
+int find_group_member(int group_id, int user_id, group_member_t* member) {
+    db_conn_t* conn;
+    sqlite3_stmt* stmt = acquire_statement(STMT_GET_GROUP_MEMBER, &conn);
+    if (!stmt) return -1;
+
+    sqlite3_bind_int(stmt, 1, group_id);
     sqlite3_bind_int(stmt, 2, user_id);
 
-    *count = 0;
-    *messages = NULL;
-
-    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
-        *messages = realloc(*messages, sizeof(message_t) * (*count + 1));
-        message_t* msg = &(*messages)[*count];
-        
-        msg->id = sqlite3_column_int(stmt, 0);
-        msg->sender_id = sqlite3_column_int(stmt, 1);
-        msg->receiver_id = sqlite3_column_int(stmt, 2);
-        msg->group_id = sqlite3_column_int(stmt, 3);
-        strcpy(msg->content, (char*)sqlite3_column_text(stmt, 4));
-        if (sqlite3_column_text(stmt, 5)) {
-            strcpy(msg->media_path, (char*)sqlite3_column_text(stmt, 5));
+    int found = sqlite3_step(stmt) == SQLITE_ROW;
+    if (found) {
+        member->group_id = group_id;
+        member->user_id = user_id;
+        member->role = sqlite3_column_int(stmt, 0);
+        member->joined_at = sqlite3_column_int64(stmt, 1);
+        member->last_read_id = sqlite3_column_int(stmt, 2);
+    }
+
+    release_statement(conn, stmt);
+    return found ? 0 : -1;
+}
+
+int mark_group_read(int group_id, int user_id, int message_id) {
+    db_conn_t* conn;
+    sqlite3_stmt* stmt = acquire_statement(STMT_MARK_GROUP_READ, &conn);
+    if (!stmt) return -1;
+
+    sqlite3_bind_int(stmt, 1, group_id);
+    sqlite3_bind_int(stmt, 2, user_id);
+    sqlite3_bind_int(stmt, 3, message_id);
+
+    int rc = sqlite3_step(stmt);
+    release_statement(conn, stmt);
+    return rc == SQLITE_DONE ? 0 : -1;
+}
+
+int each_user_group(int user_id, group_row_fn fn, void* ctx) {
+    db_conn_t* conn;
+    sqlite3_stmt* stmt = acquire_statement(STMT_GET_USER_GROUPS, &conn);
+    if (!stmt) return -1;
+
+    sqlite3_bind_int(stmt, 1, user_id);
+    sqlite3_bind_int(stmt, 2, GROUP_UNREAD_MAX);
+
+    group_summary_t summary;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        memset(&summary, 0, sizeof(summary));
+        summary.group.id = sqlite3_column_int(stmt, 0);
+        snprintf(summary.group.name, sizeof(summary.group.name), "%s", (const char*)sqlite3_column_text(stmt, 1));
+        summary.group.admin_id = sqlite3_column_int(stmt, 2);
+        summary.group.created_at = sqlite3_column_int64(stmt, 3);
+        summary.role = sqlite3_column_int(stmt, 4);
+        summary.last_read_id = sqlite3_column_int(stmt, 5);
+        summary.last_message_id = sqlite3_column_int(stmt, 6);
+        summary.unread = sqlite3_column_int(stmt, 7);
+
+        if (fn(&summary, ctx) != 0) break;
+    }
+
+    release_statement(conn, stmt);
+    return 0;
+}
+
+int each_group_message(int group_id, int before_id, int limit, message_row_fn fn, void* ctx) {
+    // The group takes the place of the user in the row reader's first parameter
+    return each_message_row(STMT_GET_GROUP_MESSAGES, group_id, before_id > 0 ? before_id : INT64_MAX,
+                            limit, fn, ctx);
+}
+
+// Appends text to a growing string; returns -1 once out of memory
+static int append_text(char** text, size_t* len, size_t* cap, const char* add, size_t add_len) {
+    if (*len + add_len + 1 > *cap) {
+        size_t grown_cap = (*len + add_len + 1) * 2;
+        char* grown = realloc(*text, grown_cap);
+        if (!grown) return -1;
+        *text = grown;
+        *cap = grown_cap;
+    }
+    memcpy(*text + *len, add, add_len);
+    *len += add_len;
+    (*text)[*len] = '\0';
+    return 0;
+}
+
+// Builds the FTS5 query for a search: every word of the user's text as a
+// quoted string, so nothing in it is read as query syntax (a trailing *
+// still asks for a prefix), restricted to the user's own conversations.
+// Returns NULL when out of memory; *terms is set to the number of words.
+static char* build_search_query(int user_id, const char* text, int* terms_out) {
+    char* query = NULL;
+    size_t len = 0, cap = 0;
+    int failed = append_text(&query, &len, &cap, "content : (", 11);
+
+    int terms = 0;
+    const char* p = text;
+    while (*p && terms < MESSAGE_SEARCH_MAX_TERMS && !failed) {
+        while (*p && isspace((unsigned char)*p)) p++;
+        const char* start = p;
+        while (*p && !isspace((unsigned char)*p)) p++;
+        const char* end = p;
+        if (end == start) break;
+
+        int prefix = end[-1] == '*';
+        if (prefix) end--;
+        if (end == start) continue;
+
+        failed |= append_text(&query, &len, &cap, terms ? " \"" : "\"", terms ? 2 : 1);
+        for (const char* c = start; c < end && !failed; c++) {
+            // Quotes inside a string are doubled
+            failed |= append_text(&query, &len, &cap, c, 1);
+            if (*c == '"') failed |= append_text(&query, &len, &cap, "\"", 1);
         }
-        msg->timestamp = sqlite3_column_int64(stmt, 6);
-        msg->encrypted = sqlite3_column_int(stmt, 7);
-        
-        (*count)++;
+        failed |= append_text(&query, &len, &cap, prefix ? "\"*" : "\"", prefix ? 2 : 1);
+        terms++;
     }
 
-    sqlite3_finalize(stmt);
+    char party[16];
+    int party_len = snprintf(party, sizeof(party), "u%d", user_id);
+    failed |= append_text(&query, &len, &cap, ") AND parties : (", 17);
+    failed |= append_text(&query, &len, &cap, party, party_len);
+
+    db_conn_t* conn;
+    sqlite3_stmt* stmt = failed ? NULL : acquire_statement(STMT_GET_USER_GROUP_IDS, &conn);
+    if (stmt) {
+        sqlite3_bind_int(stmt, 1, user_id);
+        while (!failed && sqlite3_step(stmt) == SQLITE_ROW) {
+            party_len = snprintf(party, sizeof(party), " OR g%d", sqlite3_column_int(stmt, 0));
+            failed |= append_text(&query, &len, &cap, party, party_len);
+        }
+        release_statement(conn, stmt);
+    } else {
+        failed = 1;
+    }
+    failed |= append_text(&query, &len, &cap, ")", 1);
+
+    *terms_out = terms;
+    if (failed) {
+        free(query);
+        return NULL;
+    }
+    return query;
+}
+
+// Returns 1 if the text has no words to search for
+int search_user_messages(int user_id, const char* text, int offset, int limit,
+                         message_row_fn fn, void* ctx) {
+    int terms;
+    char* query = build_search_query(user_id, text, &terms);
+    if (!query) return -1;
+    if (terms == 0) {
+        free(query);
+        return 1;
+    }
+
+    db_conn_t* conn;
+    sqlite3_stmt* stmt = acquire_statement(STMT_SEARCH_MESSAGES, &conn);
+    if (!stmt) {
+        free(query);
+        return -1;
+    }
+
+    sqlite3_bind_text(stmt, 1, query, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, limit);
+    sqlite3_bind_int(stmt, 3, offset);
+    read_message_rows(stmt, fn, ctx);
+
+    release_statement(conn, stmt);
+    free(query);
     return 0;
-}
\ No newline at end of file
+}
+
+// Records an upload of stored media. Returns 0 if the content is new, 1 if
+// it was already stored, -1 on error.
+int save_media(const media_t* media, int uploader_id) {
+    db_conn_t* conn;
+    sqlite3_stmt* stmt = acquire_statement(STMT_SAVE_MEDIA, &conn);
+    if (!stmt) return -1;
+
+    if (sqlite3_exec(conn->handle, "BEGIN IMMEDIATE;", NULL, NULL, NULL) != SQLITE_OK) {
+        release_statement(conn, stmt);
+        return -1;
+    }
+
+    int result = -1;
+    sqlite3_bind_text(stmt, 1, media->hash, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, media->size);
+    sqlite3_bind_text(stmt, 3, media->content_type, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 4, media->created_at);
+    if (sqlite3_step(stmt) == SQLITE_DONE) {
+        result = sqlite3_changes(conn->handle) ? 0 : 1;
+
+        sqlite3_stmt* upload = cached_statement(conn, STMT_ADD_MEDIA_UPLOAD);
+        if (upload) {
+            sqlite3_bind_text(upload, 1, media->hash, -1, SQLITE_STATIC);
+            sqlite3_bind_int(upload, 2, uploader_id);
+            sqlite3_bind_int64(upload, 3, media->created_at);
+            if (sqlite3_step(upload) != SQLITE_DONE) result = -1;
+            sqlite3_reset(upload);
+            sqlite3_clear_bindings(upload);
+        } else {
+            result = -1;
+        }
+    }
+
+    if (result < 0 || sqlite3_exec(conn->handle, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK) {
+        sqlite3_exec(conn->handle, "ROLLBACK;", NULL, NULL, NULL);
+        result = -1;
+    }
+    release_statement(conn, stmt);
+    return result;
+}
+
+// Looks up media the user may see. Returns 0 if found, 1 if it does not
+// exist or is not theirs to see, -1 on error.
+int find_media(const char* hash, int user_id, media_t* media) {
+    db_conn_t* conn;
+    sqlite3_stmt* stmt = acquire_statement(STMT_GET_MEDIA, &conn);
+    if (!stmt) return -1;
+
+    sqlite3_bind_text(stmt, 1, hash, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, user_id);
+
+    int rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) {
+        snprintf(media->hash, sizeof(media->hash), "%s", (const char*)sqlite3_column_text(stmt, 0));
+        media->size = sqlite3_column_int64(stmt, 1);
+        snprintf(media->content_type, sizeof(media->content_type), "%s",
+                 (const char*)sqlite3_column_text(stmt, 2));
+        media->created_at = sqlite3_column_int64(stmt, 3);
+    }
+
+    release_statement(conn, stmt);
+    return rc == SQLITE_ROW ? 0 : rc == SQLITE_DONE ? 1 : -1;
+}
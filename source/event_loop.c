@@ -0,0 +1,786 @@
+#include "server.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+
+// Connections are registered EPOLLONESHOT: whoever holds a connection
+// (the loop, or the worker running its current request) is its only user.
+// Workers hand connections back through done_list and wake the loop via
+// done_fd; only then is the next pipelined request parsed or the socket
+// re-armed, so responses always leave in request order. Connections stay
+// open between requests unless the client asked to close. A connection
+// upgraded to a WebSocket is never handed to a worker again; the loop reads
+// its frames and writes pushes to it directly. A request that parks (see
+// long_poll.c) comes back without a response and is only watched for
+// hangups until a worker picks it up again. A request whose body is being
+// streamed in (see connection_stream_body) goes back to a worker each time
+// the socket has more of it, until it has all been read.
+
+static int epoll_fd = -1;
+static int done_fd = -1;
+static int connection_count = 0;
+
+// Response bytes waiting for the socket. Bodies handed over with an owner
+// are referenced in place and released once sent; anything else is copied
+// into the chunk itself. A chunk without data is a range of an open file,
+// sent with sendfile and closed once done.
+typedef struct out_chunk {
+    struct out_chunk* next;
+    const char* data;
+    size_t len;
+    size_t sent;
+    int fd;
+    off_t offset;
+    void (*release)(void*);
+    void* owner;
+    char bytes[];
+} out_chunk_t;
+
+#define OUT_IOV_MAX 16
+
+static worker_pool_t request_pool;
+static connection_t* done_list = NULL;
+
+// Connections closed while the loop works through a batch of events are
+// freed once it is done, since a later event of the batch may still name
+// them. Loop thread only.
+static connection_t* closed_list = NULL;
+static pthread_mutex_t done_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void dispatch_next(connection_t* conn);
+static void finish_request(connection_t* conn);
+static void receive_body(connection_t* conn);
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void free_out_chunk(out_chunk_t* chunk) {
+    if (chunk->release) chunk->release(chunk->owner);
+    if (!chunk->data) close(chunk->fd);
+    free(chunk);
+}
+
+static void close_connection(connection_t* conn) {
+    long_poll_cancel(conn);
+    if (conn->stream) {
+        // The rest of the body will never come; let its handler clean up
+        body_stream_t* stream = conn->stream;
+        conn->stream = NULL;
+        stream->finish(&conn->client, stream);
+    }
+#if ENABLE_WEBSOCKET
+    if (conn->websocket) websocket_detach(conn);
+#endif
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->client.socket, NULL);
+    close(conn->client.socket);
+    while (conn->out_head) {
+        out_chunk_t* next = conn->out_head->next;
+        free_out_chunk(conn->out_head);
+        conn->out_head = next;
+    }
+    free(conn->in_buf);
+    conn->in_buf = NULL;
+    conn->closed = 1;
+    conn->next_done = closed_list;
+    closed_list = conn;
+    connection_count--;
+}
+
+static void free_closed_connections(void) {
+    while (closed_list) {
+        connection_t* next = closed_list->next_done;
+        free(closed_list);
+        closed_list = next;
+    }
+}
+
+static void arm_connection(connection_t* conn, uint32_t interest) {
+    struct epoll_event ev = {0};
+    // A half-close already seen would be reported again straight away
+    ev.events = interest | (conn->peer_closed ? 0 : EPOLLRDHUP) | EPOLLET | EPOLLONESHOT;
+    ev.data.ptr = conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->client.socket, &ev) < 0) {
+        close_connection(conn);
+    }
+}
+
+static int queue_out_chunk(connection_t* conn, const char* data, size_t len,
+                           void (*release)(void*), void* owner) {
+    out_chunk_t* chunk = malloc(sizeof(out_chunk_t) + (release ? 0 : len));
+    if (!chunk) {
+        if (release) release(owner);
+        return -1;
+    }
+
+    chunk->next = NULL;
+    chunk->len = len;
+    chunk->sent = 0;
+    chunk->release = release;
+    chunk->owner = owner;
+    if (release) {
+        chunk->data = data;
+    } else {
+        memcpy(chunk->bytes, data, len);
+        chunk->data = chunk->bytes;
+    }
+
+    if (conn->out_tail) {
+        conn->out_tail->next = chunk;
+    } else {
+        conn->out_head = chunk;
+    }
+    conn->out_tail = chunk;
+    return 0;
+}
+
+// Queues a range of a file; the chunk owns fd from here on
+static int queue_file_chunk(connection_t* conn, int fd, off_t offset, size_t len) {
+    out_chunk_t* chunk = malloc(sizeof(out_chunk_t));
+    if (!chunk) {
+        close(fd);
+        return -1;
+    }
+
+    chunk->next = NULL;
+    chunk->data = NULL;
+    chunk->len = len;
+    chunk->sent = 0;
+    chunk->fd = fd;
+    chunk->offset = offset;
+    chunk->release = NULL;
+    chunk->owner = NULL;
+
+    if (conn->out_tail) {
+        conn->out_tail->next = chunk;
+    } else {
+        conn->out_head = chunk;
+    }
+    conn->out_tail = chunk;
+    return 0;
+}
+
+// Writes as much of the pending output as the socket accepts. Returns 1 when
+// everything went out, 0 if the socket would block, -1 on error.
+static int flush_output(connection_t* conn) {
+    while (conn->out_head) {
+        out_chunk_t* head = conn->out_head;
+        if (!head->data) {
+            // Straight from the page cache; a short count only means the
+            // socket buffer is full
+            off_t offset = head->offset + head->sent;
+            ssize_t written = sendfile(conn->client.socket, head->fd, &offset, head->len - head->sent);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+                return -1;
+            }
+            if (written == 0) return -1; // the file is shorter than promised
+            head->sent += written;
+            if (head->sent == head->len) {
+                conn->out_head = head->next;
+                if (!conn->out_head) conn->out_tail = NULL;
+                free_out_chunk(head);
+            }
+            continue;
+        }
+
+        struct iovec iov[OUT_IOV_MAX];
+        int count = 0;
+        for (out_chunk_t* chunk = head; chunk && chunk->data && count < OUT_IOV_MAX; chunk = chunk->next) {
+            iov[count].iov_base = (void*)(chunk->data + chunk->sent);
+            iov[count].iov_len = chunk->len - chunk->sent;
+            count++;
+        }
+
+        ssize_t written = writev(conn->client.socket, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+
+        while (conn->out_head && (written > 0 || conn->out_head->sent == conn->out_head->len)) {
+            out_chunk_t* chunk = conn->out_head;
+            size_t left = chunk->len - chunk->sent;
+            if ((size_t)written < left) {
+                chunk->sent += written;
+                break;
+            }
+            written -= left;
+            conn->out_head = chunk->next;
+            if (!conn->out_head) conn->out_tail = NULL;
+            free_out_chunk(chunk);
+        }
+    }
+    return 1;
+}
+
+int connection_send(client_t* client, const char* head, size_t head_len,
+                    const char* body, size_t body_len, void (*release)(void*), void* owner) {
+    connection_t* conn = (connection_t*)client;
+
+    // Common case: nothing queued, so try to hand both parts straight to the
+    // kernel and only keep what it does not take
+    if (!conn->out_head) {
+        struct iovec iov[2] = {
+            { (void*)head, head_len },
+            { (void*)body, body_len }
+        };
+        int count = body_len ? 2 : 1;
+        size_t total = head_len + body_len;
+        size_t done = 0;
+
+        while (done < total) {
+            ssize_t written = writev(conn->client.socket, iov, count);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                conn->closing = 1;
+                if (release) release(owner);
+                return -1;
+            }
+            done += written;
+            if (done < head_len) {
+                iov[0].iov_base = (void*)(head + done);
+                iov[0].iov_len = head_len - done;
+            } else {
+                iov[0].iov_base = (void*)(body + (done - head_len));
+                iov[0].iov_len = total - done;
+                iov[1].iov_len = 0;
+                count = 1;
+            }
+        }
+
+        if (done == total) {
+            if (release) release(owner);
+            return 0;
+        }
+        if (done < head_len) {
+            if (queue_out_chunk(conn, head + done, head_len - done, NULL, NULL) < 0) goto fail;
+            done = head_len;
+        }
+        if (done == total) {
+            if (release) release(owner);
+            return 0;
+        }
+        if (queue_out_chunk(conn, body + (done - head_len), total - done, release, owner) < 0) goto fail_released;
+        return 0;
+    }
+
+    if (queue_out_chunk(conn, head, head_len, NULL, NULL) < 0) goto fail;
+    if (body_len && queue_out_chunk(conn, body, body_len, release, owner) < 0) goto fail_released;
+    if (!body_len && release) release(owner);
+    return 0;
+
+fail:
+    if (release) release(owner);
+fail_released:
+    conn->closing = 1;
+    return -1;
+}
+
+// Sends a response head followed by len bytes of a file from offset. Takes
+// ownership of fd. Whatever the socket does not take now is sent from the
+// loop thread as it drains.
+int connection_send_file(client_t* client, const char* head, size_t head_len,
+                         int fd, off_t offset, size_t len) {
+    connection_t* conn = (connection_t*)client;
+    if (queue_out_chunk(conn, head, head_len, NULL, NULL) < 0) {
+        close(fd);
+        conn->closing = 1;
+        return -1;
+    }
+    if (len == 0) {
+        close(fd);
+    } else if (queue_file_chunk(conn, fd, offset, len) < 0) {
+        conn->closing = 1;
+        return -1;
+    }
+
+    if (flush_output(conn) < 0) {
+        conn->closing = 1;
+        return -1;
+    }
+    return 0;
+}
+
+// Called once the current response is complete, by whoever owns the
+// connection: waits for the socket to drain, then moves on to the next
+// request or closes.
+static void after_response(connection_t* conn) {
+    if (conn->out_head && !conn->websocket) {
+        arm_connection(conn, EPOLLOUT);
+        return;
+    }
+    if (conn->closing) {
+        close_connection(conn);
+        return;
+    }
+    dispatch_next(conn);
+}
+
+static void handle_writable(connection_t* conn) {
+    int rc = flush_output(conn);
+    if (rc < 0) {
+        close_connection(conn);
+    } else if (rc == 0) {
+        arm_connection(conn, EPOLLOUT);
+    } else {
+        after_response(conn);
+    }
+}
+
+// Returns a connection from a worker to the loop
+static void hand_back(connection_t* conn) {
+    pthread_mutex_lock(&done_mutex);
+    conn->next_done = done_list;
+    done_list = conn;
+    pthread_mutex_unlock(&done_mutex);
+
+    event_loop_wake();
+}
+
+// Feeds a streamed body to its handler: first whatever arrived with the
+// headers, then the socket until it would block, the body is complete, or
+// this turn has taken UPLOAD_TURN_SIZE bytes and gives other connections a
+// go. Runs on a worker thread.
+static void receive_body(connection_t* conn) {
+    static __thread char chunk[UPLOAD_CHUNK_SIZE];
+    body_stream_t* stream = conn->stream;
+    int stopped = 0;
+
+    size_t buffered = conn->in_len - conn->request_len;
+    if (buffered > stream->remaining) buffered = stream->remaining;
+    if (buffered) {
+        stopped = stream->write(stream, conn->in_buf + conn->request_len, buffered) < 0;
+        conn->request_len += buffered;
+        stream->remaining -= buffered;
+    }
+
+    size_t turn = 0;
+    while (!stopped && stream->remaining > 0 && turn < UPLOAD_TURN_SIZE) {
+        size_t want = stream->remaining < sizeof(chunk) ? stream->remaining : sizeof(chunk);
+        ssize_t bytes = recv(conn->client.socket, chunk, want, 0);
+        if (bytes > 0) {
+            stopped = stream->write(stream, chunk, bytes) < 0;
+            stream->remaining -= bytes;
+            turn += bytes;
+        } else if (bytes < 0 && errno == EINTR) {
+            continue;
+        } else if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        } else {
+            stopped = 1;
+        }
+    }
+    if (!stopped && stream->remaining > 0) return;
+
+    // Done, one way or the other; an unread rest can only be skipped by closing
+    conn->stream = NULL;
+    if (stream->remaining > 0) conn->keep_alive = 0;
+    stream->finish(&conn->client, stream);
+}
+
+// Runs on a worker thread
+static void run_request(void* arg) {
+    connection_t* conn = arg;
+    http_request_t request;
+    if (http_parser_get_request(&conn->parser, conn->in_buf, &request) < 0) {
+        conn->keep_alive = 0;
+        conn->closing = 1;
+        send_response(&conn->client, 400, "application/json", "{\"error\":\"Malformed or oversized request\"}");
+        hand_back(conn);
+        return;
+    }
+
+    // Bodies are handed to handlers NUL-terminated; the byte after the body
+    // belongs to this request or to spare room the read path always leaves
+    char* body_end = request.body + request.body_len;
+    char saved = *body_end;
+    *body_end = '\0';
+
+    // A body left on the socket can only be skipped by closing, unless the
+    // handler takes it (see connection_stream_body)
+    conn->keep_alive = request.keep_alive && !request.body_remaining;
+    conn->version_minor = request.version_minor;
+    conn->client.authenticated = 0;
+    memset(&conn->client.user, 0, sizeof(user_t));
+    conn->wait.deadline_ns = 0;
+    metrics_begin_request(conn->parse_ns, conn->dispatched_ns);
+    handle_http_request(&conn->client, &request);
+    *body_end = saved;
+    if (conn->stream) receive_body(conn);
+    metrics_end_request();
+
+    if (!conn->keep_alive) conn->closing = 1;
+    hand_back(conn);
+}
+
+// Runs on a worker thread, for a streamed body with more bytes to read
+static void run_stream(void* arg) {
+    connection_t* conn = arg;
+    metrics_begin_request(0, 0);
+    metrics_set_route(ROUTE_UPLOAD_MEDIA);
+    receive_body(conn);
+    metrics_end_request();
+
+    if (!conn->keep_alive) conn->closing = 1;
+    hand_back(conn);
+}
+
+// Runs on a worker thread, for a parked request that was woken
+static void run_resumed(void* arg) {
+    connection_t* conn = arg;
+    metrics_begin_request(0, 0);
+    metrics_set_route(ROUTE_WAIT_MESSAGES);
+    api_resume_wait_messages(&conn->client, &conn->wait);
+    metrics_end_request();
+    hand_back(conn);
+}
+
+// Takes over the rest of the request body, which the loop then feeds to
+// stream as it arrives. The request is answered by stream->finish(). Only
+// called by the handler of a request with a body left on the socket.
+void connection_stream_body(client_t* client, http_request_t* request, body_stream_t* stream) {
+    connection_t* conn = (connection_t*)client;
+    stream->remaining = request->body_remaining;
+    conn->stream = stream;
+    conn->keep_alive = request->keep_alive;
+
+    if (conn->parser.expect_continue) {
+        static const char continue_line[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        send(conn->client.socket, continue_line, sizeof(continue_line) - 1, MSG_NOSIGNAL);
+        conn->continue_sent = 1;
+    }
+}
+
+static void continue_stream(connection_t* conn) {
+    if (worker_pool_submit(&request_pool, run_stream, conn) < 0) {
+        close_connection(conn);
+    }
+}
+
+void connection_resume(connection_t* conn) {
+    conn->resuming = 1;
+    if (worker_pool_submit(&request_pool, run_resumed, conn) < 0) {
+        conn->keep_alive = 0;
+        conn->closing = 1;
+        send_response(&conn->client, 503, "application/json", "{\"error\":\"Server busy\"}");
+        finish_request(conn);
+    }
+}
+
+#if ENABLE_WEBSOCKET
+// Handles buffered frames, writes what it can and re-arms, watching for
+// output only while some is queued. Only called on the loop thread.
+void connection_flush(connection_t* conn) {
+    if (!conn->ws_registered) websocket_attach(conn);
+    if (conn->in_len) websocket_read(conn);
+
+    int rc = flush_output(conn);
+    if (rc < 0 || conn->peer_closed || (conn->closing && rc == 1)) {
+        close_connection(conn);
+        return;
+    }
+
+    if (conn->in_len == 0) {
+        free(conn->in_buf);
+        conn->in_buf = NULL;
+        conn->in_cap = 0;
+    }
+    arm_connection(conn, EPOLLIN | (conn->out_head ? EPOLLOUT : 0));
+}
+#endif
+
+// Starts the next buffered request, or re-arms the socket when there is
+// none. The caller must own the connection.
+static void dispatch_next(connection_t* conn) {
+#if ENABLE_WEBSOCKET
+    if (conn->websocket) {
+        connection_flush(conn);
+        return;
+    }
+#endif
+
+    uint64_t parse_start = monotonic_ns();
+    int rc = conn->in_len ? http_parser_execute(&conn->parser, conn->in_buf, conn->in_len) : 0;
+    if (rc == 0 && conn->in_len >= MAX_REQUEST_SIZE) rc = -413;
+    conn->dispatched_ns = monotonic_ns();
+    conn->parse_ns += conn->dispatched_ns - parse_start;
+
+    if (rc < 0) {
+        conn->keep_alive = 0;
+        conn->closing = 1;
+        send_response(&conn->client, -rc, "application/json", "{\"error\":\"Malformed or oversized request\"}");
+        after_response(conn);
+        return;
+    }
+
+    if (rc > 0) {
+        conn->request_len = conn->parser.total_len;
+        if (worker_pool_submit(&request_pool, run_request, conn) < 0) {
+            conn->keep_alive = 0;
+            conn->closing = 1;
+            send_response(&conn->client, 503, "application/json", "{\"error\":\"Server busy\"}");
+            after_response(conn);
+        }
+        return;
+    }
+
+    if (conn->peer_closed || conn->closing) {
+        close_connection(conn);
+        return;
+    }
+
+    if (conn->parser.expect_continue && !conn->continue_sent && conn->parser.state > HTTP_PARSE_HEADERS) {
+        static const char continue_line[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        send(conn->client.socket, continue_line, sizeof(continue_line) - 1, MSG_NOSIGNAL);
+        conn->continue_sent = 1;
+    }
+
+    if (conn->in_len == 0) {
+        // Nothing pending: drop the buffer so idle connections stay small
+        free(conn->in_buf);
+        conn->in_buf = NULL;
+        conn->in_cap = 0;
+    }
+    arm_connection(conn, EPOLLIN);
+}
+
+static void finish_request(connection_t* conn) {
+    conn->resuming = 0;
+    if (conn->parked) {
+        // No response yet; keep the request and only listen for hangups
+        long_poll_park(conn);
+        if (!conn->resuming) arm_connection(conn, 0);
+        return;
+    }
+    if (conn->stream) {
+        // More of the body to come
+        arm_connection(conn, EPOLLIN);
+        return;
+    }
+
+    memmove(conn->in_buf, conn->in_buf + conn->request_len, conn->in_len - conn->request_len);
+    conn->in_len -= conn->request_len;
+    conn->request_len = 0;
+    conn->continue_sent = 0;
+    conn->parse_ns = 0;
+    http_parser_reset(&conn->parser);
+
+    after_response(conn);
+}
+
+static void drain_done_list(void) {
+    uint64_t count;
+    ssize_t got = read(done_fd, &count, sizeof(count));
+    (void)got;
+
+    pthread_mutex_lock(&done_mutex);
+    connection_t* conn = done_list;
+    done_list = NULL;
+    pthread_mutex_unlock(&done_mutex);
+
+    while (conn) {
+        connection_t* next = conn->next_done;
+        finish_request(conn);
+        conn = next;
+    }
+    long_poll_drain();
+
+#if ENABLE_WEBSOCKET
+    websocket_drain_pushes();
+#endif
+}
+
+void event_loop_wake(void) {
+    uint64_t one = 1;
+    ssize_t written = write(done_fd, &one, sizeof(one));
+    (void)written;
+}
+
+static void handle_readable(connection_t* conn) {
+    // Edge-triggered: drain the socket until it would block, or until the
+    // buffer holds a full request's worth of unhandled bytes
+    while (1) {
+        size_t space = conn->in_cap - conn->in_len;
+        if (space < BUFFER_SIZE && conn->in_cap < MAX_REQUEST_SIZE + 1) {
+            size_t new_cap = conn->in_cap ? conn->in_cap * 2 : BUFFER_SIZE;
+            if (new_cap > MAX_REQUEST_SIZE + 1) new_cap = MAX_REQUEST_SIZE + 1;
+            char* buf = realloc(conn->in_buf, new_cap);
+            if (!buf) {
+                conn->closing = 1;
+                break;
+            }
+            conn->in_buf = buf;
+            conn->in_cap = new_cap;
+        } else if (space <= 1) {
+            break;
+        }
+
+        ssize_t bytes = recv(conn->client.socket, conn->in_buf + conn->in_len,
+                             conn->in_cap - conn->in_len - 1, 0);
+        if (bytes > 0) {
+            conn->in_len += bytes;
+            continue;
+        }
+        if (bytes == 0) {
+            conn->peer_closed = 1;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            conn->closing = 1;
+        }
+        break;
+    }
+
+    if (conn->closing) {
+        close_connection(conn);
+        return;
+    }
+    dispatch_next(conn);
+}
+
+static void accept_connections(int server_socket) {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int client_socket = accept4(server_socket, (struct sockaddr*)&client_addr, &client_len,
+                                    SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return; // EAGAIN, or out of descriptors until something closes
+        }
+
+        if (connection_count >= MAX_CONNECTIONS) {
+            close(client_socket);
+            continue;
+        }
+
+        connection_t* conn = calloc(1, sizeof(connection_t));
+        if (!conn) {
+            close(client_socket);
+            continue;
+        }
+        conn->client.socket = client_socket;
+        conn->client.address = client_addr;
+        http_parser_reset(&conn->parser);
+
+        int opt = 1;
+        setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, (const void*)&opt, sizeof(opt));
+
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) < 0) {
+            close(client_socket);
+            free(conn);
+            continue;
+        }
+        connection_count++;
+    }
+}
+
+void event_loop_run(int server_socket) {
+    if (set_nonblocking(server_socket) < 0) {
+        perror("Failed to make listening socket non-blocking");
+        exit(1);
+    }
+
+    if (worker_pool_init(&request_pool, "requests", WORKER_THREADS, WORKER_QUEUE_SIZE) < 0) {
+        fprintf(stderr, "Failed to start worker pool\n");
+        exit(1);
+    }
+    printf("Handling requests on %d worker threads\n", request_pool.thread_count);
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd < 0 || done_fd < 0) {
+        perror("Event loop setup failed");
+        exit(1);
+    }
+
+    // The listening socket and the completion eventfd are tagged with
+    // pointers to their descriptors; everything else is a connection_t
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &server_socket;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &ev) < 0) {
+        perror("epoll_ctl failed");
+        exit(1);
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &done_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, done_fd, &ev) < 0) {
+        perror("epoll_ctl failed");
+        exit(1);
+    }
+
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+    int timeout = -1;
+
+    while (1) {
+        int n = epoll_wait(epoll_fd, events, EVENT_LOOP_MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            void* tag = events[i].data.ptr;
+            if (tag == &server_socket) {
+                accept_connections(server_socket);
+                continue;
+            }
+            if (tag == &done_fd) {
+                drain_done_list();
+                continue;
+            }
+
+            connection_t* conn = tag;
+            if (conn->closed) {
+                // Closed earlier in this batch
+                continue;
+            } else if (conn->resuming) {
+                // A worker has it again; re-arming later reports this anew
+                continue;
+            } else if (conn->parked) {
+                // Parked connections are only armed for hangups. A client
+                // that merely shut down its sending side still gets its
+                // answer; anything after it is not read.
+                if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                    close_connection(conn);
+                } else {
+                    conn->peer_closed = 1;
+                    arm_connection(conn, 0);
+                }
+            } else if (events[i].events & EPOLLERR) {
+                close_connection(conn);
+            } else if (conn->stream) {
+                continue_stream(conn);
+            } else if (conn->out_head && !conn->websocket) {
+                handle_writable(conn);
+            } else {
+                handle_readable(conn);
+            }
+        }
+        timeout = long_poll_expire();
+        free_closed_connections();
+    }
+
+    close(done_fd);
+    close(epoll_fd);
+}
+
+void event_loop_get_pool_stats(worker_pool_stats_t* stats) {
+    worker_pool_get_stats(&request_pool, stats);
+}
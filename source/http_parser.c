@@ -0,0 +1,327 @@
+#include "http_parser.h"
+#include "config.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+// Bodies above MAX_REQUEST_SIZE are not buffered but left on the socket for
+// the handler to stream, up to this size
+#if ENABLE_FILE_UPLOAD
+#define MAX_STREAMED_BODY_SIZE MAX_MEDIA_SIZE
+#else
+#define MAX_STREAMED_BODY_SIZE MAX_REQUEST_SIZE
+#endif
+
+void http_parser_reset(http_parser_t* parser) {
+    memset(parser, 0, sizeof(*parser));
+    parser->state = HTTP_PARSE_REQUEST_LINE;
+}
+
+// Finds the next complete line starting at parser->line_start. Returns its
+// length without the line terminator, or -1 if it is not complete yet.
+static long next_line(http_parser_t* parser, const char* buf, size_t len, size_t* next) {
+    const char* nl = memchr(buf + parser->pos, '\n', len - parser->pos);
+    if (!nl) {
+        parser->pos = len;
+        return -1;
+    }
+
+    size_t end = nl - buf;
+    *next = end + 1;
+    if (end > parser->line_start && buf[end - 1] == '\r') end--;
+    return end - parser->line_start;
+}
+
+// strchr() would also match the terminating NUL, so that is ruled out first
+static int is_token_char(char c) {
+    return isalnum((unsigned char)c) || (c != '\0' && strchr("!#$%&'*+-.^_`|~", c) != NULL);
+}
+
+// Control characters, NUL included, have no place in a target or header
+static int is_ctl_char(char c) {
+    return (unsigned char)c < 0x20 || c == 0x7f;
+}
+
+static int parse_request_line(http_parser_t* parser, const char* line, size_t len) {
+    size_t i = 0;
+    while (i < len && is_token_char(line[i])) i++;
+    if (i == 0 || i >= 16 || i >= len || line[i] != ' ') return -400;
+
+    size_t target = ++i;
+    while (i < len && line[i] != ' ') {
+        if (is_ctl_char(line[i])) return -400;
+        i++;
+    }
+    if (i == target || i >= len || (line[target] != '/' && line[target] != '*')) return -400;
+    if (i - target >= 1024) return -414;
+
+    i++;
+    if (len - i != 8 || strncmp(line + i, "HTTP/1.", 7) != 0 || !isdigit((unsigned char)line[i + 7])) {
+        return -400;
+    }
+    parser->version_minor = line[i + 7] - '0';
+    parser->keep_alive = parser->version_minor >= 1;
+    return 0;
+}
+
+static int header_value_has_token(const char* value, size_t len, const char* token) {
+    size_t token_len = strlen(token);
+    size_t i = 0;
+
+    while (i < len) {
+        while (i < len && (value[i] == ' ' || value[i] == '\t' || value[i] == ',')) i++;
+        size_t start = i;
+        while (i < len && value[i] != ',' && value[i] != ' ' && value[i] != '\t') i++;
+        if (i - start == token_len && strncasecmp(value + start, token, token_len) == 0) return 1;
+    }
+    return 0;
+}
+
+static int parse_header_line(http_parser_t* parser, const char* line, size_t len) {
+    const char* colon = memchr(line, ':', len);
+    if (!colon || colon == line) return -400;
+
+    size_t name_len = colon - line;
+    for (size_t i = 0; i < name_len; i++) {
+        if (!is_token_char(line[i])) return -400;
+    }
+
+    const char* value = colon + 1;
+    size_t value_len = len - name_len - 1;
+    for (size_t i = 0; i < value_len; i++) {
+        if (is_ctl_char(value[i]) && value[i] != '\t') return -400;
+    }
+    while (value_len > 0 && (*value == ' ' || *value == '\t')) {
+        value++;
+        value_len--;
+    }
+    while (value_len > 0 && (value[value_len - 1] == ' ' || value[value_len - 1] == '\t')) {
+        value_len--;
+    }
+
+    if (name_len == 14 && strncasecmp(line, "Content-Length", 14) == 0) {
+        if (value_len == 0) return -400;
+        long length = 0;
+        for (size_t i = 0; i < value_len; i++) {
+            if (!isdigit((unsigned char)value[i])) return -400;
+            length = length * 10 + (value[i] - '0');
+            if (length > MAX_STREAMED_BODY_SIZE) return -413;
+        }
+        if (parser->content_length >= 0 && parser->content_length != length) return -400;
+        parser->content_length = length;
+    } else if (name_len == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0) {
+        if (value_len != 7 || strncasecmp(value, "chunked", 7) != 0) return -501;
+        parser->chunked = 1;
+    } else if (name_len == 10 && strncasecmp(line, "Connection", 10) == 0) {
+        if (header_value_has_token(value, value_len, "close")) {
+            parser->keep_alive = 0;
+        } else if (header_value_has_token(value, value_len, "keep-alive")) {
+            parser->keep_alive = 1;
+        }
+    } else if (name_len == 6 && strncasecmp(line, "Expect", 6) == 0) {
+        if (value_len == 12 && strncasecmp(value, "100-continue", 12) == 0) {
+            parser->expect_continue = 1;
+        }
+    }
+    return 0;
+}
+
+static int parse_chunk_size(http_parser_t* parser, const char* line, size_t len) {
+    size_t i = 0;
+    size_t size = 0;
+
+    while (i < len && isxdigit((unsigned char)line[i])) {
+        int digit = isdigit((unsigned char)line[i]) ? line[i] - '0' : (tolower((unsigned char)line[i]) - 'a' + 10);
+        size = size * 16 + digit;
+        if (size > MAX_REQUEST_SIZE) return -413;
+        i++;
+    }
+    if (i == 0 || (i < len && line[i] != ';' && line[i] != ' ' && line[i] != '\t')) return -400;
+
+    if (parser->body_len + size > MAX_REQUEST_SIZE) return -413;
+    parser->chunk_remaining = size;
+    return 0;
+}
+
+int http_parser_execute(http_parser_t* parser, char* buf, size_t len) {
+    while (parser->state != HTTP_PARSE_DONE) {
+        size_t next;
+        long line_len;
+        int rc = 0;
+
+        switch (parser->state) {
+        case HTTP_PARSE_REQUEST_LINE:
+            line_len = next_line(parser, buf, len, &next);
+            if (line_len < 0) {
+                return (len - parser->line_start > HTTP_MAX_HEADER_SIZE) ? -414 : 0;
+            }
+            if (line_len == 0) {
+                // Tolerate stray CRLFs between pipelined requests
+                parser->line_start = parser->pos = next;
+                break;
+            }
+            parser->content_length = -1;
+            parser->request_start = parser->line_start;
+            rc = parse_request_line(parser, buf + parser->line_start, line_len);
+            if (rc < 0) return rc;
+            parser->headers_start = next;
+            parser->line_start = parser->pos = next;
+            parser->state = HTTP_PARSE_HEADERS;
+            break;
+
+        case HTTP_PARSE_HEADERS:
+            line_len = next_line(parser, buf, len, &next);
+            if (line_len < 0) {
+                return (len - parser->headers_start > HTTP_MAX_HEADER_SIZE) ? -431 : 0;
+            }
+            if (next - parser->headers_start > HTTP_MAX_HEADER_SIZE) return -431;
+
+            if (line_len == 0) {
+                parser->headers_end = parser->line_start;
+                parser->body_start = next;
+                parser->line_start = parser->pos = next;
+                if (parser->chunked) {
+                    parser->state = HTTP_PARSE_CHUNK_SIZE;
+                } else if (parser->content_length > MAX_REQUEST_SIZE) {
+                    // Complete as far as the parser goes; the body stays unread
+                    parser->body_remaining = parser->content_length;
+                    parser->total_len = next;
+                    parser->state = HTTP_PARSE_DONE;
+                } else if (parser->content_length > 0) {
+                    parser->state = HTTP_PARSE_BODY;
+                } else {
+                    parser->total_len = next;
+                    parser->state = HTTP_PARSE_DONE;
+                }
+                break;
+            }
+
+            if (buf[parser->line_start] == ' ' || buf[parser->line_start] == '\t') return -400; // obs-fold
+            if (++parser->header_count > HTTP_MAX_HEADERS) return -431;
+            rc = parse_header_line(parser, buf + parser->line_start, line_len);
+            if (rc < 0) return rc;
+            parser->line_start = parser->pos = next;
+            break;
+
+        case HTTP_PARSE_BODY:
+            if (len - parser->body_start < (size_t)parser->content_length) return 0;
+            parser->body_len = parser->content_length;
+            parser->total_len = parser->body_start + parser->body_len;
+            parser->state = HTTP_PARSE_DONE;
+            break;
+
+        case HTTP_PARSE_CHUNK_SIZE:
+            line_len = next_line(parser, buf, len, &next);
+            if (line_len < 0) return (len - parser->line_start > 1024) ? -400 : 0;
+            rc = parse_chunk_size(parser, buf + parser->line_start, line_len);
+            if (rc < 0) return rc;
+            parser->line_start = parser->pos = next;
+            parser->state = parser->chunk_remaining ? HTTP_PARSE_CHUNK_DATA : HTTP_PARSE_TRAILERS;
+            break;
+
+        case HTTP_PARSE_CHUNK_DATA: {
+            size_t available = len - parser->pos;
+            size_t n = available < parser->chunk_remaining ? available : parser->chunk_remaining;
+
+            // Decoded data always lands at or before the read position
+            memmove(buf + parser->body_start + parser->body_len, buf + parser->pos, n);
+            parser->body_len += n;
+            parser->pos += n;
+            parser->chunk_remaining -= n;
+            if (parser->chunk_remaining > 0) return 0;
+            parser->line_start = parser->pos;
+            parser->state = HTTP_PARSE_CHUNK_DATA_END;
+            break;
+        }
+
+        case HTTP_PARSE_CHUNK_DATA_END:
+            line_len = next_line(parser, buf, len, &next);
+            if (line_len < 0) return (len - parser->line_start > 2) ? -400 : 0;
+            if (line_len != 0) return -400;
+            parser->line_start = parser->pos = next;
+            parser->state = HTTP_PARSE_CHUNK_SIZE;
+            break;
+
+        case HTTP_PARSE_TRAILERS:
+            line_len = next_line(parser, buf, len, &next);
+            if (line_len < 0) return (len - parser->line_start > HTTP_MAX_HEADER_SIZE) ? -431 : 0;
+            parser->line_start = parser->pos = next;
+            if (line_len == 0) {
+                parser->total_len = next;
+                parser->state = HTTP_PARSE_DONE;
+            }
+            break;
+
+        case HTTP_PARSE_DONE:
+            break;
+        }
+    }
+
+    return 1;
+}
+
+int http_parser_get_request(const http_parser_t* parser, char* buf, http_request_t* request) {
+    memset(request, 0, sizeof(*request));
+
+    // Searches stay within the lines the parser accepted
+    char* method = buf + parser->request_start;
+    char* line_end = buf + parser->headers_start;
+    char* sp = memchr(method, ' ', line_end - method);
+    if (!sp) return -1;
+    *sp = '\0';
+    char* target = sp + 1;
+    sp = memchr(target, ' ', line_end - target);
+    if (!sp) return -1;
+    *sp = '\0';
+
+    request->method = method;
+    request->path = target;
+    request->query = "";
+    char* question = strchr(target, '?');
+    if (question) {
+        *question = '\0';
+        request->query = question + 1;
+    }
+    request->version_minor = parser->version_minor;
+    request->keep_alive = parser->keep_alive;
+
+    size_t pos = parser->headers_start;
+    while (pos < parser->headers_end && request->header_count < HTTP_MAX_HEADERS) {
+        char* name = buf + pos;
+        char* nl = memchr(name, '\n', parser->headers_end - pos);
+        if (!nl) return -1;
+        pos = (nl - buf) + 1;
+
+        char* end = nl;
+        if (end > name && end[-1] == '\r') end--;
+        *end = '\0';
+
+        char* colon = memchr(name, ':', end - name);
+        if (!colon) return -1;
+        *colon = '\0';
+        char* value = colon + 1;
+        while (*value == ' ' || *value == '\t') value++;
+        char* tail = end;
+        while (tail > value && (tail[-1] == ' ' || tail[-1] == '\t')) tail--;
+        *tail = '\0';
+
+        request->headers[request->header_count].name = name;
+        request->headers[request->header_count].value = value;
+        request->header_count++;
+    }
+
+    request->body = buf + parser->body_start;
+    request->body_len = parser->body_len;
+    request->body_remaining = parser->body_remaining;
+    return 0;
+}
+
+const char* http_request_header(const http_request_t* request, const char* name) {
+    for (int i = 0; i < request->header_count; i++) {
+        if (strcasecmp(request->headers[i].name, name) == 0) {
+            return request->headers[i].value;
+        }
+    }
+    return NULL;
+}
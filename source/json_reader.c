@@ -0,0 +1,267 @@
+#include "json_reader.h"
+#include <stdlib.h>
+#include <string.h>
+
+typedef enum {
+    VALUE_STRING,
+    VALUE_NUMBER,
+    VALUE_TRUE,
+    VALUE_FALSE,
+    VALUE_NULL
+} value_kind_t;
+
+static size_t skip_whitespace(const char* text, size_t len, size_t pos) {
+    while (pos < len && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\n' || text[pos] == '\r')) pos++;
+    return pos;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static long read_hex4(const char* p) {
+    long value = 0;
+    for (int i = 0; i < 4; i++) {
+        int digit = hex_value(p[i]);
+        if (digit < 0) return -1;
+        value = (value << 4) | digit;
+    }
+    return value;
+}
+
+// Validates the string whose opening quote is at pos. Returns the offset of
+// the closing quote, or 0 if the string is malformed.
+static size_t scan_string(const char* text, size_t len, size_t pos, int* escaped) {
+    *escaped = 0;
+    for (pos++; pos < len; pos++) {
+        unsigned char c = (unsigned char)text[pos];
+        if (c == '"') return pos;
+        if (c < 0x20) return 0;
+        if (c != '\\') continue;
+
+        *escaped = 1;
+        if (++pos >= len) return 0;
+        switch (text[pos]) {
+        case '"': case '\\': case '/': case 'b': case 'f': case 'n': case 'r': case 't':
+            break;
+        case 'u':
+            // \u0000 would cut the string short once it is terminated
+            if (len - pos < 5 || read_hex4(text + pos + 1) <= 0) return 0;
+            pos += 4;
+            break;
+        default:
+            return 0;
+        }
+    }
+    return 0;
+}
+
+// Validates a number starting at pos and returns the offset just past it,
+// or 0 if it does not follow the JSON grammar.
+static size_t scan_number(const char* text, size_t len, size_t pos) {
+    if (pos < len && text[pos] == '-') pos++;
+    if (pos >= len) return 0;
+    if (text[pos] == '0') {
+        pos++;
+    } else if (text[pos] >= '1' && text[pos] <= '9') {
+        while (pos < len && text[pos] >= '0' && text[pos] <= '9') pos++;
+    } else {
+        return 0;
+    }
+
+    if (pos < len && text[pos] == '.') {
+        size_t digits = ++pos;
+        while (pos < len && text[pos] >= '0' && text[pos] <= '9') pos++;
+        if (pos == digits) return 0;
+    }
+    if (pos < len && (text[pos] == 'e' || text[pos] == 'E')) {
+        pos++;
+        if (pos < len && (text[pos] == '+' || text[pos] == '-')) pos++;
+        size_t digits = pos;
+        while (pos < len && text[pos] >= '0' && text[pos] <= '9') pos++;
+        if (pos == digits) return 0;
+    }
+    return pos;
+}
+
+static int match_literal(const char* text, size_t len, size_t pos, const char* literal) {
+    size_t n = strlen(literal);
+    return len - pos >= n && memcmp(text + pos, literal, n) == 0;
+}
+
+static json_field_t* find_field(json_field_t* fields, int count, const char* key, size_t key_len) {
+    for (int i = 0; i < count; i++) {
+        if (strncmp(fields[i].name, key, key_len) == 0 && fields[i].name[key_len] == '\0') {
+            return &fields[i];
+        }
+    }
+    return NULL;
+}
+
+static size_t encode_utf8(char* out, long code) {
+    if (code < 0x80) {
+        out[0] = (char)code;
+        return 1;
+    }
+    if (code < 0x800) {
+        out[0] = (char)(0xc0 | (code >> 6));
+        out[1] = (char)(0x80 | (code & 0x3f));
+        return 2;
+    }
+    if (code < 0x10000) {
+        out[0] = (char)(0xe0 | (code >> 12));
+        out[1] = (char)(0x80 | ((code >> 6) & 0x3f));
+        out[2] = (char)(0x80 | (code & 0x3f));
+        return 3;
+    }
+    out[0] = (char)(0xf0 | (code >> 18));
+    out[1] = (char)(0x80 | ((code >> 12) & 0x3f));
+    out[2] = (char)(0x80 | ((code >> 6) & 0x3f));
+    out[3] = (char)(0x80 | (code & 0x3f));
+    return 4;
+}
+
+// Unescapes a validated string in place. The result is never longer than
+// its encoding, so the closing quote always has room for the terminator.
+static void decode_string(char* text, json_field_t* field) {
+    char* src = text + field->raw_start;
+    char* end = src + field->raw_len;
+    char* dst = src;
+
+    while (src < end) {
+        if (*src != '\\') {
+            *dst++ = *src++;
+            continue;
+        }
+
+        src++;
+        switch (*src++) {
+        case 'b': *dst++ = '\b'; break;
+        case 'f': *dst++ = '\f'; break;
+        case 'n': *dst++ = '\n'; break;
+        case 'r': *dst++ = '\r'; break;
+        case 't': *dst++ = '\t'; break;
+        case 'u': {
+            long code = read_hex4(src);
+            src += 4;
+            if (code >= 0xd800 && code <= 0xdbff && end - src >= 6 && src[0] == '\\' && src[1] == 'u') {
+                long low = read_hex4(src + 2);
+                if (low >= 0xdc00 && low <= 0xdfff) {
+                    code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                    src += 6;
+                }
+            }
+            if (code >= 0xd800 && code <= 0xdfff) code = 0xfffd; // unpaired surrogate
+            dst += encode_utf8(dst, code);
+            break;
+        }
+        default: *dst++ = src[-1]; break; // \" \\ \/
+        }
+    }
+    *dst = '\0';
+}
+
+int json_read_fields(char* text, size_t len, json_field_t* fields, int count) {
+    for (int i = 0; i < count; i++) fields[i].present = 0;
+
+    size_t pos = skip_whitespace(text, len, 0);
+    if (pos >= len || text[pos] != '{') return -1;
+    pos = skip_whitespace(text, len, pos + 1);
+
+    if (pos < len && text[pos] == '}') {
+        pos++;
+    } else {
+        for (;;) {
+            int escaped;
+            if (pos >= len || text[pos] != '"') return -1;
+            size_t key_end = scan_string(text, len, pos, &escaped);
+            if (!key_end || escaped) return -1;
+            json_field_t* field = find_field(fields, count, text + pos + 1, key_end - pos - 1);
+
+            pos = skip_whitespace(text, len, key_end + 1);
+            if (pos >= len || text[pos] != ':') return -1;
+            pos = skip_whitespace(text, len, pos + 1);
+            if (pos >= len) return -1;
+
+            size_t value_start = pos;
+            value_kind_t kind;
+            if (text[pos] == '"') {
+                size_t value_end = scan_string(text, len, pos, &escaped);
+                if (!value_end) return -1;
+                kind = VALUE_STRING;
+                pos = value_end + 1;
+            } else if (text[pos] == '-' || (text[pos] >= '0' && text[pos] <= '9')) {
+                pos = scan_number(text, len, pos);
+                if (!pos) return -1;
+                kind = VALUE_NUMBER;
+            } else if (match_literal(text, len, pos, "true")) {
+                kind = VALUE_TRUE;
+                pos += 4;
+            } else if (match_literal(text, len, pos, "false")) {
+                kind = VALUE_FALSE;
+                pos += 5;
+            } else if (match_literal(text, len, pos, "null")) {
+                kind = VALUE_NULL;
+                pos += 4;
+            } else {
+                return -1; // nested object or array
+            }
+
+            if (field) {
+                field->present = kind != VALUE_NULL;
+                switch (kind) {
+                case VALUE_STRING:
+                    if (field->type != JSON_FIELD_STRING) return -1;
+                    field->raw_start = value_start + 1;
+                    field->raw_len = pos - value_start - 2;
+                    field->escaped = escaped;
+                    break;
+                case VALUE_NUMBER: {
+                    if (field->type != JSON_FIELD_NUMBER) return -1;
+                    // Copied out so strtod() cannot run past the token
+                    char number[64];
+                    if (pos - value_start >= sizeof(number)) return -1;
+                    memcpy(number, text + value_start, pos - value_start);
+                    number[pos - value_start] = '\0';
+                    field->number = strtod(number, NULL);
+                    break;
+                }
+                case VALUE_TRUE:
+                case VALUE_FALSE:
+                    if (field->type != JSON_FIELD_BOOL) return -1;
+                    field->boolean = kind == VALUE_TRUE;
+                    break;
+                case VALUE_NULL:
+                    break;
+                }
+            }
+
+            pos = skip_whitespace(text, len, pos);
+            if (pos >= len) return -1;
+            if (text[pos] == '}') {
+                pos++;
+                break;
+            }
+            if (text[pos] != ',') return -1;
+            pos = skip_whitespace(text, len, pos + 1);
+        }
+    }
+
+    if (skip_whitespace(text, len, pos) != len) return -1;
+
+    // The whole object is valid; only now terminate strings in place
+    for (int i = 0; i < count; i++) {
+        json_field_t* field = &fields[i];
+        if (!field->present || field->type != JSON_FIELD_STRING) continue;
+        if (field->escaped) {
+            decode_string(text, field);
+        } else {
+            text[field->raw_start + field->raw_len] = '\0';
+        }
+        field->string = text + field->raw_start;
+    }
+    return 0;
+}
@@ -0,0 +1,189 @@
+#include "json_writer.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Escape for each byte: 0 copies it as is, 'u' writes \u00XX, anything else
+// is written after a backslash. Bytes >= 0x80 pass through, so valid UTF-8
+// stays valid.
+static const char escapes[256] = {
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    0, 0, '"', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\', 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 'u',
+};
+
+void json_writer_init(json_writer_t* w, size_t initial_size) {
+    memset(w, 0, sizeof(*w));
+    w->cap = initial_size ? initial_size : JSON_WRITER_INITIAL_SIZE;
+    w->data = malloc(w->cap);
+    if (!w->data) w->failed = 1;
+}
+
+void json_writer_free(json_writer_t* w) {
+    free(w->data);
+    w->data = NULL;
+    w->len = w->cap = 0;
+}
+
+int json_writer_finish(json_writer_t* w) {
+    if (w->failed) {
+        json_writer_free(w);
+        return -1;
+    }
+    return 0;
+}
+
+// Makes room for extra more bytes; returns 0 if the writer has failed
+static int reserve(json_writer_t* w, size_t extra) {
+    if (w->failed) return 0;
+    if (w->len + extra <= w->cap) return 1;
+
+    size_t cap = w->cap;
+    while (cap < w->len + extra) cap *= 2;
+    char* data = realloc(w->data, cap);
+    if (!data) {
+        w->failed = 1;
+        return 0;
+    }
+    w->data = data;
+    w->cap = cap;
+    return 1;
+}
+
+static void append(json_writer_t* w, const char* bytes, size_t len) {
+    if (!reserve(w, len)) return;
+    memcpy(w->data + w->len, bytes, len);
+    w->len += len;
+}
+
+static void append_char(json_writer_t* w, char c) {
+    if (!reserve(w, 1)) return;
+    w->data[w->len++] = c;
+}
+
+static void separate(json_writer_t* w) {
+    if (w->need_comma) append_char(w, ',');
+}
+
+void json_writer_begin_object(json_writer_t* w) {
+    separate(w);
+    append_char(w, '{');
+    w->need_comma = 0;
+}
+
+void json_writer_end_object(json_writer_t* w) {
+    append_char(w, '}');
+    w->need_comma = 1;
+}
+
+void json_writer_begin_array(json_writer_t* w) {
+    separate(w);
+    append_char(w, '[');
+    w->need_comma = 0;
+}
+
+void json_writer_end_array(json_writer_t* w) {
+    append_char(w, ']');
+    w->need_comma = 1;
+}
+
+static void write_escaped(json_writer_t* w, const char* value, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char* s = (const unsigned char*)value;
+    size_t start = 0;
+
+    append_char(w, '"');
+    for (size_t i = 0; i < len; i++) {
+        char esc = escapes[s[i]];
+        if (!esc) continue;
+
+        // Copy the run of plain bytes before this one in one go
+        append(w, value + start, i - start);
+        if (esc == 'u') {
+            char seq[6] = { '\\', 'u', '0', '0', hex[s[i] >> 4], hex[s[i] & 0xf] };
+            append(w, seq, sizeof(seq));
+        } else {
+            char seq[2] = { '\\', esc };
+            append(w, seq, sizeof(seq));
+        }
+        start = i + 1;
+    }
+    append(w, value + start, len - start);
+    append_char(w, '"');
+}
+
+void json_writer_key(json_writer_t* w, const char* key) {
+    separate(w);
+    write_escaped(w, key, strlen(key));
+    append_char(w, ':');
+    w->need_comma = 0;
+}
+
+void json_writer_string_len(json_writer_t* w, const char* value, size_t len) {
+    separate(w);
+    write_escaped(w, value, len);
+    w->need_comma = 1;
+}
+
+void json_writer_string(json_writer_t* w, const char* value) {
+    if (!value) {
+        json_writer_null(w);
+        return;
+    }
+    json_writer_string_len(w, value, strlen(value));
+}
+
+void json_writer_int(json_writer_t* w, long long value) {
+    char digits[24];
+    char* p = digits + sizeof(digits);
+    unsigned long long magnitude = value < 0 ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+
+    do {
+        *--p = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude);
+    if (value < 0) *--p = '-';
+
+    separate(w);
+    append(w, p, digits + sizeof(digits) - p);
+    w->need_comma = 1;
+}
+
+void json_writer_double(json_writer_t* w, double value) {
+    // JSON has no NaN or infinity
+    if (!isfinite(value)) {
+        json_writer_null(w);
+        return;
+    }
+
+    char text[32];
+    int len = snprintf(text, sizeof(text), "%.17g", value);
+    // Keep integral values recognisably floating point, as json-c does
+    if (!strpbrk(text, ".eE") && len + 2 < (int)sizeof(text)) {
+        text[len++] = '.';
+        text[len++] = '0';
+    }
+
+    separate(w);
+    append(w, text, len);
+    w->need_comma = 1;
+}
+
+void json_writer_bool(json_writer_t* w, int value) {
+    separate(w);
+    if (value) append(w, "true", 4);
+    else append(w, "false", 5);
+    w->need_comma = 1;
+}
+
+void json_writer_null(json_writer_t* w) {
+    separate(w);
+    append(w, "null", 4);
+    w->need_comma = 1;
+}
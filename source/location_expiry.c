@@ -0,0 +1,213 @@
+#include "server.h"
+
+#if AUTO_DELETE_EXPIRED_LOCATIONS
+
+// Purges shared locations when their duration runs out. Every user with a
+// shared location has one timer in a hierarchical wheel ticking once a
+// second: level 0 holds the next 64 seconds one slot per second, level 1
+// the next 64 minutes-ish in 64-second slots, level 2 the next three days
+// in 4096-second slots. A slot of a higher level is redistributed to the
+// level below when the wheel reaches it, so scheduling and rescheduling are
+// O(1) and each tick only touches the timers that are due. Sharing again
+// moves the user's timer; the timers due in a tick are purged together in
+// one transaction by the expiry thread.
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 3
+
+typedef struct location_timer {
+    int user_id;
+    time_t expires;
+    struct location_timer** slot;     // wheel slot it is linked into
+    struct location_timer* prev;
+    struct location_timer* next;
+    struct location_timer* user_next; // in its user bucket
+} location_timer_t;
+
+static location_timer_t* wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static location_timer_t* timers_by_user[LOCATION_EXPIRY_BUCKETS];
+static time_t wheel_time = 0; // last tick processed
+static int timer_count = 0;
+static pthread_mutex_t wheel_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wheel_ready;
+
+static unsigned int bucket_of(int user_id) {
+    return ((unsigned int)user_id * 2654435761u) & (LOCATION_EXPIRY_BUCKETS - 1);
+}
+
+static location_timer_t** slot_for(time_t expires) {
+    time_t target = expires > wheel_time ? expires : wheel_time + 1;
+    time_t delta = target - wheel_time;
+
+    // A slot is reached again every WHEEL_SLOTS of its level's ticks, so a
+    // timer goes to the lowest level that reaches its slot before it is due
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        int shift = level * WHEEL_BITS;
+        if (delta <= ((time_t)WHEEL_SLOTS << shift)) {
+            return &wheel[level][(target >> shift) & WHEEL_MASK];
+        }
+    }
+
+    // Further out than the wheel reaches: park it in the furthest slot of
+    // the top level and let the cascade place it again from there
+    int shift = (WHEEL_LEVELS - 1) * WHEEL_BITS;
+    target = wheel_time + ((time_t)WHEEL_SLOTS << shift);
+    return &wheel[WHEEL_LEVELS - 1][(target >> shift) & WHEEL_MASK];
+}
+
+static void link_timer(location_timer_t* timer) {
+    location_timer_t** slot = slot_for(timer->expires);
+    timer->slot = slot;
+    timer->prev = NULL;
+    timer->next = *slot;
+    if (*slot) (*slot)->prev = timer;
+    *slot = timer;
+}
+
+static void unlink_timer(location_timer_t* timer) {
+    if (timer->prev) {
+        timer->prev->next = timer->next;
+    } else {
+        *timer->slot = timer->next;
+    }
+    if (timer->next) timer->next->prev = timer->prev;
+    timer->prev = timer->next = NULL;
+}
+
+void location_expiry_schedule(int user_id, time_t expires) {
+    pthread_mutex_lock(&wheel_lock);
+
+    location_timer_t* timer = timers_by_user[bucket_of(user_id)];
+    while (timer && timer->user_id != user_id) timer = timer->user_next;
+
+    if (timer) {
+        unlink_timer(timer);
+    } else {
+        timer = calloc(1, sizeof(location_timer_t));
+        if (!timer) {
+            // Reads still filter on expiry; the row is just not purged
+            pthread_mutex_unlock(&wheel_lock);
+            return;
+        }
+        timer->user_id = user_id;
+        unsigned int bucket = bucket_of(user_id);
+        timer->user_next = timers_by_user[bucket];
+        timers_by_user[bucket] = timer;
+        if (timer_count++ == 0) pthread_cond_signal(&wheel_ready);
+    }
+
+    timer->expires = expires;
+    link_timer(timer);
+    pthread_mutex_unlock(&wheel_lock);
+}
+
+static void forget_timer(location_timer_t* timer) {
+    location_timer_t** link = &timers_by_user[bucket_of(timer->user_id)];
+    while (*link != timer) link = &(*link)->user_next;
+    *link = timer->user_next;
+    timer_count--;
+    free(timer);
+}
+
+// Moves every timer in a slot down to where it now belongs
+static void cascade(int level, int index) {
+    location_timer_t* timer = wheel[level][index];
+    wheel[level][index] = NULL;
+    while (timer) {
+        location_timer_t* next = timer->next;
+        link_timer(timer);
+        timer = next;
+    }
+}
+
+// Advances the wheel by one second, collecting the users whose time is up
+static void tick(int** expired, int* count, int* cap) {
+    time_t now = ++wheel_time;
+
+    // Top level first, so a timer due right now falls all the way through
+    for (int level = WHEEL_LEVELS - 1; level > 0; level--) {
+        int shift = level * WHEEL_BITS;
+        if ((now & (((time_t)1 << shift) - 1)) == 0) {
+            wheel_time = now - 1;
+            cascade(level, (now >> shift) & WHEEL_MASK);
+            wheel_time = now;
+        }
+    }
+
+    location_timer_t* timer = wheel[0][now & WHEEL_MASK];
+    wheel[0][now & WHEEL_MASK] = NULL;
+    while (timer) {
+        location_timer_t* next = timer->next;
+        if (*count == *cap) {
+            int grown_cap = *cap ? *cap * 2 : 64;
+            int* grown = realloc(*expired, sizeof(int) * grown_cap);
+            if (!grown) {
+                // Try again next tick
+                link_timer(timer);
+                timer = next;
+                continue;
+            }
+            *expired = grown;
+            *cap = grown_cap;
+        }
+        (*expired)[(*count)++] = timer->user_id;
+        forget_timer(timer);
+        timer = next;
+    }
+}
+
+static void* location_expirer(void* arg) {
+    (void)arg;
+    int* expired = NULL;
+    int cap = 0;
+
+    pthread_mutex_lock(&wheel_lock);
+    while (1) {
+        while (timer_count == 0) {
+            pthread_cond_wait(&wheel_ready, &wheel_lock);
+        }
+
+        // Timers run on the wall clock that the rows store; catch up on
+        // every second since the last pass, or skip ahead if nothing waits
+        int count = 0;
+        time_t now = time(NULL);
+        while (wheel_time < now && timer_count > 0) {
+            tick(&expired, &count, &cap);
+        }
+        if (wheel_time < now) wheel_time = now;
+
+        if (count > 0) {
+            pthread_mutex_unlock(&wheel_lock);
+            expire_user_locations(expired, count);
+            pthread_mutex_lock(&wheel_lock);
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += 1;
+        pthread_cond_timedwait(&wheel_ready, &wheel_lock, &deadline);
+    }
+    return NULL;
+}
+
+int location_expiry_start(void) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wheel_ready, &attr);
+    pthread_condattr_destroy(&attr);
+
+    wheel_time = time(NULL) - 1;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, location_expirer, NULL) != 0) {
+        perror("Failed to start location expiry");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,313 @@
+#include "server.h"
+#include <math.h>
+
+#if LOCATION_WRITE_BEHIND
+
+// Latest shared position of every user, held in memory in front of SQLite.
+// update_user_location() only overwrites the user's entry and marks it
+// dirty, so a client reporting every few seconds costs a hash lookup
+// instead of a write transaction; a flusher thread writes the dirty entries
+// out in one transaction per interval, and whatever a user sent in between
+// collapses into the last position. Location reads are answered from here.
+//
+// Entries are found by user id through a hash table and by position through
+// a grid of one-degree cells, which bounding box queries walk instead of the
+// whole table. One lock covers everything: updates hold it for a few
+// pointer moves, and reads copy rows out and format them after letting go.
+
+#define GRID_ROWS 180
+#define GRID_COLS 360
+
+typedef struct location_entry {
+    int user_id;
+    char username[50];
+    double latitude;
+    double longitude;
+    time_t updated;
+    int duration; // in minutes
+    int cell;
+    int dirty;
+    struct location_entry* user_next;
+    struct location_entry* cell_prev;
+    struct location_entry* cell_next;
+    struct location_entry* dirty_prev;
+    struct location_entry* dirty_next;
+} location_entry_t;
+
+static location_entry_t* entries_by_user[LOCATION_STORE_BUCKETS];
+static location_entry_t* grid[GRID_ROWS * GRID_COLS];
+static location_entry_t* dirty_head = NULL;
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int bucket_of(int user_id) {
+    return ((unsigned int)user_id * 2654435761u) & (LOCATION_STORE_BUCKETS - 1);
+}
+
+static int grid_row(double lat) {
+    int row = (int)floor(lat + 90.0);
+    return row < 0 ? 0 : row >= GRID_ROWS ? GRID_ROWS - 1 : row;
+}
+
+static int grid_col(double lng) {
+    int col = (int)floor(lng + 180.0);
+    return col < 0 ? 0 : col >= GRID_COLS ? GRID_COLS - 1 : col;
+}
+
+static location_entry_t* find_entry(int user_id) {
+    location_entry_t* entry = entries_by_user[bucket_of(user_id)];
+    while (entry && entry->user_id != user_id) entry = entry->user_next;
+    return entry;
+}
+
+static void link_cell(location_entry_t* entry) {
+    entry->cell = grid_row(entry->latitude) * GRID_COLS + grid_col(entry->longitude);
+    entry->cell_prev = NULL;
+    entry->cell_next = grid[entry->cell];
+    if (grid[entry->cell]) grid[entry->cell]->cell_prev = entry;
+    grid[entry->cell] = entry;
+}
+
+static void unlink_cell(location_entry_t* entry) {
+    if (entry->cell_prev) {
+        entry->cell_prev->cell_next = entry->cell_next;
+    } else {
+        grid[entry->cell] = entry->cell_next;
+    }
+    if (entry->cell_next) entry->cell_next->cell_prev = entry->cell_prev;
+}
+
+static void mark_dirty(location_entry_t* entry) {
+    if (entry->dirty) return;
+    entry->dirty = 1;
+    entry->dirty_prev = NULL;
+    entry->dirty_next = dirty_head;
+    if (dirty_head) dirty_head->dirty_prev = entry;
+    dirty_head = entry;
+}
+
+static void clear_dirty(location_entry_t* entry) {
+    if (!entry->dirty) return;
+    if (entry->dirty_prev) {
+        entry->dirty_prev->dirty_next = entry->dirty_next;
+    } else {
+        dirty_head = entry->dirty_next;
+    }
+    if (entry->dirty_next) entry->dirty_next->dirty_prev = entry->dirty_prev;
+    entry->dirty = 0;
+}
+
+static int expired(const location_entry_t* entry, time_t now) {
+    return entry->updated + (time_t)entry->duration * 60 <= now;
+}
+
+// Writes or replaces an entry; username is only needed for a new one.
+// Returns 1 if the entry is new and no username was given.
+static int store(int user_id, const char* username, double lat, double lng,
+                 time_t updated, int duration, int dirty) {
+    location_entry_t* entry = find_entry(user_id);
+    if (entry) {
+        unlink_cell(entry);
+    } else {
+        if (!username) return 1;
+        entry = calloc(1, sizeof(location_entry_t));
+        if (!entry) return -1;
+        entry->user_id = user_id;
+        strncpy(entry->username, username, sizeof(entry->username) - 1);
+        unsigned int bucket = bucket_of(user_id);
+        entry->user_next = entries_by_user[bucket];
+        entries_by_user[bucket] = entry;
+    }
+
+    entry->latitude = lat;
+    entry->longitude = lng;
+    entry->updated = updated;
+    entry->duration = duration;
+    link_cell(entry);
+    if (dirty) mark_dirty(entry);
+    return 0;
+}
+
+int location_store_update(int user_id, const char* username, double lat, double lng,
+                          time_t updated, int duration) {
+    pthread_mutex_lock(&store_lock);
+    int rc = store(user_id, username, lat, lng, updated, duration, 1);
+    pthread_mutex_unlock(&store_lock);
+    return rc;
+}
+
+int location_store_load(const user_t* user, void* ctx) {
+    (void)ctx;
+    pthread_mutex_lock(&store_lock);
+    int rc = store(user->id, user->username, user->latitude, user->longitude,
+                   user->location_updated, user->location_duration, 0);
+    pthread_mutex_unlock(&store_lock);
+    return rc < 0 ? -1 : 0;
+}
+
+void location_store_forget(const int* user_ids, int count, time_t now) {
+    pthread_mutex_lock(&store_lock);
+    for (int i = 0; i < count; i++) {
+        location_entry_t** link = &entries_by_user[bucket_of(user_ids[i])];
+        while (*link && (*link)->user_id != user_ids[i]) link = &(*link)->user_next;
+
+        // Shared again since the timer was set
+        location_entry_t* entry = *link;
+        if (!entry || !expired(entry, now)) continue;
+
+        *link = entry->user_next;
+        unlink_cell(entry);
+        clear_dirty(entry);
+        free(entry);
+    }
+    pthread_mutex_unlock(&store_lock);
+}
+
+int location_store_take_dirty(location_update_t** updates, int* cap) {
+    pthread_mutex_lock(&store_lock);
+    int count = 0;
+    while (dirty_head) {
+        if (count == *cap) {
+            int grown_cap = *cap ? *cap * 2 : 256;
+            location_update_t* grown = realloc(*updates, sizeof(location_update_t) * grown_cap);
+            if (!grown) break; // the rest waits for the next flush
+            *updates = grown;
+            *cap = grown_cap;
+        }
+
+        location_entry_t* entry = dirty_head;
+        location_update_t* update = &(*updates)[count++];
+        update->user_id = entry->user_id;
+        update->latitude = entry->latitude;
+        update->longitude = entry->longitude;
+        update->updated = entry->updated;
+        update->duration = entry->duration;
+        clear_dirty(entry);
+    }
+    pthread_mutex_unlock(&store_lock);
+    return count;
+}
+
+void location_store_requeue(const location_update_t* updates, int count) {
+    pthread_mutex_lock(&store_lock);
+    for (int i = 0; i < count; i++) {
+        location_entry_t* entry = find_entry(updates[i].user_id);
+        if (entry) mark_dirty(entry);
+    }
+    pthread_mutex_unlock(&store_lock);
+}
+
+// Rows copied out under the lock, handed to the callback after it
+typedef struct {
+    user_t* users;
+    int count;
+    int cap;
+} row_copy_t;
+
+static int copy_row(row_copy_t* rows, const location_entry_t* entry) {
+    if (rows->count == rows->cap) {
+        int cap = rows->cap ? rows->cap * 2 : 64;
+        user_t* grown = realloc(rows->users, sizeof(user_t) * cap);
+        if (!grown) return -1;
+        rows->users = grown;
+        rows->cap = cap;
+    }
+
+    user_t* user = &rows->users[rows->count++];
+    memset(user, 0, sizeof(*user));
+    user->id = entry->user_id;
+    strcpy(user->username, entry->username);
+    user->location_consent = 1;
+    user->latitude = entry->latitude;
+    user->longitude = entry->longitude;
+    user->location_updated = entry->updated;
+    user->location_duration = entry->duration;
+    return 0;
+}
+
+static void hand_out(row_copy_t* rows, user_row_fn fn, void* ctx) {
+    for (int i = 0; i < rows->count; i++) {
+        if (fn(&rows->users[i], ctx) != 0) break;
+    }
+    free(rows->users);
+}
+
+int location_store_each(time_t now, user_row_fn fn, void* ctx) {
+    row_copy_t rows = { 0 };
+    int rc = 0;
+
+    pthread_mutex_lock(&store_lock);
+    for (int bucket = 0; bucket < LOCATION_STORE_BUCKETS && rc == 0; bucket++) {
+        for (location_entry_t* entry = entries_by_user[bucket]; entry && rc == 0; entry = entry->user_next) {
+            if (!expired(entry, now)) rc = copy_row(&rows, entry);
+        }
+    }
+    pthread_mutex_unlock(&store_lock);
+
+    if (rc < 0) {
+        free(rows.users);
+        return -1;
+    }
+    hand_out(&rows, fn, ctx);
+    return 0;
+}
+
+int location_store_each_in_box(double min_lat, double max_lat, double min_lng, double max_lng,
+                               int limit, time_t now, user_row_fn fn, void* ctx) {
+    // A box with min_lng > max_lng crosses the antimeridian; walk both sides
+    double ranges[2][2] = { { min_lng, max_lng }, { -180.0, max_lng } };
+    int range_count = 1;
+    if (min_lng > max_lng) {
+        ranges[0][1] = 180.0;
+        range_count = 2;
+    }
+
+    row_copy_t rows = { 0 };
+    int rc = 0;
+
+    pthread_mutex_lock(&store_lock);
+    for (int r = 0; r < range_count; r++) {
+        int first_col = grid_col(ranges[r][0]);
+        int last_col = grid_col(ranges[r][1]);
+        for (int row = grid_row(min_lat); row <= grid_row(max_lat); row++) {
+            for (int col = first_col; col <= last_col; col++) {
+                location_entry_t* entry = grid[row * GRID_COLS + col];
+                for (; entry && rc == 0 && (limit < 0 || rows.count < limit); entry = entry->cell_next) {
+                    if (entry->latitude >= min_lat && entry->latitude <= max_lat &&
+                        entry->longitude >= ranges[r][0] && entry->longitude <= ranges[r][1] &&
+                        !expired(entry, now)) {
+                        rc = copy_row(&rows, entry);
+                    }
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&store_lock);
+
+    if (rc < 0) {
+        free(rows.users);
+        return -1;
+    }
+    hand_out(&rows, fn, ctx);
+    return 0;
+}
+
+static void* location_flusher(void* arg) {
+    (void)arg;
+    while (1) {
+        usleep(LOCATION_FLUSH_INTERVAL_MS * 1000);
+        flush_user_locations();
+    }
+    return NULL;
+}
+
+int location_store_start(void) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, location_flusher, NULL) != 0) {
+        perror("Failed to start location flusher");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,183 @@
+#include "server.h"
+
+// Parked GET /api/messages/wait requests. A worker that finds nothing new
+// marks the connection parked and hands it back to the loop without a
+// response; from then on only the loop thread touches it, through the
+// per-user waiter table and a list ordered by deadline. A wake-up
+// resubmits the connection to a worker, which checks the database again.
+// The deadline is set when the request first parks and kept when it parks
+// again, so spurious wake-ups do not extend the wait. Every wait has the
+// same timeout, so a new waiter goes at the end of the list and only one
+// parking again may have to move further in.
+//
+// save_message() publishes through latest_ids, the highest message id
+// seen per user bucket. A worker reads it before its database check and
+// parks with that value; if the bucket has moved on by the time the loop
+// registers the waiter, a message may have slipped in between and the
+// waiter is woken straight away. Buckets are shared, so a wake-up can be
+// spurious; the worker then simply parks again with the newer value.
+
+static int latest_ids[LONG_POLL_BUCKETS];
+
+static connection_t* waiters[LONG_POLL_BUCKETS];
+static connection_t* oldest = NULL;
+static connection_t* newest = NULL;
+static int parked_count = 0;
+
+// User ids with new messages, waiting for the loop
+static int* notified = NULL;
+static int notified_count = 0;
+static int notified_cap = 0;
+static pthread_mutex_t notified_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int bucket_of(int user_id) {
+    return ((unsigned int)user_id * 2654435761u) & (LONG_POLL_BUCKETS - 1);
+}
+
+int long_poll_latest(int user_id) {
+    return __atomic_load_n(&latest_ids[bucket_of(user_id)], __ATOMIC_ACQUIRE);
+}
+
+void long_poll_notify(int user_id, int message_id) {
+    int* latest = &latest_ids[bucket_of(user_id)];
+    int seen = __atomic_load_n(latest, __ATOMIC_RELAXED);
+    while (seen < message_id &&
+           !__atomic_compare_exchange_n(latest, &seen, message_id, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    }
+
+    // Nobody waiting: anyone who parks later sees latest_ids instead
+    if (__atomic_load_n(&parked_count, __ATOMIC_SEQ_CST) == 0) return;
+
+    pthread_mutex_lock(&notified_lock);
+    if (notified_count == notified_cap) {
+        int cap = notified_cap ? notified_cap * 2 : 64;
+        int* grown = realloc(notified, sizeof(int) * cap);
+        if (!grown) {
+            pthread_mutex_unlock(&notified_lock);
+            return; // the waiter times out and checks anyway
+        }
+        notified = grown;
+        notified_cap = cap;
+    }
+    notified[notified_count++] = user_id;
+    pthread_mutex_unlock(&notified_lock);
+
+    event_loop_wake();
+}
+
+void long_poll_wait(client_t* client, int since_id, int seen_id, int limit) {
+    connection_t* conn = (connection_t*)client;
+    conn->parked = 1;
+    conn->wait.user_id = client->user.id;
+    conn->wait.since_id = since_id;
+    conn->wait.seen_id = seen_id;
+    conn->wait.limit = limit;
+    conn->wait.timed_out = 0;
+    if (!conn->wait.deadline_ns) {
+        conn->wait.deadline_ns = monotonic_ns() + LONG_POLL_TIMEOUT_MS * 1000000ULL;
+    }
+}
+
+static void unlink_waiter(connection_t* conn) {
+    long_poll_t* wait = &conn->wait;
+
+    if (wait->bucket_prev) {
+        wait->bucket_prev->wait.bucket_next = wait->bucket_next;
+    } else {
+        waiters[bucket_of(wait->user_id)] = wait->bucket_next;
+    }
+    if (wait->bucket_next) wait->bucket_next->wait.bucket_prev = wait->bucket_prev;
+
+    if (wait->older) {
+        wait->older->wait.newer = wait->newer;
+    } else {
+        oldest = wait->newer;
+    }
+    if (wait->newer) {
+        wait->newer->wait.older = wait->older;
+    } else {
+        newest = wait->older;
+    }
+
+    wait->bucket_prev = wait->bucket_next = wait->older = wait->newer = NULL;
+    __atomic_sub_fetch(&parked_count, 1, __ATOMIC_RELEASE);
+}
+
+static void wake(connection_t* conn, int timed_out) {
+    unlink_waiter(conn);
+    conn->parked = 0;
+    conn->wait.timed_out = timed_out;
+    connection_resume(conn);
+}
+
+void long_poll_park(connection_t* conn) {
+    long_poll_t* wait = &conn->wait;
+    unsigned int bucket = bucket_of(wait->user_id);
+
+    // Counted first, so a notifier that misses the waiter still queues
+    __atomic_add_fetch(&parked_count, 1, __ATOMIC_SEQ_CST);
+
+    wait->bucket_prev = NULL;
+    wait->bucket_next = waiters[bucket];
+    if (waiters[bucket]) waiters[bucket]->wait.bucket_prev = conn;
+    waiters[bucket] = conn;
+
+    connection_t* older = newest;
+    while (older && older->wait.deadline_ns > wait->deadline_ns) older = older->wait.older;
+    connection_t* newer = older ? older->wait.newer : oldest;
+    wait->older = older;
+    wait->newer = newer;
+    if (older) {
+        older->wait.newer = conn;
+    } else {
+        oldest = conn;
+    }
+    if (newer) {
+        newer->wait.older = conn;
+    } else {
+        newest = conn;
+    }
+
+    if (__atomic_load_n(&latest_ids[bucket], __ATOMIC_SEQ_CST) > wait->seen_id) {
+        wake(conn, 0);
+    }
+}
+
+void long_poll_cancel(connection_t* conn) {
+    if (conn->parked) {
+        unlink_waiter(conn);
+        conn->parked = 0;
+    }
+}
+
+void long_poll_drain(void) {
+    pthread_mutex_lock(&notified_lock);
+    int count = notified_count;
+    int* users = notified;
+    notified = NULL;
+    notified_count = notified_cap = 0;
+    pthread_mutex_unlock(&notified_lock);
+
+    for (int i = 0; i < count; i++) {
+        connection_t* conn = waiters[bucket_of(users[i])];
+        while (conn) {
+            connection_t* next = conn->wait.bucket_next;
+            if (conn->wait.user_id == users[i]) wake(conn, 0);
+            conn = next;
+        }
+    }
+    free(users);
+}
+
+int long_poll_expire(void) {
+    if (!oldest) return -1;
+
+    uint64_t now = monotonic_ns();
+    while (oldest && oldest->wait.deadline_ns <= now) {
+        wake(oldest, 1);
+    }
+    if (!oldest) return -1;
+
+    // Rounded up so the loop does not wake just before the deadline
+    return (int)((oldest->wait.deadline_ns - now + 999999) / 1000000);
+}
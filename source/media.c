@@ -0,0 +1,336 @@
+#include "server.h"
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/evp.h>
+#include <sys/stat.h>
+
+#if ENABLE_FILE_UPLOAD
+
+// Uploaded media, stored once per content under MEDIA_DIR/<ab>/<hash>,
+// where hash is the hex SHA-256 of the file and ab its first two digits.
+//
+// An upload never sits in memory as a whole. Bodies too large for the
+// request buffer are streamed in by the event loop (connection_stream_body)
+// a socket read at a time, and each piece is hashed and written to a
+// temporary file in MEDIA_DIR/tmp. Once complete, the file is synced and
+// renamed to its hash, and the directory synced so the name survives a
+// crash before the database row refers to it. If that name already exists
+// the same content is stored already, and the copy is dropped.
+//
+// Downloads go from the page cache to the socket with sendfile, whole or
+// as a single byte range.
+
+#define MEDIA_TEMP_DIR MEDIA_DIR "/tmp"
+#define MEDIA_DEFAULT_TYPE "application/octet-stream"
+
+typedef struct {
+    body_stream_t stream;  // first, so the loop's pointer is the upload's
+    int user_id;
+    int fd;
+    int failed;            // a write to the temporary file failed
+    long long size;
+    EVP_MD_CTX* sha;
+    char temp_path[64];
+    char content_type[100];
+} media_upload_t;
+
+// Clears out uploads left unfinished by an earlier run
+static void clean_temp_dir(void) {
+    DIR* dir = opendir(MEDIA_TEMP_DIR);
+    if (!dir) return;
+
+    struct dirent* entry;
+    char path[512];
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "%s/%s", MEDIA_TEMP_DIR, entry->d_name);
+        unlink(path);
+    }
+    closedir(dir);
+}
+
+int media_init(void) {
+    if ((mkdir(MEDIA_DIR, 0700) < 0 && errno != EEXIST) ||
+        (mkdir(MEDIA_TEMP_DIR, 0700) < 0 && errno != EEXIST)) {
+        perror("Failed to create media directory");
+        return -1;
+    }
+    clean_temp_dir();
+    return 0;
+}
+
+static void media_file_path(const char* hash, char* path, size_t size) {
+    snprintf(path, size, "%s/%.2s/%s", MEDIA_DIR, hash, hash);
+}
+
+// Keeps a client's Content-Type if it is a plain media type that is safe
+// to send back in a header
+static void copy_content_type(const char* value, char* type, size_t size) {
+    size_t len = 0;
+    if (value) {
+        for (; value[len] && len + 1 < size; len++) {
+            char c = value[len];
+            if (!isalnum((unsigned char)c) && !strchr("!#$&^_.+-/;= ", c)) break;
+        }
+    }
+    if (len == 0 || value[len] != '\0' || !strchr(value, '/')) {
+        snprintf(type, size, "%s", MEDIA_DEFAULT_TYPE);
+        return;
+    }
+    memcpy(type, value, len);
+    type[len] = '\0';
+}
+
+static int write_upload(body_stream_t* stream, const char* data, size_t len) {
+    media_upload_t* upload = (media_upload_t*)stream;
+    if (!EVP_DigestUpdate(upload->sha, data, len)) {
+        upload->failed = 1;
+        return -1;
+    }
+    upload->size += len;
+
+    while (len > 0) {
+        ssize_t written = write(upload->fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            upload->failed = 1;
+            return -1;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+static void discard_upload(media_upload_t* upload) {
+    EVP_MD_CTX_free(upload->sha);
+    if (upload->fd >= 0) close(upload->fd);
+    unlink(upload->temp_path);
+    free(upload);
+}
+
+// Makes the entries of a directory durable, as fsync on a file does not
+static int sync_dir(const char* path) {
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    int rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+// Moves a complete upload to its content address; returns 0 on success
+static int store_upload(media_upload_t* upload, const char* hash) {
+    if (fdatasync(upload->fd) < 0) return -1;
+    close(upload->fd);
+    upload->fd = -1;
+
+    char dir[128];
+    snprintf(dir, sizeof(dir), "%s/%.2s", MEDIA_DIR, hash);
+    if (mkdir(dir, 0700) == 0) {
+        if (sync_dir(MEDIA_DIR) < 0) return -1;
+    } else if (errno != EEXIST) {
+        return -1;
+    }
+
+    char path[128];
+    media_file_path(hash, path, sizeof(path));
+    if (access(path, F_OK) == 0) {
+        // Stored already; the copy just received is not needed
+        unlink(upload->temp_path);
+        return 0;
+    }
+    if (rename(upload->temp_path, path) < 0) return -1;
+    return sync_dir(dir);
+}
+
+static void finish_upload(client_t* client, body_stream_t* stream) {
+    media_upload_t* upload = (media_upload_t*)stream;
+    if (upload->failed) {
+        send_response(client, 500, "application/json", "{\"error\":\"Failed to store media\"}");
+        discard_upload(upload);
+        return;
+    }
+    if (stream->remaining > 0) {
+        // Cut short; the connection is closing and nobody waits for an answer
+        discard_upload(upload);
+        return;
+    }
+
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    if (!EVP_DigestFinal_ex(upload->sha, digest, NULL)) {
+        send_response(client, 500, "application/json", "{\"error\":\"Failed to store media\"}");
+        discard_upload(upload);
+        return;
+    }
+
+    media_t media = {0};
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+        sprintf(media.hash + i * 2, "%02x", digest[i]);
+    }
+    media.size = upload->size;
+    snprintf(media.content_type, sizeof(media.content_type), "%s", upload->content_type);
+    media.created_at = time(NULL);
+
+    if (store_upload(upload, media.hash) < 0) {
+        send_response(client, 500, "application/json", "{\"error\":\"Failed to store media\"}");
+        discard_upload(upload);
+        return;
+    }
+
+    int rc = save_media(&media, upload->user_id);
+    // Stored before, perhaps under another type; answer with the stored row
+    if (rc == 1 && find_media(media.hash, upload->user_id, &media) != 0) rc = -1;
+    discard_upload(upload);
+    if (rc < 0) {
+        send_response(client, 500, "application/json", "{\"error\":\"Failed to store media\"}");
+        return;
+    }
+
+    char body[256];
+    snprintf(body, sizeof(body),
+             "{\"success\":true,\"media\":\"%s\",\"size\":%lld,\"content_type\":\"%s\",\"deduplicated\":%s}",
+             media.hash, media.size, media.content_type, rc == 1 ? "true" : "false");
+    send_response(client, 201, "application/json", body);
+}
+
+void api_upload_media(client_t* client, http_request_t* request) {
+    if (!client->authenticated) {
+        send_response(client, 401, "application/json", "{\"error\":\"Not authenticated\"}");
+        return;
+    }
+    if (request->body_len == 0 && request->body_remaining == 0) {
+        send_response(client, 400, "application/json", "{\"error\":\"Missing media\"}");
+        return;
+    }
+
+    media_upload_t* upload = calloc(1, sizeof(media_upload_t));
+    if (!upload) {
+        send_response(client, 500, "application/json", "{\"error\":\"Out of memory\"}");
+        return;
+    }
+    snprintf(upload->temp_path, sizeof(upload->temp_path), "%s/upload-XXXXXX", MEDIA_TEMP_DIR);
+    upload->fd = mkostemp(upload->temp_path, O_CLOEXEC);
+    if (upload->fd < 0) {
+        free(upload);
+        send_response(client, 500, "application/json", "{\"error\":\"Failed to store media\"}");
+        return;
+    }
+
+    upload->sha = EVP_MD_CTX_new();
+    if (!upload->sha || !EVP_DigestInit_ex(upload->sha, EVP_sha256(), NULL)) {
+        discard_upload(upload);
+        send_response(client, 500, "application/json", "{\"error\":\"Failed to store media\"}");
+        return;
+    }
+
+    upload->user_id = client->user.id;
+    upload->stream.write = write_upload;
+    upload->stream.finish = finish_upload;
+    copy_content_type(http_request_header(request, "Content-Type"),
+                      upload->content_type, sizeof(upload->content_type));
+
+    // Small uploads arrive whole with the request; large ones are streamed
+    if (request->body_remaining) {
+        connection_stream_body(client, request, &upload->stream);
+        return;
+    }
+    write_upload(&upload->stream, request->body, request->body_len);
+    finish_upload(client, &upload->stream);
+}
+
+// Reads a single "bytes=" range. Returns 1 with the range set, 0 to send
+// the whole file (no usable header, or several ranges, which are not
+// supported), or -1 if the range lies beyond the end of the file.
+static int parse_range(const char* header, long long size, long long* start, long long* end) {
+    if (strncmp(header, "bytes=", 6) != 0 || strchr(header, ',')) return 0;
+    const char* p = header + 6;
+    while (*p == ' ') p++;
+
+    char* after;
+    if (*p == '-') {
+        // The last n bytes
+        if (!isdigit((unsigned char)p[1])) return 0;
+        long long suffix = strtoll(p + 1, &after, 10);
+        if (*after) return 0;
+        if (suffix == 0 || size == 0) return -1;
+        *start = suffix < size ? size - suffix : 0;
+        *end = size - 1;
+        return 1;
+    }
+
+    if (!isdigit((unsigned char)*p)) return 0;
+    long long first = strtoll(p, &after, 10);
+    if (*after != '-') return 0;
+    p = after + 1;
+    long long last = size - 1;
+    if (*p) {
+        if (!isdigit((unsigned char)*p)) return 0;
+        last = strtoll(p, &after, 10);
+        if (*after || last < first) return 0;
+        if (last > size - 1) last = size - 1;
+    }
+    if (first >= size) return -1;
+
+    *start = first;
+    *end = last;
+    return 1;
+}
+
+void api_get_media(client_t* client, http_request_t* request) {
+    if (!client->authenticated) {
+        send_response(client, 401, "application/json", "{\"error\":\"Not authenticated\"}");
+        return;
+    }
+
+    // The route only matches a hex SHA-256 as the last segment
+    const char* hash = strrchr(request->path, '/') + 1;
+    media_t media;
+    int rc = find_media(hash, client->user.id, &media);
+    if (rc < 0) {
+        send_response(client, 500, "application/json", "{\"error\":\"Failed to retrieve media\"}");
+        return;
+    }
+    if (rc > 0) {
+        send_response(client, 404, "application/json", "{\"error\":\"Media not found\"}");
+        return;
+    }
+
+    char path[128];
+    media_file_path(media.hash, path, sizeof(path));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) close(fd);
+        send_response(client, 500, "application/json", "{\"error\":\"Failed to retrieve media\"}");
+        return;
+    }
+
+    long long size = st.st_size;
+    long long start = 0, end = size - 1;
+    const char* range = http_request_header(request, "Range");
+    int partial = range ? parse_range(range, size, &start, &end) : 0;
+
+    // Content never changes under its hash, so caches may keep it for good
+    char headers[512];
+    int len = snprintf(headers, sizeof(headers),
+        "Accept-Ranges: bytes\r\n"
+        "ETag: \"%s\"\r\n"
+        "Cache-Control: private, max-age=31536000, immutable\r\n"
+        "X-Content-Type-Options: nosniff\r\n",
+        media.hash);
+
+    if (partial < 0) {
+        snprintf(headers + len, sizeof(headers) - len, "Content-Range: bytes */%lld\r\n", size);
+        send_file_response(client, 416, media.content_type, fd, 0, 0, headers);
+        return;
+    }
+    if (partial) {
+        snprintf(headers + len, sizeof(headers) - len, "Content-Range: bytes %lld-%lld/%lld\r\n",
+                 start, end, size);
+    }
+    send_file_response(client, partial ? 206 : 200, media.content_type, fd, start, end - start + 1, headers);
+}
+
+#endif
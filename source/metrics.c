@@ -0,0 +1,348 @@
+#include "server.h"
+#include <stdarg.h>
+
+// Request counters and phase latency histograms. Every thread that handles
+// requests owns a block of counters and only ever writes its own, with
+// plain relaxed loads and stores, so recording takes no locks and no
+// locked instructions. The metrics endpoint sums all blocks on demand;
+// a block being written meanwhile may be a request behind, never torn.
+//
+// Histograms are log-linear in the manner of HdrHistogram: each power of
+// two of nanoseconds is split into 8 equal buckets, which keeps any
+// reported quantile within 12.5% of the true value from 1 ns to a minute.
+
+#define SUB_BUCKET_BITS 3
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define MAX_EXPONENT 36 // 2^36 ns is about 69 s; longer values are clamped
+#define HISTOGRAM_BUCKETS ((MAX_EXPONENT - SUB_BUCKET_BITS + 2) * SUB_BUCKETS)
+
+static const char* const route_names[ROUTE_COUNT] = {
+    [ROUTE_OTHER] = "other",
+    [ROUTE_ROOT] = "root",
+    [ROUTE_OPTIONS] = "options",
+    [ROUTE_REGISTER] = "register",
+    [ROUTE_LOGIN] = "login",
+    [ROUTE_SEND_MESSAGE] = "send_message",
+    [ROUTE_UPDATE_LOCATION] = "update_location",
+    [ROUTE_GET_LOCATIONS] = "get_locations",
+    [ROUTE_GET_USERS] = "get_users",
+    [ROUTE_GET_MESSAGES] = "get_messages",
+    [ROUTE_WAIT_MESSAGES] = "wait_messages",
+    [ROUTE_WEBSOCKET] = "websocket",
+    [ROUTE_METRICS] = "metrics",
+    [ROUTE_CREATE_GROUP] = "create_group",
+    [ROUTE_GET_GROUPS] = "get_groups",
+    [ROUTE_ADD_GROUP_MEMBER] = "add_group_member",
+    [ROUTE_SEND_GROUP_MESSAGE] = "send_group_message",
+    [ROUTE_GET_GROUP_MESSAGES] = "get_group_messages",
+    [ROUTE_MARK_GROUP_READ] = "mark_group_read",
+    [ROUTE_SEARCH_MESSAGES] = "search_messages",
+    [ROUTE_UPLOAD_MEDIA] = "upload_media",
+    [ROUTE_GET_MEDIA] = "get_media",
+};
+
+static const char* const phase_names[PHASE_COUNT] = {
+    [PHASE_PARSE] = "parse",
+    [PHASE_QUEUE] = "queue",
+    [PHASE_AUTH] = "auth",
+    [PHASE_DB] = "db",
+    [PHASE_SERIALIZE] = "serialize",
+    [PHASE_SEND] = "send",
+    [PHASE_TOTAL] = "total",
+};
+
+// Status codes counted on their own; anything else is counted as "other"
+static const int statuses[] = { 101, 200, 201, 400, 401, 403, 404, 405, 413, 414, 426, 429, 431, 500, 501, 503 };
+#define STATUS_COUNT ((int)(sizeof(statuses) / sizeof(statuses[0])) + 1)
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+typedef struct metrics_block {
+    struct metrics_block* next;
+    uint64_t requests[ROUTE_COUNT][STATUS_COUNT];
+    histogram_t phases[ROUTE_COUNT][PHASE_COUNT];
+} metrics_block_t;
+
+// The request the current thread is handling
+typedef struct {
+    int active;
+    metrics_route_t route;
+    int status;
+    uint64_t started_ns;
+    uint64_t phase_ns[PHASE_COUNT];
+} request_timing_t;
+
+static metrics_block_t* blocks = NULL;
+static __thread metrics_block_t* local_block = NULL;
+static __thread request_timing_t timing;
+
+static void bump(uint64_t* counter, uint64_t amount) {
+    // Only the owning thread writes; readers need untorn values, no more
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + amount, __ATOMIC_RELAXED);
+}
+
+static int bucket_of(uint64_t ns) {
+    if (ns < SUB_BUCKETS) return (int)ns;
+    int exponent = 63 - __builtin_clzll(ns);
+    if (exponent > MAX_EXPONENT) return HISTOGRAM_BUCKETS - 1;
+    int sub = (int)(ns >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+    return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+// Highest value that lands in the bucket
+static uint64_t bucket_limit(int index) {
+    if (index < SUB_BUCKETS) return (uint64_t)index;
+    int exponent = index / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+    uint64_t width = 1ULL << (exponent - SUB_BUCKET_BITS);
+    return (uint64_t)(SUB_BUCKETS + index % SUB_BUCKETS) * width + width - 1;
+}
+
+static int status_index(int status) {
+    for (int i = 0; i < STATUS_COUNT - 1; i++) {
+        if (statuses[i] == status) return i;
+    }
+    return STATUS_COUNT - 1;
+}
+
+static metrics_block_t* thread_block(void) {
+    if (local_block) return local_block;
+
+    metrics_block_t* block = calloc(1, sizeof(metrics_block_t));
+    if (!block) return NULL;
+    block->next = __atomic_load_n(&blocks, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&blocks, &block->next, block, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    local_block = block;
+    return block;
+}
+
+void metrics_begin_request(uint64_t parse_ns, uint64_t dispatched_ns) {
+    memset(&timing, 0, sizeof(timing));
+    timing.active = 1;
+    timing.started_ns = monotonic_ns();
+    timing.phase_ns[PHASE_PARSE] = parse_ns;
+    if (dispatched_ns && dispatched_ns < timing.started_ns) {
+        timing.phase_ns[PHASE_QUEUE] = timing.started_ns - dispatched_ns;
+    }
+}
+
+void metrics_set_route(metrics_route_t route) {
+    timing.route = route;
+}
+
+void metrics_set_status(int status) {
+    timing.status = status;
+}
+
+void metrics_add_phase(metrics_phase_t phase, uint64_t ns) {
+    if (timing.active) timing.phase_ns[phase] += ns;
+}
+
+void metrics_end_request(void) {
+    if (!timing.active) return;
+    timing.active = 0;
+
+    // A parked long-poll has not answered yet; it is counted when it does
+    if (timing.status == 0) return;
+
+    metrics_block_t* block = thread_block();
+    if (!block) return;
+
+    uint64_t handled = monotonic_ns() - timing.started_ns;
+    uint64_t* phase_ns = timing.phase_ns;
+    uint64_t accounted = phase_ns[PHASE_AUTH] + phase_ns[PHASE_DB] + phase_ns[PHASE_SEND];
+    phase_ns[PHASE_SERIALIZE] = handled > accounted ? handled - accounted : 0;
+    phase_ns[PHASE_TOTAL] = phase_ns[PHASE_PARSE] + phase_ns[PHASE_QUEUE] + handled;
+
+    bump(&block->requests[timing.route][status_index(timing.status)], 1);
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+        histogram_t* h = &block->phases[timing.route][phase];
+        bump(&h->count, 1);
+        bump(&h->sum_ns, phase_ns[phase]);
+        bump(&h->buckets[bucket_of(phase_ns[phase])], 1);
+    }
+}
+
+// Growable text buffer for the exposition
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+    int failed;
+} text_t;
+
+static void appendf(text_t* t, const char* format, ...) {
+    if (t->failed) return;
+    for (;;) {
+        va_list args;
+        va_start(args, format);
+        int n = vsnprintf(t->data + t->len, t->cap - t->len, format, args);
+        va_end(args);
+        if (n < 0) {
+            t->failed = 1;
+            return;
+        }
+        if ((size_t)n < t->cap - t->len) {
+            t->len += n;
+            return;
+        }
+
+        size_t cap = t->cap * 2;
+        while (cap - t->len <= (size_t)n) cap *= 2;
+        char* data = realloc(t->data, cap);
+        if (!data) {
+            t->failed = 1;
+            return;
+        }
+        t->data = data;
+        t->cap = cap;
+    }
+}
+
+static uint64_t quantile(const histogram_t* h, double q) {
+    uint64_t rank = (uint64_t)(q * (double)h->count);
+    if (rank >= h->count) rank = h->count - 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > rank) return bucket_limit(i);
+    }
+    return bucket_limit(HISTOGRAM_BUCKETS - 1);
+}
+
+static void sum_blocks(metrics_block_t* total) {
+    for (metrics_block_t* block = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); block; block = block->next) {
+        for (int r = 0; r < ROUTE_COUNT; r++) {
+            for (int s = 0; s < STATUS_COUNT; s++) {
+                total->requests[r][s] += __atomic_load_n(&block->requests[r][s], __ATOMIC_RELAXED);
+            }
+            for (int p = 0; p < PHASE_COUNT; p++) {
+                histogram_t* into = &total->phases[r][p];
+                histogram_t* from = &block->phases[r][p];
+                into->sum_ns += __atomic_load_n(&from->sum_ns, __ATOMIC_RELAXED);
+                // Count from the buckets, so quantiles always add up
+                for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+                    uint64_t n = __atomic_load_n(&from->buckets[i], __ATOMIC_RELAXED);
+                    into->buckets[i] += n;
+                    into->count += n;
+                }
+            }
+        }
+    }
+}
+
+static void write_requests(text_t* t, const metrics_block_t* total) {
+    appendf(t, "# HELP hubbergram_requests_total Requests answered, by route and status.\n"
+               "# TYPE hubbergram_requests_total counter\n");
+    for (int r = 0; r < ROUTE_COUNT; r++) {
+        for (int s = 0; s < STATUS_COUNT; s++) {
+            if (!total->requests[r][s]) continue;
+            if (s < STATUS_COUNT - 1) {
+                appendf(t, "hubbergram_requests_total{route=\"%s\",status=\"%d\"} %llu\n",
+                        route_names[r], statuses[s], (unsigned long long)total->requests[r][s]);
+            } else {
+                appendf(t, "hubbergram_requests_total{route=\"%s\",status=\"other\"} %llu\n",
+                        route_names[r], (unsigned long long)total->requests[r][s]);
+            }
+        }
+    }
+
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    appendf(t, "# HELP hubbergram_request_phase_seconds Time spent in each phase of a request.\n"
+               "# TYPE hubbergram_request_phase_seconds summary\n");
+    for (int r = 0; r < ROUTE_COUNT; r++) {
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            const histogram_t* h = &total->phases[r][p];
+            if (!h->count) continue;
+            for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+                appendf(t, "hubbergram_request_phase_seconds{route=\"%s\",phase=\"%s\",quantile=\"%g\"} %.9f\n",
+                        route_names[r], phase_names[p], quantiles[q], quantile(h, quantiles[q]) / 1e9);
+            }
+            appendf(t, "hubbergram_request_phase_seconds_sum{route=\"%s\",phase=\"%s\"} %.9f\n",
+                    route_names[r], phase_names[p], h->sum_ns / 1e9);
+            appendf(t, "hubbergram_request_phase_seconds_count{route=\"%s\",phase=\"%s\"} %llu\n",
+                    route_names[r], phase_names[p], (unsigned long long)h->count);
+        }
+    }
+}
+
+static void write_counter(text_t* t, const char* name, const char* help, uint64_t value) {
+    appendf(t, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name, (unsigned long long)value);
+}
+
+static void write_gauge(text_t* t, const char* name, const char* help, double value) {
+    appendf(t, "# HELP %s %s\n# TYPE %s gauge\n%s %.17g\n", name, help, name, name, value);
+}
+
+static void write_subsystems(text_t* t) {
+    worker_pool_stats_t pool;
+    event_loop_get_pool_stats(&pool);
+    write_gauge(t, "hubbergram_worker_threads", "Request worker threads.", pool.threads);
+    write_gauge(t, "hubbergram_worker_queue_depth", "Requests waiting for a worker.", (double)pool.depth);
+    write_gauge(t, "hubbergram_worker_queue_depth_max", "Deepest the worker queue has been.", (double)pool.depth_max);
+    write_counter(t, "hubbergram_worker_rejected_total", "Requests turned away with a full queue.", pool.rejected);
+
+    user_cache_stats_t cache;
+    user_cache_get_stats(&cache);
+    write_counter(t, "hubbergram_user_cache_hits_total", "User lookups answered from the cache.", cache.hits);
+    write_counter(t, "hubbergram_user_cache_misses_total", "User lookups that went to the database.", cache.misses);
+    write_counter(t, "hubbergram_user_cache_evictions_total", "Cached users evicted for space.", cache.evictions);
+    write_gauge(t, "hubbergram_user_cache_entries", "Users in the cache.", cache.entries);
+
+    message_batch_stats_t batches;
+    get_message_batch_stats(&batches);
+    write_counter(t, "hubbergram_message_batches_total", "Message group commits.", batches.batches);
+    write_counter(t, "hubbergram_message_batch_messages_total", "Messages written by group commits.", batches.messages);
+    appendf(t, "# HELP hubbergram_message_batch_commit_seconds_total Time spent committing message batches.\n"
+               "# TYPE hubbergram_message_batch_commit_seconds_total counter\n"
+               "hubbergram_message_batch_commit_seconds_total %.9f\n", batches.commit_ns_total / 1e9);
+
+    rate_limit_stats_t limits;
+    rate_limit_get_stats(&limits);
+    appendf(t, "# HELP hubbergram_rate_limited_total Requests refused with 429, by bucket.\n"
+               "# TYPE hubbergram_rate_limited_total counter\n"
+               "hubbergram_rate_limited_total{bucket=\"requests\"} %llu\n"
+               "hubbergram_rate_limited_total{bucket=\"messages\"} %llu\n",
+               (unsigned long long)limits.throttled_requests, (unsigned long long)limits.throttled_messages);
+
+    db_statement_stats_t statements[64];
+    int count = get_statement_stats(statements, 64);
+    appendf(t, "# HELP hubbergram_statement_executions_total Prepared statement checkouts, by statement.\n"
+               "# TYPE hubbergram_statement_executions_total counter\n");
+    for (int i = 0; i < count; i++) {
+        appendf(t, "hubbergram_statement_executions_total{statement=\"%s\"} %llu\n",
+                statements[i].name, (unsigned long long)statements[i].hits);
+    }
+}
+
+void api_get_metrics(client_t* client) {
+    if (!client->authenticated || client->user.role != USER_ADMIN) {
+        send_response(client, 403, "application/json", "{\"error\":\"Admin access required\"}");
+        return;
+    }
+
+    metrics_block_t* total = calloc(1, sizeof(metrics_block_t));
+    text_t t = { malloc(16384), 0, 16384, 0 };
+    if (!total || !t.data) {
+        free(total);
+        free(t.data);
+        send_response(client, 500, "application/json", "{\"error\":\"Out of memory\"}");
+        return;
+    }
+
+    sum_blocks(total);
+    write_requests(&t, total);
+    write_subsystems(&t);
+    free(total);
+
+    if (t.failed) {
+        free(t.data);
+        send_response(client, 500, "application/json", "{\"error\":\"Out of memory\"}");
+        return;
+    }
+    send_response_body(client, 200, "text/plain; version=0.0.4", t.data, t.len, free, t.data);
+}
@@ -0,0 +1,158 @@
+#include "server.h"
+
+// Token buckets in front of the request handlers. Each client has one
+// bucket for requests and one for sent messages, holding up to a minute's
+// allowance and refilling continuously at the configured rate; a request
+// that finds its bucket empty is turned away with 429. Clients are the
+// user of a valid token, or the remote address when there is none.
+//
+// Buckets live in fixed-size tables split into shards with their own lock,
+// addressed by hashing the client key with a short linear probe. When the
+// probe finds no free slot, the bucket that has been idle longest is
+// reused: after a minute idle a bucket is full again, so forgetting it
+// loses nothing.
+
+#define RATE_PROBE_LENGTH 8
+
+// Key spaces, in the top bits of a bucket key
+#define RATE_KEY_ADDRESS (1ULL << 62)
+#define RATE_KEY_USER (2ULL << 62)
+
+typedef struct {
+    uint64_t key;      // 0 marks a free slot
+    uint64_t last_ns;  // last refill
+    double tokens;
+} rate_bucket_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    rate_bucket_t* buckets;
+    int mask;
+} rate_shard_t;
+
+typedef struct {
+    rate_shard_t* shards;
+    int shard_mask;
+    double per_minute;
+} rate_table_t;
+
+static rate_table_t requests;
+static rate_table_t messages;
+
+static uint64_t allowed = 0;
+static uint64_t throttled_requests = 0;
+static uint64_t throttled_messages = 0;
+
+static int round_up_pow2(int n) {
+    int p = 1;
+    while (p < n) p <<= 1;
+    return p;
+}
+
+static int table_init(rate_table_t* table, int capacity, int shards, int per_minute) {
+    shards = round_up_pow2(shards > 0 ? shards : 1);
+    int per_shard = round_up_pow2((capacity + shards - 1) / shards);
+    if (per_shard < RATE_PROBE_LENGTH) per_shard = RATE_PROBE_LENGTH;
+
+    table->shards = calloc(shards, sizeof(rate_shard_t));
+    if (!table->shards) return -1;
+    table->shard_mask = shards - 1;
+    table->per_minute = per_minute;
+
+    for (int i = 0; i < shards; i++) {
+        rate_shard_t* shard = &table->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->buckets = calloc(per_shard, sizeof(rate_bucket_t));
+        if (!shard->buckets) return -1;
+        shard->mask = per_shard - 1;
+    }
+    return 0;
+}
+
+static uint64_t hash_key(uint64_t key) {
+    // splitmix64 finalizer
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return key;
+}
+
+// Takes a token from the client's bucket; returns 0 if there is none
+static int take_token(rate_table_t* table, uint64_t key) {
+    uint64_t hash = hash_key(key);
+    rate_shard_t* shard = &table->shards[hash & table->shard_mask];
+    uint64_t slot_hash = hash >> 32;
+
+    pthread_mutex_lock(&shard->lock);
+    // Read under the lock, so last_ns never moves backwards: a time read
+    // earlier by another thread would make now - last_ns wrap around and
+    // refill the bucket completely
+    uint64_t now = monotonic_ns();
+
+    // The client's bucket, or else a free slot, or else the stalest one
+    rate_bucket_t* bucket = NULL;
+    rate_bucket_t* stalest = NULL;
+    for (int i = 0; i < RATE_PROBE_LENGTH; i++) {
+        rate_bucket_t* candidate = &shard->buckets[(slot_hash + i) & shard->mask];
+        if (candidate->key == key) {
+            bucket = candidate;
+            break;
+        }
+        if (candidate->key == 0) {
+            if (!stalest || stalest->key != 0) stalest = candidate;
+        } else if (!stalest || (stalest->key != 0 && candidate->last_ns < stalest->last_ns)) {
+            stalest = candidate;
+        }
+    }
+
+    if (bucket) {
+        double refill = (double)(now - bucket->last_ns) * table->per_minute / 60e9;
+        bucket->tokens += refill;
+        if (bucket->tokens > table->per_minute) bucket->tokens = table->per_minute;
+    } else {
+        bucket = stalest;
+        bucket->key = key;
+        bucket->tokens = table->per_minute;
+    }
+    bucket->last_ns = now;
+
+    int ok = bucket->tokens >= 1.0;
+    if (ok) bucket->tokens -= 1.0;
+
+    pthread_mutex_unlock(&shard->lock);
+    return ok;
+}
+
+int rate_limit_init(int capacity, int shards) {
+    if (capacity <= 0) return 0; // Disabled; everything is allowed
+    if (table_init(&requests, capacity, shards, RATE_LIMIT_REQUESTS_PER_MINUTE) < 0) return -1;
+    if (table_init(&messages, capacity, shards, RATE_LIMIT_MESSAGES_PER_MINUTE) < 0) return -1;
+    return 0;
+}
+
+int rate_limit_allow(client_t* client, int sends_message) {
+    if (!requests.shards) return 1;
+
+    uint64_t key = client->authenticated
+        ? RATE_KEY_USER | (uint32_t)client->user.id
+        : RATE_KEY_ADDRESS | client->address.sin_addr.s_addr;
+
+    if (!take_token(&requests, key)) {
+        __atomic_add_fetch(&throttled_requests, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    if (sends_message && !take_token(&messages, key)) {
+        __atomic_add_fetch(&throttled_messages, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    __atomic_add_fetch(&allowed, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+void rate_limit_get_stats(rate_limit_stats_t* stats) {
+    stats->allowed = __atomic_load_n(&allowed, __ATOMIC_RELAXED);
+    stats->throttled_requests = __atomic_load_n(&throttled_requests, __ATOMIC_RELAXED);
+    stats->throttled_messages = __atomic_load_n(&throttled_messages, __ATOMIC_RELAXED);
+}
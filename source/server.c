@@ -1,158 +1,387 @@
 #include "server.h"
+#include <ctype.h>
+#include <math.h>
+#include <limits.h>
+#include <signal.h>
 
-static client_t clients[MAX_CLIENTS];
-static int client_count = 0;
-static pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-void send_response(int socket, int status, const char* content_type, const char* body) {
-    char response[BUFFER_SIZE];
-    const char* status_text = (status == 200) ? "OK" : 
-                             (status == 201) ? "Created" :
-                             (status == 400) ? "Bad Request" :
-                             (status == 401) ? "Unauthorized" :
-                             (status == 403) ? "Forbidden" :
-                             (status == 404) ? "Not Found" : "Internal Server Error";
+static const char* status_text(int status) {
+    switch (status) {
+    case 200: return "OK";
+    case 201: return "Created";
+    case 206: return "Partial Content";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 413: return "Payload Too Large";
+    case 426: return "Upgrade Required";
+    case 429: return "Too Many Requests";
+    case 414: return "URI Too Long";
+    case 416: return "Range Not Satisfiable";
+    case 431: return "Request Header Fields Too Large";
+    case 501: return "Not Implemented";
+    case 503: return "Service Unavailable";
+    default: return "Internal Server Error";
+    }
+}
 
-    snprintf(response, sizeof(response),
+// Formats the status line and headers of a response; extra_headers are
+// complete header lines
+static int format_head(connection_t* conn, char* head, size_t size, int status,
+                       const char* content_type, size_t body_len, const char* extra_headers) {
+    const char* connection_header = !conn->keep_alive ? "Connection: close\r\n" :
+                                    conn->version_minor == 0 ? "Connection: keep-alive\r\n" : "";
+    int head_len = snprintf(head, size,
         "HTTP/1.1 %d %s\r\n"
         "Content-Type: %s\r\n"
         "Content-Length: %zu\r\n"
+        "%s%s"
         "Access-Control-Allow-Origin: *\r\n"
         "Access-Control-Allow-Methods: GET, POST, PUT, DELETE, OPTIONS\r\n"
         "Access-Control-Allow-Headers: Content-Type, Authorization\r\n"
-        "\r\n%s",
-        status, status_text, content_type, strlen(body), body);
+        "\r\n",
+        status, status_text(status), content_type, body_len, connection_header, extra_headers);
+    return head_len < (int)size ? head_len : (int)size - 1;
+}
+
+void send_response_body(client_t* client, int status, const char* content_type,
+                        const char* body, size_t body_len, void (*release)(void*), void* owner) {
+    char head[512];
+    uint64_t send_start = monotonic_ns();
+    int head_len = format_head((connection_t*)client, head, sizeof(head), status, content_type, body_len, "");
 
-    send(socket, response, strlen(response), 0);
+    connection_send(client, head, head_len, body, body_len, release, owner);
+    metrics_set_status(status);
+    metrics_add_phase(PHASE_SEND, monotonic_ns() - send_start);
 }
 
-void send_json_response(int socket, int status, json_object* json) {
-    const char* json_string = json_object_to_json_string(json);
-    send_response(socket, status, "application/json", json_string);
+// Sends length bytes of an open file from offset without copying them
+// through the process. Takes ownership of fd.
+void send_file_response(client_t* client, int status, const char* content_type,
+                        int fd, off_t offset, size_t length, const char* extra_headers) {
+    char head[1024];
+    uint64_t send_start = monotonic_ns();
+    int head_len = format_head((connection_t*)client, head, sizeof(head), status, content_type,
+                               length, extra_headers);
+
+    connection_send_file(client, head, head_len, fd, offset, length);
+    metrics_set_status(status);
+    metrics_add_phase(PHASE_SEND, monotonic_ns() - send_start);
 }
 
-int is_admin(client_t* client) {
-    return client->authenticated && client->user.role == USER_ADMIN;
+void send_response(client_t* client, int status, const char* content_type, const char* body) {
+    send_response_body(client, status, content_type, body, strlen(body), NULL, NULL);
 }
 
-void handle_http_request(client_t* client, const char* request) {
-    char method[16], path[256], version[16];
-    sscanf(request, "%s %s %s", method, path, version);
-    
-    // Extract Authorization header
-    char* auth_header = strstr(request, "Authorization: Bearer ");
-    if (auth_header) {
-        auth_header += 22; // Skip "Authorization: Bearer "
-        char* end = strstr(auth_header, "\r\n");
-        if (end) {
-            int token_len = end - auth_header;
-            if (token_len < sizeof(client->token)) {
-                strncpy(client->token, auth_header, token_len);
-                client->token[token_len] = '\0';
-                int user_id;
-                if (verify_token(client->token, &user_id) == 1) {
-                    user_t* user = get_user_by_id(user_id);
-                    if (user) {
-                        client->authenticated = 1;
-                        client->user = *user;
-                        free(user);
-                    }
-                }
-            }
-        }
-    }
+static void release_json(void* json) {
+    json_object_put(json);
+}
 
-    // Handle CORS preflight
-    if (strcmp(method, "OPTIONS") == 0) {
-        send_response(client->socket, 200, "text/plain", "");
+void send_json_response(client_t* client, int status, json_object* json) {
+    // The serialized string lives inside the object; hold a reference so a
+    // slow client can be written to later without copying it
+    size_t length;
+    const char* json_string = json_object_to_json_string_length(json, JSON_C_TO_STRING_SPACED, &length);
+    send_response_body(client, status, "application/json", json_string, length,
+                       release_json, json_object_get(json));
+}
+
+// Hands the writer's buffer to the connection, which frees it once sent
+void send_json_writer(client_t* client, int status, json_writer_t* w) {
+    if (json_writer_finish(w) < 0) {
+        send_response(client, 500, "application/json", "{\"error\":\"Out of memory\"}");
         return;
     }
+    send_response_body(client, status, "application/json", w->data, w->len, free, w->data);
+    w->data = NULL;
+}
 
-    // API-only server - no static files
-    if (strcmp(method, "GET") == 0 && strcmp(path, "/") == 0) {
-        send_response(client->socket, 200, "application/json", "{\"message\":\"Telegram Clone API Server\",\"version\":\"1.0\"}");
-        return;
+// Fills fields from a request body. Flat objects are read in place; any
+// other shape goes through json-c, in which case the returned object owns
+// the field strings and must be released once they are no longer needed.
+json_object* read_json_fields(http_request_t* request, json_field_t* fields, int count) {
+    if (request->body_len == 0) {
+        for (int i = 0; i < count; i++) fields[i].present = 0;
+        return NULL;
+    }
+    if (json_read_fields(request->body, request->body_len, fields, count) == 0) {
+        return NULL;
     }
 
-    // API endpoints
-    if (strcmp(method, "POST") == 0) {
-        // Extract JSON body
-        char* body = strstr(request, "\r\n\r\n");
-        json_object* json = NULL;
-        
-        if (body) {
-            body += 4; // Skip \r\n\r\n
-            if (strlen(body) > 0) {
-                json = json_tokener_parse(body);
-            }
-        }
-        
-        if (!json) {
-            json = json_object_new_object();
+    // Body is NUL-terminated by the event loop
+    json_object* json = json_tokener_parse(request->body);
+    for (int i = 0; i < count; i++) {
+        json_field_t* field = &fields[i];
+        json_object* value;
+
+        field->present = json && json_object_object_get_ex(json, field->name, &value) && value;
+        if (!field->present) continue;
+
+        switch (field->type) {
+        case JSON_FIELD_STRING:
+            field->string = json_object_get_string(value);
+            field->present = field->string != NULL;
+            break;
+        case JSON_FIELD_NUMBER:
+            field->number = json_object_get_double(value);
+            break;
+        case JSON_FIELD_BOOL:
+            field->boolean = json_object_get_boolean(value);
+            break;
         }
+    }
+    return json;
+}
 
-        if (strcmp(path, "/api/register") == 0) {
-            api_register(client, json);
-        } else if (strcmp(path, "/api/login") == 0) {
-            api_login(client, json);
-        } else if (strcmp(path, "/api/message") == 0) {
-            api_send_message(client, json);
-        } else if (strcmp(path, "/api/location") == 0) {
-            api_update_location(client, json);
-        } else {
-            send_response(client->socket, 404, "application/json", "{\"error\":\"Endpoint not found\"}");
+// Copies the URL-decoded value of name from a query string. Returns 1 if
+// the parameter is present.
+int query_param(const char* query, const char* name, char* value, size_t size) {
+    size_t name_len = strlen(name);
+    const char* p = query;
+
+    while (p && *p) {
+        const char* end = strchr(p, '&');
+        if (!end) end = p + strlen(p);
+
+        if ((size_t)(end - p) >= name_len && strncmp(p, name, name_len) == 0 &&
+            (p + name_len == end || p[name_len] == '=')) {
+            const char* src = p + name_len + (p + name_len < end ? 1 : 0);
+            size_t len = 0;
+            while (src < end && len + 1 < size) {
+                if (*src == '%' && end - src >= 3 && isxdigit((unsigned char)src[1]) && isxdigit((unsigned char)src[2])) {
+                    char hex[3] = { src[1], src[2], '\0' };
+                    value[len++] = (char)strtol(hex, NULL, 16);
+                    src += 3;
+                } else {
+                    value[len++] = (*src == '+') ? ' ' : *src;
+                    src++;
+                }
+            }
+            value[len] = '\0';
+            return 1;
         }
+        p = *end ? end + 1 : NULL;
+    }
+    return 0;
+}
 
-        json_object_put(json);
-    } else if (strcmp(method, "GET") == 0) {
-        if (strcmp(path, "/api/locations") == 0) {
-            api_get_locations(client);
-        } else if (strcmp(path, "/api/users") == 0) {
-            api_get_users(client);
-        } else if (strcmp(path, "/api/messages") == 0) {
-            api_get_messages(client);
-        } else {
-            send_response(client->socket, 404, "application/json", "{\"error\":\"Endpoint not found\"}");
+long query_param_long(const char* query, const char* name, long default_value) {
+    char value[32];
+    if (!query_param(query, name, value, sizeof(value))) return default_value;
+
+    char* end;
+    long result = strtol(value, &end, 10);
+    return (end == value || *end) ? default_value : result;
+}
+
+// Returns 1 and sets value if the parameter is present and a finite number
+int query_param_double(const char* query, const char* name, double* value) {
+    char text[64];
+    if (!query_param(query, name, text, sizeof(text))) return 0;
+
+    char* end;
+    double result = strtod(text, &end);
+    if (end == text || *end || !isfinite(result)) return 0;
+    *value = result;
+    return 1;
+}
+
+// The number in a path segment matched by {id}, or -1 if there is none
+int path_id(const char* path) {
+    for (const char* p = path; (p = strchr(p, '/')) != NULL; p++) {
+        if (!isdigit((unsigned char)p[1])) continue;
+        char* end;
+        long id = strtol(p + 1, &end, 10);
+        if ((*end == '/' || *end == '\0') && id > 0 && id <= INT_MAX) return (int)id;
+    }
+    return -1;
+}
+
+int is_admin(client_t* client) {
+    return client->authenticated && client->user.role == USER_ADMIN;
+}
+
+static const struct {
+    const char* method;
+    const char* path;
+    metrics_route_t route;
+} routes[] = {
+    { "POST", "/api/register", ROUTE_REGISTER },
+    { "POST", "/api/login", ROUTE_LOGIN },
+    { "POST", "/api/message", ROUTE_SEND_MESSAGE },
+    { "POST", "/api/location", ROUTE_UPDATE_LOCATION },
+    { "GET", "/", ROUTE_ROOT },
+    { "GET", "/api/locations", ROUTE_GET_LOCATIONS },
+    { "GET", "/api/users", ROUTE_GET_USERS },
+    { "GET", "/api/messages", ROUTE_GET_MESSAGES },
+    { "GET", "/api/messages/wait", ROUTE_WAIT_MESSAGES },
+    { "GET", "/api/messages/search", ROUTE_SEARCH_MESSAGES },
+    { "GET", "/api/metrics", ROUTE_METRICS },
+#if ENABLE_FILE_UPLOAD
+    { "POST", "/api/media", ROUTE_UPLOAD_MEDIA },
+    { "GET", "/api/media/{hash}", ROUTE_GET_MEDIA },
+#endif
+#if ENABLE_GROUP_CHAT
+    { "POST", "/api/groups", ROUTE_CREATE_GROUP },
+    { "GET", "/api/groups", ROUTE_GET_GROUPS },
+    { "POST", "/api/groups/{id}/members", ROUTE_ADD_GROUP_MEMBER },
+    { "POST", "/api/groups/{id}/message", ROUTE_SEND_GROUP_MESSAGE },
+    { "GET", "/api/groups/{id}/messages", ROUTE_GET_GROUP_MESSAGES },
+    { "POST", "/api/groups/{id}/read", ROUTE_MARK_GROUP_READ },
+#endif
+#if ENABLE_WEBSOCKET
+    { "GET", "/ws", ROUTE_WEBSOCKET },
+#endif
+};
+
+// Compares a path with a route pattern, where {id} stands for one segment
+// of digits and {hash} for a hex SHA-256
+static int path_matches(const char* pattern, const char* path) {
+    while (*pattern) {
+        if (strncmp(pattern, "{id}", 4) == 0) {
+            if (!isdigit((unsigned char)*path)) return 0;
+            while (isdigit((unsigned char)*path)) path++;
+            pattern += 4;
+        } else if (strncmp(pattern, "{hash}", 6) == 0) {
+            for (int i = 0; i < SHA256_DIGEST_LENGTH * 2; i++, path++) {
+                if (!isdigit((unsigned char)*path) && (*path < 'a' || *path > 'f')) return 0;
+            }
+            pattern += 6;
+        } else if (*pattern++ != *path++) {
+            return 0;
         }
-    } else {
-        send_response(client->socket, 405, "text/plain", "Method not allowed");
     }
+    return *path == '\0';
 }
 
-void* handle_client(void* arg) {
-    client_t* client = (client_t*)arg;
-    char buffer[BUFFER_SIZE];
-    
-    while (1) {
-        int bytes = recv(client->socket, buffer, sizeof(buffer) - 1, 0);
-        if (bytes <= 0) break;
-        
-        buffer[bytes] = '\0';
-        
-        // Check if it's HTTP request
-        if (strncmp(buffer, "GET", 3) == 0 || strncmp(buffer, "POST", 4) == 0 || 
-            strncmp(buffer, "OPTIONS", 7) == 0) {
-            handle_http_request(client, buffer);
+static metrics_route_t find_route(const char* method, const char* path) {
+    if (strcmp(method, "OPTIONS") == 0) return ROUTE_OPTIONS;
+    for (size_t i = 0; i < sizeof(routes) / sizeof(routes[0]); i++) {
+        if (strcmp(routes[i].method, method) == 0 && path_matches(routes[i].path, path)) {
+            return routes[i].route;
         }
-        // WebSocket handling would go here for real-time messaging
     }
+    return ROUTE_OTHER;
+}
 
-    close(client->socket);
-    
-    // Remove client from list
-    pthread_mutex_lock(&clients_mutex);
-    for (int i = 0; i < client_count; i++) {
-        if (clients[i].socket == client->socket) {
-            for (int j = i; j < client_count - 1; j++) {
-                clients[j] = clients[j + 1];
+void handle_http_request(client_t* client, http_request_t* request) {
+    const char* method = request->method;
+    metrics_route_t route = find_route(method, request->path);
+    metrics_set_route(route);
+
+    // Extract Authorization header
+    uint64_t auth_start = monotonic_ns();
+    const char* auth_header = http_request_header(request, "Authorization");
+    if (auth_header && strncmp(auth_header, "Bearer ", 7) == 0) {
+        const char* token = auth_header + 7;
+        if (strlen(token) < sizeof(client->token)) {
+            strcpy(client->token, token);
+            int user_id;
+            user_role_t role;
+            if (verify_token(client->token, &user_id, &role) == 1) {
+                // Handlers only need the id and role, both signed into the token
+                client->authenticated = 1;
+                client->user.id = user_id;
+                client->user.role = role;
             }
-            client_count--;
-            break;
         }
     }
-    pthread_mutex_unlock(&clients_mutex);
-    
-    return NULL;
+    metrics_add_phase(PHASE_AUTH, monotonic_ns() - auth_start);
+
+    // Throttled before any database or JSON work
+    if (!rate_limit_allow(client, route == ROUTE_SEND_MESSAGE || route == ROUTE_SEND_GROUP_MESSAGE)) {
+        send_response(client, 429, "application/json", "{\"error\":\"Too many requests\"}");
+        return;
+    }
+
+    // Only uploads take bodies too large to buffer
+    if (request->body_remaining && route != ROUTE_UPLOAD_MEDIA) {
+        send_response(client, 413, "application/json", "{\"error\":\"Request body too large\"}");
+        return;
+    }
+
+    switch (route) {
+    case ROUTE_OPTIONS:
+        // CORS preflight
+        send_response(client, 200, "text/plain", "");
+        break;
+    case ROUTE_ROOT:
+        // API-only server - no static files
+        send_response(client, 200, "application/json", "{\"message\":\"Telegram Clone API Server\",\"version\":\"1.0\"}");
+        break;
+    // POST handlers read their own fields from the body
+    case ROUTE_REGISTER:
+        api_register(client, request);
+        break;
+    case ROUTE_LOGIN:
+        api_login(client, request);
+        break;
+    case ROUTE_SEND_MESSAGE:
+        api_send_message(client, request);
+        break;
+    case ROUTE_UPDATE_LOCATION:
+        api_update_location(client, request);
+        break;
+    case ROUTE_GET_LOCATIONS:
+        api_get_locations(client, request->query);
+        break;
+    case ROUTE_GET_USERS:
+        api_get_users(client);
+        break;
+    case ROUTE_GET_MESSAGES:
+        api_get_messages(client, request->query);
+        break;
+    case ROUTE_WAIT_MESSAGES:
+        api_wait_messages(client, request->query);
+        break;
+    case ROUTE_SEARCH_MESSAGES:
+        api_search_messages(client, request->query);
+        break;
+    case ROUTE_METRICS:
+        api_get_metrics(client);
+        break;
+#if ENABLE_FILE_UPLOAD
+    case ROUTE_UPLOAD_MEDIA:
+        api_upload_media(client, request);
+        break;
+    case ROUTE_GET_MEDIA:
+        api_get_media(client, request);
+        break;
+#endif
+#if ENABLE_GROUP_CHAT
+    case ROUTE_CREATE_GROUP:
+        api_create_group(client, request);
+        break;
+    case ROUTE_GET_GROUPS:
+        api_get_groups(client);
+        break;
+    case ROUTE_ADD_GROUP_MEMBER:
+        api_add_group_member(client, request);
+        break;
+    case ROUTE_SEND_GROUP_MESSAGE:
+        api_send_group_message(client, request);
+        break;
+    case ROUTE_GET_GROUP_MESSAGES:
+        api_get_group_messages(client, request);
+        break;
+    case ROUTE_MARK_GROUP_READ:
+        api_mark_group_read(client, request);
+        break;
+#endif
+#if ENABLE_WEBSOCKET
+    case ROUTE_WEBSOCKET:
+        handle_websocket(client, request);
+        break;
+#endif
+    default:
+        if (strcmp(method, "GET") == 0 || strcmp(method, "POST") == 0) {
+            send_response(client, 404, "application/json", "{\"error\":\"Endpoint not found\"}");
+        } else {
+            send_response(client, 405, "text/plain", "Method not allowed");
+        }
+        break;
+    }
 }
 
 void start_server(void) {
@@ -175,7 +404,7 @@ void start_server(void) {
         exit(1);
     }
 
-    if (listen(server_socket, 10) < 0) {
+    if (listen(server_socket, LISTEN_BACKLOG) < 0) {
         perror("Listen failed");
         exit(1);
     }
@@ -183,30 +412,7 @@ void start_server(void) {
     printf("Telegram Clone Server running on port %d\n", PORT);
     printf("Access the web interface at http://localhost:%d\n", PORT);
 
-    while (1) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        int client_socket = accept(server_socket, (struct sockaddr*)&client_addr, &client_len);
-        
-        if (client_socket < 0) continue;
-
-        pthread_mutex_lock(&clients_mutex);
-        if (client_count < MAX_CLIENTS) {
-            clients[client_count].socket = client_socket;
-            clients[client_count].address = client_addr;
-            clients[client_count].authenticated = 0;
-            memset(&clients[client_count].user, 0, sizeof(user_t));
-            
-            pthread_t thread;
-            pthread_create(&thread, NULL, handle_client, &clients[client_count]);
-            pthread_detach(thread);
-            
-            client_count++;
-        } else {
-            close(client_socket);
-        }
-        pthread_mutex_unlock(&clients_mutex);
-    }
+    event_loop_run(server_socket);
 
     close(server_socket);
 }
@@ -217,6 +423,21 @@ int main(void) {
         return 1;
     }
 
+    if (rate_limit_init(RATE_LIMIT_CLIENTS, RATE_LIMIT_SHARDS) < 0) {
+        fprintf(stderr, "Rate limiter initialization failed\n");
+        return 1;
+    }
+
+#if ENABLE_FILE_UPLOAD
+    if (media_init() < 0) {
+        fprintf(stderr, "Media storage initialization failed\n");
+        return 1;
+    }
+#endif
+
+    // A client that goes away mid-response shows up as EPIPE on the write
+    signal(SIGPIPE, SIG_IGN);
+
     // Create default admin user
     create_user("admin", "admin@telegram.local", "admin123", USER_ADMIN);
     
@@ -0,0 +1,271 @@
+#include "server.h"
+
+// Bounded cache of user rows in front of SQLite. Records live in a table
+// keyed by id; a second table, keyed by username, holds whole copies too
+// but only their id is read from it, so records always come from the id
+// table and invalidating that is enough. Each table is split into shards
+// with their own lock, and a full shard evicts with the CLOCK algorithm:
+// hits set a reference bit, and the hand clears bits until it finds an
+// entry that has not been used since its last pass.
+typedef struct {
+    uint64_t hash;
+    int next;       // next entry in the same bucket, -1 ends the chain
+    int referenced;
+    user_t user;
+} cache_entry_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    int* buckets;
+    int bucket_mask;
+    cache_entry_t* entries;
+    int capacity;
+    int count;
+    int hand;
+} cache_shard_t;
+
+typedef struct {
+    cache_shard_t* shards;
+    int shard_mask;
+    int by_username;
+} cache_table_t;
+
+static cache_table_t users_by_id;
+static cache_table_t ids_by_username;
+
+// Bumped on every invalidation; see user_cache_put()
+static uint64_t generation = 0;
+
+static uint64_t hits = 0;
+static uint64_t misses = 0;
+static uint64_t inserts = 0;
+static uint64_t evictions = 0;
+static uint64_t invalidations = 0;
+
+static uint64_t hash_id(int id) {
+    uint64_t h = (uint64_t)(uint32_t)id * 0x9E3779B97F4A7C15ULL;
+    return h ^ (h >> 29);
+}
+
+static uint64_t hash_username(const char* username) {
+    uint64_t h = 0xCBF29CE484222325ULL; // FNV-1a
+    while (*username) {
+        h ^= (unsigned char)*username++;
+        h *= 0x100000001B3ULL;
+    }
+    return h ^ (h >> 29);
+}
+
+static int round_up_pow2(int n) {
+    int p = 1;
+    while (p < n) p <<= 1;
+    return p;
+}
+
+static int table_init(cache_table_t* table, int capacity, int shards, int by_username) {
+    shards = round_up_pow2(shards > 0 ? shards : 1);
+    int per_shard = (capacity + shards - 1) / shards;
+    int buckets = round_up_pow2(per_shard * 2);
+
+    table->shards = calloc(shards, sizeof(cache_shard_t));
+    if (!table->shards) return -1;
+    table->shard_mask = shards - 1;
+    table->by_username = by_username;
+
+    for (int i = 0; i < shards; i++) {
+        cache_shard_t* shard = &table->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->buckets = malloc(buckets * sizeof(int));
+        shard->entries = calloc(per_shard, sizeof(cache_entry_t));
+        if (!shard->buckets || !shard->entries) return -1;
+        memset(shard->buckets, 0xff, buckets * sizeof(int));
+        shard->bucket_mask = buckets - 1;
+        shard->capacity = per_shard;
+    }
+    return 0;
+}
+
+static cache_shard_t* table_shard(cache_table_t* table, uint64_t hash) {
+    return &table->shards[(hash >> 32) & table->shard_mask];
+}
+
+static int entry_matches(cache_table_t* table, cache_entry_t* entry, uint64_t hash, const user_t* key) {
+    if (entry->hash != hash) return 0;
+    return table->by_username ? strcmp(entry->user.username, key->username) == 0
+                              : entry->user.id == key->id;
+}
+
+// Returns the index of the matching entry, or -1. Caller holds the lock.
+static int shard_find(cache_table_t* table, cache_shard_t* shard, uint64_t hash, const user_t* key) {
+    int i = shard->buckets[hash & shard->bucket_mask];
+    while (i >= 0 && !entry_matches(table, &shard->entries[i], hash, key)) {
+        i = shard->entries[i].next;
+    }
+    return i;
+}
+
+static void shard_unlink(cache_shard_t* shard, int index) {
+    int* link = &shard->buckets[shard->entries[index].hash & shard->bucket_mask];
+    while (*link != index) {
+        link = &shard->entries[*link].next;
+    }
+    *link = shard->entries[index].next;
+}
+
+static int table_get(cache_table_t* table, const user_t* key, user_t* user) {
+    uint64_t hash = table->by_username ? hash_username(key->username) : hash_id(key->id);
+    cache_shard_t* shard = table_shard(table, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    int i = shard_find(table, shard, hash, key);
+    if (i >= 0) {
+        shard->entries[i].referenced = 1;
+        *user = shard->entries[i].user;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return i >= 0;
+}
+
+// Inserts or replaces; returns -1 instead if generation moved past the one
+// the caller read before loading the row.
+static int table_put(cache_table_t* table, const user_t* user, uint64_t expected) {
+    uint64_t hash = table->by_username ? hash_username(user->username) : hash_id(user->id);
+    cache_shard_t* shard = table_shard(table, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    if (__atomic_load_n(&generation, __ATOMIC_ACQUIRE) != expected) {
+        pthread_mutex_unlock(&shard->lock);
+        return -1;
+    }
+
+    int i = shard_find(table, shard, hash, user);
+    if (i < 0) {
+        if (shard->count < shard->capacity) {
+            i = shard->count++;
+        } else {
+            while (shard->entries[shard->hand].referenced) {
+                shard->entries[shard->hand].referenced = 0;
+                shard->hand = (shard->hand + 1) % shard->capacity;
+            }
+            i = shard->hand;
+            shard->hand = (shard->hand + 1) % shard->capacity;
+            shard_unlink(shard, i);
+            __atomic_add_fetch(&evictions, 1, __ATOMIC_RELAXED);
+        }
+
+        cache_entry_t* entry = &shard->entries[i];
+        entry->hash = hash;
+        entry->next = shard->buckets[hash & shard->bucket_mask];
+        entry->referenced = 0;
+        shard->buckets[hash & shard->bucket_mask] = i;
+    }
+
+    shard->entries[i].user = *user;
+    pthread_mutex_unlock(&shard->lock);
+    __atomic_add_fetch(&inserts, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void table_remove(cache_table_t* table, const user_t* key) {
+    uint64_t hash = table->by_username ? hash_username(key->username) : hash_id(key->id);
+    cache_shard_t* shard = table_shard(table, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    int i = shard_find(table, shard, hash, key);
+    if (i >= 0) {
+        shard_unlink(shard, i);
+
+        // Keep entries dense: move the last one into the hole
+        int last = --shard->count;
+        if (i != last) {
+            int* link = &shard->buckets[shard->entries[last].hash & shard->bucket_mask];
+            while (*link != last) {
+                link = &shard->entries[*link].next;
+            }
+            *link = i;
+            shard->entries[i] = shard->entries[last];
+        }
+        if (shard->hand >= shard->count) shard->hand = 0;
+        __atomic_add_fetch(&invalidations, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+int user_cache_init(int capacity, int shards) {
+    if (capacity <= 0) return 0; // Disabled; every lookup misses
+    if (table_init(&users_by_id, capacity, shards, 0) < 0) return -1;
+    if (table_init(&ids_by_username, capacity, shards, 1) < 0) return -1;
+    return 0;
+}
+
+int user_cache_get_by_id(int user_id, user_t* user) {
+    if (!users_by_id.shards) return 0;
+
+    user_t key;
+    key.id = user_id;
+    int found = table_get(&users_by_id, &key, user);
+    __atomic_add_fetch(found ? &hits : &misses, 1, __ATOMIC_RELAXED);
+    return found;
+}
+
+int user_cache_get_by_username(const char* username, user_t* user) {
+    if (!ids_by_username.shards || strlen(username) >= sizeof(user->username)) return 0;
+
+    user_t key;
+    strcpy(key.username, username);
+    int found = table_get(&ids_by_username, &key, &key) && table_get(&users_by_id, &key, user);
+    __atomic_add_fetch(found ? &hits : &misses, 1, __ATOMIC_RELAXED);
+    return found;
+}
+
+uint64_t user_cache_generation(void) {
+    return __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+}
+
+// Stale rows cannot be cached: an invalidation bumps the generation before
+// taking the shard lock, so a put either sees the bump and is dropped, or
+// lands first and is then removed.
+void user_cache_put(const user_t* user, uint64_t expected) {
+    if (!users_by_id.shards) return;
+
+    if (table_put(&users_by_id, user, expected) == 0) {
+        // username -> id never changes once assigned
+        table_put(&ids_by_username, user, expected);
+    }
+}
+
+void user_cache_invalidate(int user_id) {
+    if (!users_by_id.shards) return;
+
+    __atomic_add_fetch(&generation, 1, __ATOMIC_ACQ_REL);
+    user_t key;
+    key.id = user_id;
+    table_remove(&users_by_id, &key);
+}
+
+void user_cache_forget_username(const char* username) {
+    if (!ids_by_username.shards || strlen(username) >= sizeof(((user_t*)0)->username)) return;
+
+    __atomic_add_fetch(&generation, 1, __ATOMIC_ACQ_REL);
+    user_t key;
+    strcpy(key.username, username);
+    table_remove(&ids_by_username, &key);
+}
+
+void user_cache_get_stats(user_cache_stats_t* stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->hits = __atomic_load_n(&hits, __ATOMIC_RELAXED);
+    stats->misses = __atomic_load_n(&misses, __ATOMIC_RELAXED);
+    stats->inserts = __atomic_load_n(&inserts, __ATOMIC_RELAXED);
+    stats->evictions = __atomic_load_n(&evictions, __ATOMIC_RELAXED);
+    stats->invalidations = __atomic_load_n(&invalidations, __ATOMIC_RELAXED);
+
+    if (!users_by_id.shards) return;
+    for (int i = 0; i <= users_by_id.shard_mask; i++) {
+        cache_shard_t* shard = &users_by_id.shards[i];
+        pthread_mutex_lock(&shard->lock);
+        stats->entries += shard->count;
+        stats->capacity += shard->capacity;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
@@ -0,0 +1,301 @@
+#include "server.h"
+#include <strings.h>
+#include <openssl/evp.h>
+
+#if ENABLE_WEBSOCKET
+
+// Push channel (RFC 6455). A worker answers the upgrade request; from then
+// on the connection belongs to the event loop thread alone, which reads
+// client frames and writes pushes. The registry of open sockets by user is
+// only touched on that thread, so it needs no locking. Workers publish by
+// queueing a frame on the push list and waking the loop.
+
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+#define WS_OP_CONTINUATION 0x0
+#define WS_OP_TEXT 0x1
+#define WS_OP_BINARY 0x2
+#define WS_OP_CLOSE 0x8
+#define WS_OP_PING 0x9
+#define WS_OP_PONG 0xA
+
+// One encoded server frame, shared by every socket it is sent to. Only the
+// loop thread references it once published, so the count is not atomic.
+typedef struct {
+    int refs;
+    size_t header_len;
+    unsigned char header[10];
+    size_t len;
+    char payload[];
+} ws_frame_t;
+
+typedef struct ws_push {
+    struct ws_push* next;
+    ws_frame_t* frame;
+    int count;
+    int user_ids[];
+} ws_push_t;
+
+static connection_t* registry[WEBSOCKET_REGISTRY_BUCKETS];
+static int open_sockets = 0;
+
+static ws_push_t* push_head = NULL;
+static ws_push_t* push_tail = NULL;
+static pthread_mutex_t push_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int bucket_of(int user_id) {
+    return ((unsigned int)user_id * 2654435761u) & (WEBSOCKET_REGISTRY_BUCKETS - 1);
+}
+
+static size_t encode_header(unsigned char* header, int opcode, size_t len) {
+    header[0] = 0x80 | opcode; // FIN, never fragmented
+    if (len < 126) {
+        header[1] = (unsigned char)len;
+        return 2;
+    }
+    if (len <= 0xffff) {
+        header[1] = 126;
+        header[2] = (unsigned char)(len >> 8);
+        header[3] = (unsigned char)len;
+        return 4;
+    }
+    header[1] = 127;
+    for (int i = 0; i < 8; i++) {
+        header[2 + i] = (unsigned char)((uint64_t)len >> (56 - 8 * i));
+    }
+    return 10;
+}
+
+static void release_frame(void* arg) {
+    ws_frame_t* frame = arg;
+    if (--frame->refs == 0) free(frame);
+}
+
+// Sends a small control frame; the payload is copied if it has to wait
+static void send_control(connection_t* conn, int opcode, const char* payload, size_t len) {
+    unsigned char frame[2 + 125];
+    size_t header_len = encode_header(frame, opcode, len);
+    memcpy(frame + header_len, payload, len);
+    connection_send(&conn->client, (const char*)frame, header_len + len, NULL, 0, NULL, NULL);
+}
+
+static void send_close(connection_t* conn, int status) {
+    char code[2] = { (char)(status >> 8), (char)status };
+    send_control(conn, WS_OP_CLOSE, code, sizeof(code));
+    conn->closing = 1;
+}
+
+static int header_has_token(const char* value, const char* token) {
+    return value && strcasestr(value, token) != NULL;
+}
+
+void handle_websocket(client_t* client, http_request_t* request) {
+    connection_t* conn = (connection_t*)client;
+
+    const char* key = http_request_header(request, "Sec-WebSocket-Key");
+    const char* version = http_request_header(request, "Sec-WebSocket-Version");
+    if (strcmp(request->method, "GET") != 0 ||
+        !header_has_token(http_request_header(request, "Upgrade"), "websocket") ||
+        !header_has_token(http_request_header(request, "Connection"), "upgrade") ||
+        !key || strlen(key) != 24) {
+        send_response(client, 400, "application/json", "{\"error\":\"WebSocket upgrade required\"}");
+        return;
+    }
+    if (!version || strcmp(version, "13") != 0) {
+        send_response(client, 426, "application/json", "{\"error\":\"Unsupported WebSocket version\"}");
+        return;
+    }
+
+    // Browsers cannot set headers on a WebSocket, so the token may also
+    // come in the query string
+    if (!client->authenticated) {
+        char token[TOKEN_SIZE];
+        int user_id;
+        user_role_t role;
+        if (query_param(request->query, "token", token, sizeof(token)) &&
+            verify_token(token, &user_id, &role) == 1) {
+            client->authenticated = 1;
+            client->user.id = user_id;
+            client->user.role = role;
+        }
+    }
+    if (!client->authenticated) {
+        send_response(client, 401, "application/json", "{\"error\":\"Not authenticated\"}");
+        return;
+    }
+
+    char accept_input[24 + sizeof(WEBSOCKET_GUID)];
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    char accept[32];
+    snprintf(accept_input, sizeof(accept_input), "%s%s", key, WEBSOCKET_GUID);
+    SHA1((const unsigned char*)accept_input, strlen(accept_input), digest);
+    EVP_EncodeBlock((unsigned char*)accept, digest, SHA_DIGEST_LENGTH);
+
+    char head[256];
+    int head_len = snprintf(head, sizeof(head),
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: %s\r\n"
+        "\r\n", accept);
+
+    connection_send(client, head, head_len, NULL, 0, NULL, NULL);
+    metrics_set_status(101);
+    conn->keep_alive = 1;
+    conn->websocket = 1;
+}
+
+void websocket_attach(connection_t* conn) {
+    unsigned int bucket = bucket_of(conn->client.user.id);
+    conn->ws_next = registry[bucket];
+    registry[bucket] = conn;
+    conn->ws_registered = 1;
+    __atomic_add_fetch(&open_sockets, 1, __ATOMIC_RELAXED);
+}
+
+void websocket_detach(connection_t* conn) {
+    if (!conn->ws_registered) return;
+
+    connection_t** link = &registry[bucket_of(conn->client.user.id)];
+    while (*link && *link != conn) link = &(*link)->ws_next;
+    if (*link) *link = conn->ws_next;
+    conn->ws_registered = 0;
+    __atomic_sub_fetch(&open_sockets, 1, __ATOMIC_RELAXED);
+}
+
+int websocket_active(void) {
+    return __atomic_load_n(&open_sockets, __ATOMIC_RELAXED) > 0;
+}
+
+void websocket_read(connection_t* conn) {
+    size_t pos = 0;
+
+    while (!conn->closing) {
+        unsigned char* frame = (unsigned char*)conn->in_buf + pos;
+        size_t avail = conn->in_len - pos;
+        if (avail < 2) break;
+
+        int opcode = frame[0] & 0x0f;
+        size_t len = frame[1] & 0x7f;
+        size_t header_len = 2 + (len == 126 ? 2 : len == 127 ? 8 : 0) + 4;
+
+        // Clients must mask, and no extensions are negotiated
+        if ((frame[0] & 0x70) || !(frame[1] & 0x80)) {
+            send_close(conn, 1002);
+            break;
+        }
+        if (avail < header_len) break;
+
+        if (len == 126) {
+            len = ((size_t)frame[2] << 8) | frame[3];
+        } else if (len == 127) {
+            uint64_t big = 0;
+            for (int i = 0; i < 8; i++) big = (big << 8) | frame[2 + i];
+            len = big > WEBSOCKET_MAX_FRAME_SIZE ? WEBSOCKET_MAX_FRAME_SIZE + 1 : (size_t)big;
+        }
+        if (len > WEBSOCKET_MAX_FRAME_SIZE) {
+            send_close(conn, 1009);
+            break;
+        }
+        if (avail < header_len + len) break;
+
+        const unsigned char* mask = frame + header_len - 4;
+        char* payload = (char*)frame + header_len;
+        for (size_t i = 0; i < len; i++) payload[i] ^= mask[i & 3];
+        pos += header_len + len;
+
+        switch (opcode) {
+        case WS_OP_CLOSE:
+            // Echo the status code, if any, and close once it is out
+            send_control(conn, WS_OP_CLOSE, payload, len >= 2 ? 2 : 0);
+            conn->closing = 1;
+            break;
+        case WS_OP_PING:
+            if (len > 125 || !(frame[0] & 0x80)) {
+                send_close(conn, 1002);
+                break;
+            }
+            send_control(conn, WS_OP_PONG, payload, len);
+            break;
+        case WS_OP_PONG:
+        case WS_OP_TEXT:
+        case WS_OP_BINARY:
+        case WS_OP_CONTINUATION:
+            // The channel only pushes; messages are still sent over HTTP
+            break;
+        default:
+            send_close(conn, 1002);
+            break;
+        }
+    }
+
+    if (pos) {
+        memmove(conn->in_buf, conn->in_buf + pos, conn->in_len - pos);
+        conn->in_len -= pos;
+    }
+}
+
+void websocket_publish(const int* user_ids, int count, const char* payload, size_t len) {
+    ws_frame_t* frame = malloc(sizeof(ws_frame_t) + len);
+    ws_push_t* push = malloc(sizeof(ws_push_t) + sizeof(int) * count);
+    if (!frame || !push) {
+        free(frame);
+        free(push);
+        return;
+    }
+
+    frame->refs = 1;
+    frame->header_len = encode_header(frame->header, WS_OP_TEXT, len);
+    frame->len = len;
+    memcpy(frame->payload, payload, len);
+
+    push->next = NULL;
+    push->frame = frame;
+    push->count = count;
+    memcpy(push->user_ids, user_ids, sizeof(int) * count);
+
+    pthread_mutex_lock(&push_lock);
+    if (push_tail) {
+        push_tail->next = push;
+    } else {
+        push_head = push;
+    }
+    push_tail = push;
+    pthread_mutex_unlock(&push_lock);
+
+    event_loop_wake();
+}
+
+void websocket_drain_pushes(void) {
+    pthread_mutex_lock(&push_lock);
+    ws_push_t* push = push_head;
+    push_head = push_tail = NULL;
+    pthread_mutex_unlock(&push_lock);
+
+    while (push) {
+        ws_frame_t* frame = push->frame;
+
+        for (int i = 0; i < push->count; i++) {
+            int user_id = push->user_ids[i];
+            connection_t* conn = registry[bucket_of(user_id)];
+            while (conn) {
+                // Flushing may close the connection and unlink it
+                connection_t* next = conn->ws_next;
+                if (conn->client.user.id == user_id && !conn->closing) {
+                    frame->refs++;
+                    connection_send(&conn->client, (const char*)frame->header, frame->header_len,
+                                    frame->payload, frame->len, release_frame, frame);
+                    connection_flush(conn);
+                }
+                conn = next;
+            }
+        }
+
+        ws_push_t* next = push->next;
+        release_frame(frame);
+        free(push);
+        push = next;
+    }
+}
+
+#endif
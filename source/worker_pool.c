@@ -0,0 +1,175 @@
+#include "worker_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void atomic_max_u64(uint64_t* target, uint64_t value) {
+    uint64_t current = __atomic_load_n(target, __ATOMIC_RELAXED);
+    while (value > current &&
+           !__atomic_compare_exchange_n(target, &current, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static void atomic_max_size(size_t* target, size_t value) {
+    size_t current = __atomic_load_n(target, __ATOMIC_RELAXED);
+    while (value > current &&
+           !__atomic_compare_exchange_n(target, &current, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static int try_dequeue(worker_pool_t* pool, work_slot_t* out) {
+    size_t pos = __atomic_load_n(&pool->dequeue_pos, __ATOMIC_RELAXED);
+
+    while (1) {
+        work_slot_t* slot = &pool->slots[pos & pool->mask];
+        size_t seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&pool->dequeue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *out = *slot;
+                __atomic_store_n(&slot->sequence, pos + pool->mask + 1, __ATOMIC_RELEASE);
+                return 1;
+            }
+        } else if (diff < 0) {
+            return 0; // Empty, or the producer has not published yet
+        } else {
+            pos = __atomic_load_n(&pool->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void* worker_main(void* arg) {
+    worker_pool_t* pool = arg;
+    work_slot_t item;
+
+    while (1) {
+        while (sem_wait(&pool->ready) != 0) {
+        }
+
+        // The semaphore guarantees an item is claimed for us, but its
+        // producer may still be between reserving and publishing the slot.
+        while (!try_dequeue(pool, &item)) {
+            sched_yield();
+        }
+
+        uint64_t waited = monotonic_ns() - item.enqueued_ns;
+        __atomic_add_fetch(&pool->wait_ns_total, waited, __ATOMIC_RELAXED);
+        atomic_max_u64(&pool->wait_ns_max, waited);
+
+        item.fn(item.arg);
+
+        __atomic_add_fetch(&pool->completed, 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+int worker_pool_init(worker_pool_t* pool, const char* name, int threads, size_t capacity) {
+    if (threads <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cores > 0 ? (int)cores : 1;
+    }
+
+    size_t size = 2;
+    while (size < capacity) size <<= 1;
+
+    pool->name = name;
+    pool->slots = calloc(size, sizeof(work_slot_t));
+    if (!pool->slots) return -1;
+    pool->mask = size - 1;
+    for (size_t i = 0; i < size; i++) {
+        pool->slots[i].sequence = i;
+    }
+    pool->enqueue_pos = 0;
+    pool->dequeue_pos = 0;
+
+    pool->submitted = 0;
+    pool->rejected = 0;
+    pool->completed = 0;
+    pool->wait_ns_total = 0;
+    pool->wait_ns_max = 0;
+    pool->depth_max = 0;
+
+    if (sem_init(&pool->ready, 0, 0) != 0) {
+        free(pool->slots);
+        return -1;
+    }
+
+    pool->threads = calloc(threads, sizeof(pthread_t));
+    if (!pool->threads) {
+        free(pool->slots);
+        return -1;
+    }
+
+    pool->thread_count = 0;
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, worker_main, pool) != 0) {
+            perror("Failed to start worker thread");
+            break;
+        }
+        pool->thread_count++;
+    }
+
+    return pool->thread_count > 0 ? 0 : -1;
+}
+
+int worker_pool_submit(worker_pool_t* pool, work_fn_t fn, void* arg) {
+    size_t pos = __atomic_load_n(&pool->enqueue_pos, __ATOMIC_RELAXED);
+    work_slot_t* slot;
+
+    while (1) {
+        slot = &pool->slots[pos & pool->mask];
+        size_t seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&pool->enqueue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            __atomic_add_fetch(&pool->rejected, 1, __ATOMIC_RELAXED);
+            return -1;
+        } else {
+            pos = __atomic_load_n(&pool->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->fn = fn;
+    slot->arg = arg;
+    slot->enqueued_ns = monotonic_ns();
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+
+    __atomic_add_fetch(&pool->submitted, 1, __ATOMIC_RELAXED);
+    size_t depth = pos + 1 - __atomic_load_n(&pool->dequeue_pos, __ATOMIC_RELAXED);
+    atomic_max_size(&pool->depth_max, depth);
+
+    sem_post(&pool->ready);
+    return 0;
+}
+
+void worker_pool_get_stats(worker_pool_t* pool, worker_pool_stats_t* stats) {
+    size_t head = __atomic_load_n(&pool->enqueue_pos, __ATOMIC_RELAXED);
+    size_t tail = __atomic_load_n(&pool->dequeue_pos, __ATOMIC_RELAXED);
+
+    stats->name = pool->name;
+    stats->threads = pool->thread_count;
+    stats->capacity = pool->mask + 1;
+    stats->depth = head >= tail ? head - tail : 0;
+    stats->depth_max = __atomic_load_n(&pool->depth_max, __ATOMIC_RELAXED);
+    stats->submitted = __atomic_load_n(&pool->submitted, __ATOMIC_RELAXED);
+    stats->rejected = __atomic_load_n(&pool->rejected, __ATOMIC_RELAXED);
+    stats->completed = __atomic_load_n(&pool->completed, __ATOMIC_RELAXED);
+    stats->wait_ns_total = __atomic_load_n(&pool->wait_ns_total, __ATOMIC_RELAXED);
+    stats->wait_ns_max = __atomic_load_n(&pool->wait_ns_max, __ATOMIC_RELAXED);
+}
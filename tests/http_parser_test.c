@@ -0,0 +1,102 @@
+#include "http_parser.h"
+#include <stdio.h>
+#include <string.h>
+
+// Tests for the request parser. Each case feeds a raw request to
+// http_parser_execute() in one piece and checks the result; requests that
+// are accepted are then turned into a view with http_parser_get_request().
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+// Parses len bytes of raw (which may hold NULs) and returns the parser's result
+static int parse(const char* raw, size_t len, http_parser_t* parser, char* buf, http_request_t* request) {
+    memcpy(buf, raw, len);
+    buf[len] = '\0';
+    http_parser_reset(parser);
+    int rc = http_parser_execute(parser, buf, len);
+    if (rc == 1 && http_parser_get_request(parser, buf, request) < 0) return -1;
+    return rc;
+}
+
+#define PARSE(raw) parse(raw, sizeof(raw) - 1, &parser, buf, &request)
+
+static void test_simple_request(void) {
+    http_parser_t parser;
+    http_request_t request;
+    char buf[256];
+
+    CHECK(PARSE("GET /api/users?limit=5 HTTP/1.1\r\nHost: x\r\nX-Pad:  a b \r\n\r\n") == 1);
+    CHECK(strcmp(request.method, "GET") == 0);
+    CHECK(strcmp(request.path, "/api/users") == 0);
+    CHECK(strcmp(request.query, "limit=5") == 0);
+    CHECK(request.header_count == 2);
+    CHECK(strcmp(http_request_header(&request, "x-pad"), "a b") == 0);
+    CHECK(request.keep_alive);
+}
+
+static void test_incomplete_request(void) {
+    http_parser_t parser;
+    http_request_t request;
+    char buf[256];
+
+    CHECK(PARSE("GET / HTTP/1.1\r\nHost: x\r\n") == 0);
+    CHECK(PARSE("POST / HTTP/1.1\r\nContent-Length: 4\r\n\r\nab") == 0);
+}
+
+static void test_nul_and_control_bytes(void) {
+    http_parser_t parser;
+    http_request_t request;
+    char buf[256];
+
+    CHECK(PARSE("GET /a\0b HTTP/1.1\r\nHost: x\r\n\r\n") == -400);
+    CHECK(PARSE("G\0T / HTTP/1.1\r\nHost: x\r\n\r\n") == -400);
+    CHECK(PARSE("GET /a\x01 HTTP/1.1\r\nHost: x\r\n\r\n") == -400);
+    CHECK(PARSE("GET /a\x7f HTTP/1.1\r\nHost: x\r\n\r\n") == -400);
+    CHECK(PARSE("GET / HTTP/1.1\r\nHo\0st: x\r\n\r\n") == -400);
+    CHECK(PARSE("GET / HTTP/1.1\r\n\0: x\r\n\r\n") == -400);
+    CHECK(PARSE("GET / HTTP/1.1\r\nHost: a\0b\r\n\r\n") == -400);
+    CHECK(PARSE("GET / HTTP/1.1\r\nHost: a\rb\r\n\r\n") == -400);
+    CHECK(PARSE("GET / HTTP/1.1\r\nHost:\ta\tb\r\n\r\n") == 1);
+}
+
+static void test_malformed_framing(void) {
+    http_parser_t parser;
+    http_request_t request;
+    char buf[256];
+
+    CHECK(PARSE("GET / HTTP/1.1\r\nContent-Length: 1\r\nContent-Length: 2\r\n\r\nab") == -400);
+    CHECK(PARSE("GET / HTTP/1.1\r\nTransfer-Encoding: gzip\r\n\r\n") == -501);
+    CHECK(PARSE("GET / HTTP/1.1\r\n folded\r\n\r\n") == -400);
+    CHECK(PARSE("GET / HTTP/2.0\r\n\r\n") == -400);
+}
+
+static void test_chunked_body(void) {
+    http_parser_t parser;
+    http_request_t request;
+    char buf[256];
+
+    CHECK(PARSE("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n3\r\nabc\r\n2\r\nde\r\n0\r\n\r\n") == 1);
+    CHECK(request.body_len == 5 && memcmp(request.body, "abcde", 5) == 0);
+}
+
+int main(void) {
+    test_simple_request();
+    test_incomplete_request();
+    test_nul_and_control_bytes();
+    test_malformed_framing();
+    test_chunked_body();
+
+    if (failures) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("http_parser: all checks passed\n");
+    return 0;
+}